@@ -0,0 +1,252 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "common.h"
+
+using namespace std;
+
+/*
+ * Speed cache: one line per fixture, "host clk,data,mclr devid half_ns".
+ * Kept next to the server mode temporary files.
+ */
+#define AUTOTUNE_CACHE		"/var/tmp/picberry-autotune"
+
+#define AUTOTUNE_MAX_NS		1000	/* the old delay_us(1) per phase */
+#define AUTOTUNE_STEP_NS	10		/* stop the search below this */
+#define AUTOTUNE_ID_READS	8		/* device ID reads per candidate */
+#define AUTOTUNE_WORDS		256		/* flash locations read back per candidate */
+
+static char fixture_key[128];
+static bool fixture_tuned = false;
+
+static void make_key(Pic *pic)
+{
+	char host[64];
+
+	if (gethostname(host, sizeof(host)) != 0)
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = '\0';
+
+	snprintf(fixture_key, sizeof(fixture_key), "%s %d,%d,%d 0x%08x",
+			host, pic_clk, pic_data, pic_mclr, pic->device_id);
+}
+
+/* Return the cached half period of this fixture, -1 if there is none */
+static int cache_lookup(void)
+{
+	FILE *fp;
+	char line[192];
+	size_t keylen = strlen(fixture_key);
+	int half_ns = -1;
+
+	fp = fopen(AUTOTUNE_CACHE, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (strncmp(line, fixture_key, keylen) == 0 && line[keylen] == ' ')
+			half_ns = atoi(&line[keylen + 1]);
+
+	fclose(fp);
+	return half_ns;
+}
+
+/* Replace the entry of this fixture (half_ns < 0: just remove it) */
+static void cache_store(int half_ns)
+{
+	FILE *fp, *tmp;
+	char line[192];
+	size_t keylen = strlen(fixture_key);
+
+	tmp = fopen(AUTOTUNE_CACHE ".new", "w");
+	if (tmp == NULL) {
+		perror("Cannot write " AUTOTUNE_CACHE);
+		return;
+	}
+
+	fp = fopen(AUTOTUNE_CACHE, "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL)
+			if (strncmp(line, fixture_key, keylen) != 0 || line[keylen] != ' ')
+				fputs(line, tmp);
+		fclose(fp);
+	}
+
+	if (half_ns >= 0)
+		fprintf(tmp, "%s %d\n", fixture_key, half_ns);
+
+	fclose(tmp);
+	rename(AUTOTUNE_CACHE ".new", AUTOTUNE_CACHE);
+}
+
+/*
+ * A verify failure at a tuned rate invalidates the cache entry, so that the
+ * next --autotune run searches again instead of reusing the same speed.
+ * The drivers bail out with exit(), hence the exit handler.
+ */
+static void verify_failed(int status, void *arg)
+{
+	if (fixture_tuned && (status == 32 || status == 34 || status == 35)) {
+		fprintf(stderr, "Verify failed at the tuned PGC rate, "
+				"it will be tuned again on the next --autotune run.\n");
+		cache_store(-1);
+	}
+}
+
+/* Read the device ID, dropping the memory image of the previous read */
+static bool read_id(Pic *pic)
+{
+	pic->mem.clear();
+	return pic->read_device_id();
+}
+
+/*
+ * Read the first AUTOTUNE_WORDS locations of flash into words, the erased
+ * ones included: on a blank part the erased words are all there is to
+ * compare. A location the read did not return is 0xFFFFFFFF, which no
+ * read matches; the window is cut at the end of a smaller flash.
+ */
+static void read_window(Pic *pic, uint32_t *words)
+{
+	int fulldump = flags.fulldump;
+	uint32_t i;
+
+	pic->mem.clear();
+	flags.fulldump = 1;
+	pic->read((char *)"/dev/null", 0, AUTOTUNE_WORDS);
+	flags.fulldump = fulldump;
+
+	for (i = 0; i < AUTOTUNE_WORDS; i++)
+		if (i >= pic->mem.code_memory_size)
+			words[i] = 0;
+		else
+			words[i] = pic->mem.filled[i] ? pic->mem.location[i] : 0xFFFFFFFF;
+}
+
+/* Check the fixture at the given half period against the reference words */
+static bool try_rate(Pic *pic, int half_ns, const uint32_t *reference)
+{
+	uint32_t words[AUTOTUNE_WORDS];
+	uint32_t id = pic->device_id;
+	uint16_t rev = pic->device_rev;
+	int i;
+
+	flags.pgc_half_ns = half_ns;
+
+	for (i = 0; i < AUTOTUNE_ID_READS; i++)
+		if (!read_id(pic) || pic->device_id != id || pic->device_rev != rev) {
+			pic->device_id = id;
+			pic->device_rev = rev;
+			return false;
+		}
+
+	if (reference == NULL)
+		return true;
+
+	read_window(pic, words);
+	return memcmp(words, reference, sizeof(words)) == 0;
+}
+
+/*
+ * Binary search the shortest PGC half period at which repeated device ID
+ * reads and a read back of the start of flash still agree with the values
+ * obtained at AUTOTUNE_MAX_NS. The result is cached per fixture (host, GPIO
+ * triplet and device ID); a cached value is only checked with device ID
+ * reads before being used.
+ */
+void autotune(Pic *pic)
+{
+	uint32_t reference[AUTOTUNE_WORDS];
+	int cached, lo, hi, mid, i;
+
+	make_key(pic);
+	on_exit(verify_failed, NULL);
+
+	cached = cache_lookup();
+	if (cached >= 0) {
+		if (try_rate(pic, cached, NULL)) {
+			fprintf(stderr, "Autotune: cached PGC half period %dns\n", cached);
+			fixture_tuned = true;
+			return;
+		}
+		fprintf(stderr, "Autotune: cached rate does not work anymore.\n");
+	}
+
+	cerr << "Autotune: searching the PGC rate..." << endl;
+
+	/* reference values at the slowest rate */
+	if (!try_rate(pic, AUTOTUNE_MAX_NS, NULL)) {
+		cerr << "Autotune: unreliable even at " << AUTOTUNE_MAX_NS
+			 << "ns, using the timing profile." << endl;
+		flags.pgc_half_ns = -1;
+		read_id(pic);
+		return;
+	}
+	read_window(pic, reference);
+	for (i = 0; i < AUTOTUNE_WORDS; i++)
+		if (reference[i] == 0xFFFFFFFF)
+			break;
+	if (i < AUTOTUNE_WORDS) {
+		cerr << "Autotune: the read back is incomplete, "
+			 << "using the timing profile." << endl;
+		flags.pgc_half_ns = -1;
+		read_id(pic);
+		return;
+	}
+
+	/*
+	 * hi always passes, lo is the fastest candidate not yet excluded: the
+	 * search starts at the shortest phase of the family, delay_ns() never
+	 * goes below it anyway.
+	 */
+	lo = pic->pgc_min_ns();
+	hi = AUTOTUNE_MAX_NS;
+	while (hi - lo > AUTOTUNE_STEP_NS) {
+		mid = (lo + hi) / 2;
+		if (try_rate(pic, mid, reference))
+			hi = mid;
+		else
+			lo = mid + 1;
+		if (flags.debug)
+			fprintf(stderr, "\nAutotune: %dns..%dns\n", lo, hi);
+	}
+
+	/* keep some margin above the edge of the working region */
+	hi += hi / 4 + AUTOTUNE_STEP_NS;
+	if (hi > AUTOTUNE_MAX_NS)
+		hi = AUTOTUNE_MAX_NS;
+
+	flags.pgc_half_ns = hi;
+	fixture_tuned = true;
+	cache_store(hi);
+
+	/* leave a clean memory image for the selected operation */
+	read_id(pic);
+
+	fprintf(stderr, "\nAutotune: PGC half period %dns\n", hi);
+}
@@ -0,0 +1,381 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "common.h"
+#include "devices/dspic33f.h"
+#include "devices/dspic33e.h"
+#include "devices/pic10f322.h"
+#include "devices/pic16f183xx.h"
+#include "devices/pic18fj.h"
+#include "devices/pic24fjxxxga0xx.h"
+#include "devices/pic24fjxxxga3xx.h"
+#include "devices/pic24fjxxga1xx_gb0xx.h"
+#include "devices/pic32.h"
+#include "devices/pic24fjxxxga1_gb1.h"
+#include "devices/pic24fxxka1xx.h"
+#include "devices/pic24fjxxxxgx6xx.h"
+#include "devices/pic24fxxklxxx.h"
+#include "devices/dspic33epxxgs50x.h"
+#include "devices/dspic33ckxxmp10x.h"
+
+/*
+ * picberry-bench: micro-benchmarks of the hot paths (delays, GPIO macros,
+ * driver command/read primitives, hex file parsing and writing), printed
+ * as one JSON object on stdout so that runs on different releases and host
+ * boards can be compared by a script. Built with "make bench".
+ */
+
+#if defined(BOARD_A10)
+#define BENCH_HOST		"a10"
+#elif defined(BOARD_RPI)
+#define BENCH_HOST		"raspberrypi"
+#elif defined(BOARD_RPI2)
+#define BENCH_HOST		"raspberrypi2"
+#elif defined(BOARD_RPI4)
+#define BENCH_HOST		"raspberrypi4"
+#elif defined(BOARD_AM335X)
+#define BENCH_HOST		"am335x"
+#elif defined(BOARD_SIM)
+#define BENCH_HOST		"sim"
+#endif
+
+#define DELAY_RUNS		1000		/* delay_us() calls per duration */
+#define GPIO_TOGGLES	(1 << 20)	/* SET/CLR pairs */
+#define GPIO_READS		(1 << 20)
+#define DRIVER_OPS		20000		/* commands and reads per driver */
+#define INHX_TMPFILE	"/var/tmp/picberry-bench.hex"
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Cost of a now_ns() pair, subtracted from the single-call measurements */
+static uint64_t clock_overhead(void)
+{
+	uint64_t t0, best = ~0ULL;
+	int i;
+
+	for (i = 0; i < DELAY_RUNS; i++) {
+		t0 = now_ns();
+		t0 = now_ns() - t0;
+		if (t0 < best)
+			best = t0;
+	}
+	return best;
+}
+
+static void bench_delay(uint64_t overhead)
+{
+	static const unsigned int durations[] = {0, 1, 10, 100};
+	uint64_t t0, t, sum, min, max;
+	unsigned int d;
+	int i;
+
+	printf("  \"delay_us\": [\n");
+	for (d = 0; d < sizeof(durations) / sizeof(durations[0]); d++) {
+		sum = 0;
+		min = ~0ULL;
+		max = 0;
+		for (i = 0; i < DELAY_RUNS; i++) {
+			t0 = now_ns();
+			delay_us(durations[d]);
+			t = now_ns() - t0;
+			t = t > overhead ? t - overhead : 0;
+			sum += t;
+			if (t < min)
+				min = t;
+			if (t > max)
+				max = t;
+		}
+		printf("    {\"us\": %u, \"runs\": %d, \"mean_ns\": %llu, "
+				"\"min_ns\": %llu, \"max_ns\": %llu, \"error_ns\": %lld}%s\n",
+				durations[d], DELAY_RUNS,
+				(unsigned long long)(sum / DELAY_RUNS),
+				(unsigned long long)min, (unsigned long long)max,
+				(long long)(sum / DELAY_RUNS) - durations[d] * 1000LL,
+				d + 1 < sizeof(durations) / sizeof(durations[0]) ? "," : "");
+	}
+	printf("  ],\n");
+}
+
+/* Raw PGC edge rate and PGD sample rate through the GPIO macros */
+static void bench_gpio(void)
+{
+	uint64_t t0, toggle_ns, read_ns;
+	volatile uint32_t sink = 0;
+	int i;
+
+	GPIO_CLR(pic_clk);
+	t0 = now_ns();
+	for (i = 0; i < GPIO_TOGGLES; i++) {
+		GPIO_SET(pic_clk);
+		GPIO_CLR(pic_clk);
+	}
+	toggle_ns = now_ns() - t0;
+
+	pgd_in();
+	t0 = now_ns();
+	for (i = 0; i < GPIO_READS; i++)
+		sink += GPIO_LEV(pic_data);
+	read_ns = now_ns() - t0;
+	pgd_out();
+	(void)sink;
+
+	printf("  \"gpio\": {\"edges\": %d, \"ns_per_edge\": %.2f, "
+			"\"edges_per_s\": %.0f, \"reads\": %d, \"ns_per_read\": %.2f},\n",
+			2 * GPIO_TOGGLES, (double)toggle_ns / (2 * GPIO_TOGGLES),
+			2e9 * GPIO_TOGGLES / toggle_ns,
+			GPIO_READS, (double)read_ns / GPIO_READS);
+}
+
+/*
+ * The command and read primitives of the drivers are protected: each
+ * bench_* class exposes them as cmd() and data(). The commands are NOPs
+ * (or their closest equivalent), the reads clock in whatever is on PGD.
+ */
+static const timing_param no_delay(0, 0, 0);
+
+#define BENCH_ICSP(cls, ctor, cmd_expr, data_expr) \
+	struct bench_##cls : cls { \
+		bench_##cls() : cls ctor {} \
+		void cmd(void) { cmd_expr; } \
+		uint32_t data(void) { return data_expr; } \
+	}
+
+BENCH_ICSP(dspic33f, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(dspic33e, (SF_DSPIC33E), send_cmd(0x000000), read_data());
+BENCH_ICSP(dspic33epxxgs50x, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(dspic33ckxxmp10x, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic24fjxxxga0xx, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic24fjxxxga3xx, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic24fjxxga1xx_gb0xx, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic24fjxxxga1_gb1, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic24fjxxxxgx6xx, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic24fxxka1xx, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic24fxxklxxx, (), send_cmd(0x000000), read_data());
+BENCH_ICSP(pic10f322, (), send_cmd(0x06, no_delay), read_data());
+BENCH_ICSP(pic16f183xx, (), send_cmd(0x00, no_delay), read_data());
+BENCH_ICSP(pic18fj, (), send_cmd(0x00), read_data());
+BENCH_ICSP(pic32, (0), SendCommand(0x07), XferData(32, 0));
+
+template <class D>
+static void bench_driver(const char *family, bool last)
+{
+	D pic;
+	uint64_t t0, cmd_ns, data_ns;
+	volatile uint32_t sink = 0;
+	int i;
+
+	t0 = now_ns();
+	for (i = 0; i < DRIVER_OPS; i++)
+		pic.cmd();
+	cmd_ns = now_ns() - t0;
+
+	t0 = now_ns();
+	for (i = 0; i < DRIVER_OPS; i++)
+		sink += pic.data();
+	data_ns = now_ns() - t0;
+	(void)sink;
+
+	printf("    {\"family\": \"%s\", \"ops\": %d, \"cmd_us\": %.3f, "
+			"\"cmds_per_s\": %.0f, \"read_us\": %.3f, \"reads_per_s\": %.0f}%s\n",
+			family, DRIVER_OPS,
+			cmd_ns / 1000.0 / DRIVER_OPS, 1e9 * DRIVER_OPS / cmd_ns,
+			data_ns / 1000.0 / DRIVER_OPS, 1e9 * DRIVER_OPS / data_ns,
+			last ? "" : ",");
+}
+
+static void bench_drivers(void)
+{
+	printf("  \"drivers\": [\n");
+	bench_driver<bench_dspic33f>("dspic33f", false);
+	bench_driver<bench_dspic33e>("dspic33e", false);
+	bench_driver<bench_dspic33epxxgs50x>("dspic33epxxgs50x", false);
+	bench_driver<bench_dspic33ckxxmp10x>("dspic33ckxxmp10x", false);
+	bench_driver<bench_pic24fjxxxga0xx>("pic24fjxxxga0xx", false);
+	bench_driver<bench_pic24fjxxxga3xx>("pic24fjxxxga3xx", false);
+	bench_driver<bench_pic24fjxxga1xx_gb0xx>("pic24fjxxga1xx", false);
+	bench_driver<bench_pic24fjxxxga1_gb1>("pic24fjxxxga1xx", false);
+	bench_driver<bench_pic24fjxxxxgx6xx>("pic24fjxxxxgx6xx", false);
+	bench_driver<bench_pic24fxxka1xx>("pic24fxxka1xx", false);
+	bench_driver<bench_pic24fxxklxxx>("pic24fxxklxxx", false);
+	bench_driver<bench_pic10f322>("pic10f322", false);
+	bench_driver<bench_pic16f183xx>("pic16f183xx", false);
+	bench_driver<bench_pic18fj>("pic18fj", false);
+	bench_driver<bench_pic32>("pic32", true);
+	printf("  ],\n");
+}
+
+/*
+ * Write and parse back fully filled synthetic images, from a small 8-bit
+ * part up to a 2MB PIC32MZ. The written file is parsed back into a second
+ * image and compared, so that a fast but broken parser does not go
+ * unnoticed.
+ */
+static void bench_inhx(void)
+{
+	static const uint32_t sizes[] = {4096, 32768, 262144, 2097152};
+	memory src, dst;
+	uint64_t t0, write_ns, read_ns;
+	uint32_t i, seed = 0x12345678;
+	unsigned int d, filled;
+	bool match;
+	FILE *fp;
+	long file_bytes;
+
+	printf("  \"inhx\": [\n");
+	for (d = 0; d < sizeof(sizes) / sizeof(sizes[0]); d++) {
+		src.program_memory_size = dst.program_memory_size = sizes[d] / 2;
+		for (i = 0; i < sizes[d] / 2; i++) {
+			seed = seed * 1103515245 + 12345;
+			src.location[i] = seed >> 16;
+			src.filled[i] = true;
+		}
+
+		t0 = now_ns();
+		write_inhx(&src, (char *)INHX_TMPFILE);
+		write_ns = now_ns() - t0;
+
+		t0 = now_ns();
+		filled = read_inhx((char *)INHX_TMPFILE, &dst);
+		read_ns = now_ns() - t0;
+
+		match = filled == sizes[d] / 2;
+		for (i = 0; i < sizes[d] / 2 && match; i++)
+			match = src.location[i] == dst.location[i];
+
+		file_bytes = 0;
+		fp = fopen(INHX_TMPFILE, "r");
+		if (fp != NULL) {
+			fseek(fp, 0, SEEK_END);
+			file_bytes = ftell(fp);
+			fclose(fp);
+		}
+
+		printf("    {\"image_bytes\": %u, \"hex_bytes\": %ld, "
+				"\"write_ms\": %.3f, \"write_mb_s\": %.2f, "
+				"\"read_ms\": %.3f, \"read_mb_s\": %.2f, \"match\": %s}%s\n",
+				sizes[d], file_bytes,
+				write_ns / 1e6, sizes[d] * 1e3 / write_ns,
+				read_ns / 1e6, sizes[d] * 1e3 / read_ns,
+				match ? "true" : "false",
+				d + 1 < sizeof(sizes) / sizeof(sizes[0]) ? "," : "");
+
+		src.clear();
+		dst.clear();
+	}
+	printf("  ]\n");
+	unlink(INHX_TMPFILE);
+}
+
+static void bench_usage(void)
+{
+	printf("picberry-bench v%s - micro-benchmarks, JSON on stdout\n\n"
+			"Usage: picberry-bench [options]\n"
+			"       -g, --gpio=PGC,PGD,MCLR    GPIO selection [default: %d,%d,%d]\n"
+			"       --timing=spec|fast|safe    ICSP timing profile [default: spec]\n"
+			"       -h, --help                 this help\n\n"
+			"The driver benchmarks toggle the selected pins: leave them "
+			"unconnected\nor connected to a target held in reset.\n",
+			VERSION, DEFAULT_PIC_CLK, DEFAULT_PIC_DATA, DEFAULT_PIC_MCLR);
+}
+
+int main(int argc, char *argv[])
+{
+	char hostname[64];
+	uint64_t overhead;
+	int opt, option_index = 0;
+
+	static struct option long_options[] = {
+			{"help",        no_argument,       0,           'h'},
+			{"gpio",        required_argument, 0,           'g'},
+			{"timing",      required_argument, 0,           'T'},
+			{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "hg:", long_options,
+							  &option_index)) != -1) {
+		switch (opt) {
+			case 'g':
+				if (sscanf(optarg, "%d,%d,%d",
+						   &pic_clk, &pic_data, &pic_mclr) != 3) {
+					fprintf(stderr, "GPIO selection must be PGC,PGD,MCLR\n");
+					return 3;
+				}
+				break;
+			case 'T':
+				if (strcmp(optarg, "fast") == 0)
+					flags.timing = TIMING_FAST;
+				else if (strcmp(optarg, "safe") == 0)
+					flags.timing = TIMING_SAFE;
+				else if (strcmp(optarg, "spec") == 0)
+					flags.timing = TIMING_SPEC;
+				else {
+					fprintf(stderr, "Unknown timing profile %s\n", optarg);
+					return 3;
+				}
+				break;
+			default:
+				bench_usage();
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (gethostname(hostname, sizeof(hostname)) != 0)
+		strcpy(hostname, "localhost");
+	hostname[sizeof(hostname) - 1] = '\0';
+
+	delay_init();
+	setup_io();
+	overhead = clock_overhead();
+
+	printf("{\n");
+	printf("  \"version\": \"%s\",\n", VERSION);
+	printf("  \"host\": \"%s\",\n", BENCH_HOST);
+	printf("  \"hostname\": \"%s\",\n", hostname);
+	printf("  \"timing\": \"%s\",\n", flags.timing == TIMING_FAST ? "fast" :
+			(flags.timing == TIMING_SAFE ? "safe" : "spec"));
+	printf("  \"clock_overhead_ns\": %llu,\n", (unsigned long long)overhead);
+	fflush(stdout);
+
+	bench_delay(overhead);
+	fflush(stdout);
+	bench_gpio();
+	fflush(stdout);
+	bench_drivers();
+	fflush(stdout);
+	bench_inhx();
+	printf("}\n");
+
+	close_io();
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "common.h"
+
+/*
+ * Channel mode ("--channel=PGC,PGD,MCLR:family:file.hex", repeated): one
+ * process writes several independent targets at once, each on its own
+ * worker thread pinned to its own CPU. The pin globals are thread_local,
+ * so the drivers run unchanged in every worker; the GPIO macros are safe
+ * to use concurrently on the BCM hosts, where only the direction registers
+ * need a read-modify-write (see gpio_rmw).
+ */
+#define CHANNEL_MAX		8
+
+struct channel {
+	int clk, data, mclr;
+	char family[32];
+	char *hexfile;
+	int cpu;
+	bool started;
+	int result;			/* exit code of the job */
+	char name[32];		/* device name, for the summary */
+	pthread_t thread;
+};
+
+static struct channel channels[CHANNEL_MAX];
+int channel_count = 0;
+
+std::atomic_flag gpio_rmw = ATOMIC_FLAG_INIT;
+
+/* the channel of the calling worker, NULL in the main thread */
+static thread_local struct channel *self = NULL;
+
+/* the simulated target is a single model, not one per channel */
+#if defined(GPIO_SET_MASK) && !defined(GPIO_SIMULATED)
+static bool pin_used(struct channel *ch, int pin)
+{
+	return ch->clk == pin || ch->data == pin || ch->mclr == pin;
+}
+
+/* Parse one "PGC,PGD,MCLR:family:file.hex" channel */
+bool channel_parse(const char *spec)
+{
+	struct channel *ch;
+	int pos = 0, i;
+
+	if (channel_count == CHANNEL_MAX) {
+		fprintf(stderr, "At most %d channels are supported.\n", CHANNEL_MAX);
+		return false;
+	}
+
+	ch = &channels[channel_count];
+	if (sscanf(spec, "%d,%d,%d:%31[^:]:%n", &ch->clk, &ch->data, &ch->mclr,
+			ch->family, &pos) != 4 || pos == 0 || spec[pos] == '\0')
+		return false;
+
+	if (ch->clk == ch->data || ch->clk == ch->mclr || ch->data == ch->mclr) {
+		fprintf(stderr, "Channel %d uses the same GPIO for two signals.\n",
+				channel_count + 1);
+		return false;
+	}
+
+	/* a pin can belong to one channel only */
+	for (i = 0; i < channel_count; i++)
+		if (pin_used(&channels[i], ch->clk) || pin_used(&channels[i], ch->data) ||
+			pin_used(&channels[i], ch->mclr)) {
+			fprintf(stderr, "Channel %d shares a GPIO with channel %d.\n",
+					channel_count + 1, i + 1);
+			return false;
+		}
+
+	ch->hexfile = strdup(&spec[pos]);
+	channel_count++;
+	return true;
+}
+#else
+bool channel_parse(const char *spec)
+{
+	fprintf(stderr, "Channel mode is not supported on this host.\n");
+	return false;
+}
+#endif
+
+/* thrown by fatal() in a channel worker, caught by channel_worker() */
+struct channel_abort {
+	int code;
+};
+
+/*
+ * Bail out of a driver: exit() in the main thread, end of the job in a
+ * channel worker (the other channels go on). The worker unwinds back to
+ * channel_worker(), which takes the target out of program mode and frees
+ * the driver as after a normal job.
+ */
+void fatal(int code)
+{
+	if (self == NULL)
+		exit(code);
+
+	throw channel_abort{code};
+}
+
+static void *channel_worker(void *arg)
+{
+	struct channel *ch = (struct channel *)arg;
+	int n = ch - channels + 1;
+	Pic *pic;
+
+	self = ch;
+	pic_clk = ch->clk;
+	pic_data = ch->data;
+	pic_mclr = ch->mclr;
+
+	setup_pins();
+
+	pic = pic_new(ch->family);
+
+	try {
+		pic->enter_program_mode();
+		pic->setup_pe();
+
+		if (pic->read_device_id()) {
+			strcpy(ch->name, pic->name);
+			fprintf(stdout, "[ch%d] %s (0x%08x) on CPU %d, writing %s\n",
+					n, pic->name, pic->device_id, ch->cpu, ch->hexfile);
+			pic->write(ch->hexfile);
+			edge_stats_report(ch->name);
+		}
+		else {
+			fprintf(stdout, "[ch%d] ERROR: unknown/unsupported device (ID 0x%x)\n",
+					n, pic->device_id);
+			ch->result = 5;
+		}
+	}
+	catch (const channel_abort &abort) {
+		ch->result = abort.code;
+	}
+
+	pic->exit_program_mode();
+	release_pins();
+
+	pic->mem.clear();
+	delete pic;
+
+	return NULL;
+}
+
+/*
+ * Run the job of every channel on its own thread, pinned to its own CPU
+ * starting from the last one (as --realtime does), and wait for all of
+ * them. Returns 0 if every job succeeded, the first failure otherwise.
+ */
+int channels_run(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int i, ret = 0;
+
+	for (i = 0; i < channel_count; i++) {
+		struct channel *ch = &channels[i];
+		Pic *pic = pic_new(ch->family);
+
+		if (pic == NULL) {
+			fprintf(stderr, "ERROR: channel %d: unknown PIC family %s.\n",
+					i + 1, ch->family);
+			return 4;
+		}
+		delete pic;
+	}
+
+	if (channel_count > ncpus)
+		fprintf(stderr, "Warning: %d channels on %ld CPUs, "
+				"some channels will share a CPU.\n", channel_count, ncpus);
+
+	for (i = 0; i < channel_count; i++) {
+		struct channel *ch = &channels[i];
+
+		ch->cpu = ncpus - 1 - (i % ncpus);
+		ch->result = 0;
+		ch->started = false;
+		strcpy(ch->name, "-");
+
+		pthread_attr_init(&attr);
+		CPU_ZERO(&cpus);
+		CPU_SET(ch->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+		if (pthread_create(&ch->thread, &attr, channel_worker, ch) == 0)
+			ch->started = true;
+		else {
+			perror("Cannot start channel worker");
+			ch->result = 6;
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	for (i = 0; i < channel_count; i++)
+		if (channels[i].started)
+			pthread_join(channels[i].thread, NULL);
+
+	fprintf(stdout, "\nChannel results:\n");
+	for (i = 0; i < channel_count; i++) {
+		struct channel *ch = &channels[i];
+
+		fprintf(stdout, "  ch%d (PGC %d, PGD %d, MCLR %d) %-20s %s",
+				i + 1, ch->clk, ch->data, ch->mclr, ch->name,
+				ch->result ? "FAILED" : "OK");
+		if (ch->result)
+			fprintf(stdout, " (%d)", ch->result);
+		fprintf(stdout, "\n");
+
+		if (ch->result && !ret)
+			ret = ch->result;
+	}
+
+	return ret;
+}
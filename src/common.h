@@ -21,6 +21,8 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
+#include <atomic>
+
 #if defined(BOARD_A10)
 #include "hosts/a10.h"
 #elif defined(BOARD_RPI)
@@ -31,8 +33,21 @@
 #include "hosts/rpi4.h"
 #elif defined(BOARD_AM335X)
 #include "hosts/am335x.h"
+#elif defined(BOARD_SIM)
+#include "hosts/sim.h"
 #endif
 
+/* GPIO registers are mapped from /dev/mem, unless the host says otherwise */
+#if defined(GPIO_GPIOMEM) && !defined(GPIO_DEVICE)
+#error "/dev/gpiomem is only available on the Raspberry Pi"
+#endif
+#ifndef GPIO_DEVICE
+#define GPIO_DEVICE        "/dev/mem"
+#define GPIO_MAP_BASE      GPIO_BASE
+#endif
+
+#include "timing.h"
+#include "edgestats.h"
 #include "devices/device.h"
 
 using namespace std;
@@ -40,25 +55,75 @@ using namespace std;
 #define VERSION "0.4.0"
 
 /* Low-level functions */
+void delay_init(void);
+void delay_ns(uint32_t howLong);
 void delay_us(unsigned int howLong);
+uint64_t delay_ticks(void);
+uint64_t delay_ticks_to_ns(uint64_t ticks);
 void setup_io(void);
 void close_io(void);
+void setup_pins(void);
+void release_pins(void);
 
 /* inhx.cpp functions */
 unsigned int read_inhx(char *infile, memory *mem, uint32_t offset=0);
+unsigned int read_inhx_erase(char *infile, Pic *pic, uint32_t offset=0);
+uint32_t read_inhx_row(memory *mem, uint32_t addr, uint32_t row);
+unsigned int read_inhx_wait(memory *mem, unsigned int filled_locations);
 void write_inhx(memory *mem, char *outfile, uint32_t offset=0);
+struct hex_writer;
+hex_writer *hex_open(char *outfile, uint32_t offset, bool extended);
+void hex_put(hex_writer *w, uint32_t index, uint16_t data);
+void hex_close(hex_writer *w);
+
+/* autotune.cpp functions */
+void autotune(Pic *pic);
+
+/* realtime.cpp functions */
+void realtime_enter(int cpu);
+void realtime_prefault(memory *mem);
+void realtime_exit(void);
+void realtime_helper(void);
+
+/* channels.cpp functions */
+bool channel_parse(const char *spec);
+int channels_run(void);
+void fatal(int code) __attribute__((noreturn));
 
 /* Runtime Functions */
 void pic_reset(bool silent = false);
 
 /* main functions */
+Pic *pic_new(const char *family);
 void usage(void);
 void server_mode(int port);
 uint8_t send_file(char * filename);
 uint8_t receive_file(int sock, char * filename);
 
 extern volatile uint32_t *gpio;
-extern int pic_clk, pic_data, pic_mclr;
+extern thread_local int pic_clk, pic_data, pic_mclr;
+extern int channel_count;
+
+/*
+ * The GPIO registers written with a read-modify-write (GPFSELn on the BCM
+ * hosts) are shared by all the pins of a bank: with several --channel
+ * workers, the direction macros take this lock around the update. A
+ * single target never contends, so it skips the atomic altogether
+ * (channel_count is fixed before any worker starts).
+ */
+extern std::atomic_flag gpio_rmw;
+
+static inline void gpio_rmw_lock(void)
+{
+    if (channel_count)
+        while (gpio_rmw.test_and_set(std::memory_order_acquire));
+}
+
+static inline void gpio_rmw_unlock(void)
+{
+    if (channel_count)
+        gpio_rmw.clear(std::memory_order_release);
+}
 
 struct flags_struct {
    int debug = 0;
@@ -67,9 +132,44 @@ struct flags_struct {
    int boot_only = 0;
    int program_only = 0;
    int fulldump = 0;
+   int diff = 0;            /* reprogram only the pages that changed (PIC32) */
+   int hex_record_size = 16; /* data bytes per record of the hex files written */
+   int stream = 0;          /* parse the hex file while the chip is erased */
    int unattended = 0;
+   int timing = TIMING_SPEC;
+   int autotune = 0;
+   int realtime = 0;
+   int realtime_cpu = -1;   /* -1: last online CPU */
+   int pgc_half_ns = -1;    /* tuned PGC half period, -1: use the profile */
+   int nope = 0;            /* never use a Programming Executive */
+   const char *pe_file = 0; /* PE image to download when none is resident */
 };
 
 extern struct flags_struct flags;
 
+/* Wait for a timing parameter in the selected speed grade */
+static inline void delay_ns(const timing_param &p)
+{
+    delay_ns(TIMING(p));
+}
+
+/*
+ * Wait for a PGC phase, at the tuned rate when --autotune found one, but
+ * never shorter than the minimum of the phase
+ */
+static inline void delay_ns(const pgc_param &p)
+{
+    uint32_t t = TIMING(p);
+
+    if (flags.pgc_half_ns >= 0)
+        t = (uint32_t)flags.pgc_half_ns > p.half_min ?
+                (uint32_t)flags.pgc_half_ns : p.half_min;
+    delay_ns(t);
+}
+
+#include "vcd.h"
+#include "gang.h"
+#include "shift.h"
+#include "readback.h"
+
 #endif /* COMMON_H_ */
@@ -0,0 +1,243 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <iostream>
+
+#include "common.h"
+
+using namespace std;
+
+/*
+ * Time sources, selected at compile time:
+ *  - ARM generic timer virtual counter (AArch64, and the ARMv7 cores of
+ *    the BCM2836/7/2711 when built for raspberrypi2/raspberrypi4);
+ *  - x86 TSC (only useful on development machines);
+ *  - CLOCK_MONOTONIC_RAW through the vDSO, always available as fallback.
+ */
+#if defined(__aarch64__)
+#define HAVE_TS_COUNTER
+#define TS_COUNTER_NAME "cntvct_el0"
+static inline uint64_t ts_counter(void)
+{
+	uint64_t v;
+	__asm__ volatile("isb; mrs %0, cntvct_el0" : "=r" (v) :: "memory");
+	return v;
+}
+static inline uint64_t ts_counter_freq(void)
+{
+	uint64_t f;
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r" (f));
+	return f;
+}
+#elif defined(__arm__) && (defined(BOARD_RPI2) || defined(BOARD_RPI4))
+#define HAVE_TS_COUNTER
+#define TS_COUNTER_NAME "cntvct"
+static inline uint64_t ts_counter(void)
+{
+	uint64_t v;
+	__asm__ volatile("isb; mrrc p15, 1, %Q0, %R0, c14" : "=r" (v) :: "memory");
+	return v;
+}
+static inline uint64_t ts_counter_freq(void)
+{
+	uint32_t f;
+	__asm__ volatile("mrc p15, 0, %0, c14, c0, 0" : "=r" (f));
+	return f;
+}
+#elif defined(__x86_64__) || defined(__i386__)
+#define HAVE_TS_COUNTER
+#define TS_COUNTER_NAME "tsc"
+static inline uint64_t ts_counter(void)
+{
+	uint32_t lo, hi;
+	__asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+static inline uint64_t ts_counter_freq(void)
+{
+	return 0;	/* unknown, must be measured */
+}
+#endif
+
+#define TS_CLOCK		0
+#define TS_COUNTER		1
+
+#define CALIB_WARMUP_NS		50000000	/* let cpufreq ramp up first */
+#define CALIB_SPIN_LOOPS	(1 << 20)
+#define CALIB_RUNS			5
+#define SLEEP_MIN_NS		1000000		/* sleep instead of spinning above */
+
+static int      ts_source = TS_CLOCK;
+static uint64_t ts_freq = 1000000000;	/* ticks per second */
+static uint64_t ticks_per_ns_q16 = 1 << 16;
+static uint64_t spin_per_ns_q16 = 1 << 16;
+static uint32_t spin_max_ns = 1000;
+
+static inline uint64_t clock_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline uint64_t ts_now(void)
+{
+#ifdef HAVE_TS_COUNTER
+	if (ts_source == TS_COUNTER)
+		return ts_counter();
+#endif
+	return clock_ns();
+}
+
+/* Calibrated busy loop; the empty asm keeps the compiler from eliding it */
+static void __attribute__((noinline)) spin(uint64_t loops)
+{
+	while (loops--)
+		__asm__ volatile("" ::: "memory");
+}
+
+/*
+ * Select and calibrate the time source and the spin loop.
+ * Must be called once before any delay_ns()/delay_us().
+ */
+void delay_init(void)
+{
+	uint64_t t0, t1, c0, c1, best;
+	int i;
+
+	/* keep the core busy so that the governor settles at full speed */
+	t0 = clock_ns();
+	while (clock_ns() - t0 < CALIB_WARMUP_NS)
+		spin(1000);
+
+#ifdef HAVE_TS_COUNTER
+	ts_freq = ts_counter_freq();
+	if (ts_freq == 0) {
+		/* measure the counter against CLOCK_MONOTONIC_RAW over 10ms */
+		t0 = clock_ns();
+		c0 = ts_counter();
+		while ((t1 = clock_ns()) - t0 < 10000000);
+		c1 = ts_counter();
+		ts_freq = (c1 - c0) * 1000000000 / (t1 - t0);
+	}
+	if (ts_freq >= 1000000)
+		ts_source = TS_COUNTER;
+	else
+		ts_freq = 1000000000;
+#endif
+	ticks_per_ns_q16 = (ts_freq << 16) / 1000000000;
+	if (ticks_per_ns_q16 == 0)
+		ticks_per_ns_q16 = 1;
+
+	/* cost of a single time source read */
+	t0 = clock_ns();
+	for (i = 0; i < 1000; i++)
+		ts_now();
+	t1 = clock_ns();
+
+	/*
+	 * Below the larger of four reads or two counter ticks, polling the time
+	 * source is too coarse and the spin loop is used instead.
+	 */
+	spin_max_ns = 4 * (t1 - t0) / 1000;
+	if (spin_max_ns < 2 * 1000000000 / ts_freq)
+		spin_max_ns = 2 * 1000000000 / ts_freq;
+
+	/*
+	 * Keep the fastest of several runs: a preempted run would otherwise make
+	 * the loop look slower than it is and shorten every later delay.
+	 */
+	best = ~0ULL;
+	for (i = 0; i < CALIB_RUNS; i++) {
+		t0 = clock_ns();
+		spin(CALIB_SPIN_LOOPS);
+		t1 = clock_ns();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	if (best == 0)
+		best = 1;
+	spin_per_ns_q16 = ((uint64_t)CALIB_SPIN_LOOPS << 16) / best;
+
+	if (flags.debug)
+		fprintf(stderr, "Delay: %s @ %llu Hz, spin %.2f loops/ns below %uns\n",
+#ifdef HAVE_TS_COUNTER
+				ts_source == TS_COUNTER ? TS_COUNTER_NAME : "CLOCK_MONOTONIC_RAW",
+#else
+				"CLOCK_MONOTONIC_RAW",
+#endif
+				(unsigned long long)ts_freq, spin_per_ns_q16 / 65536.0,
+				spin_max_ns);
+}
+
+/* Busy-wait for (at least) the given number of nanoseconds */
+void delay_ns(uint32_t howLong)
+{
+	uint64_t start, ticks;
+
+	if (howLong == 0)
+		return;
+
+	if (howLong < spin_max_ns) {
+		spin(((uint64_t)howLong * spin_per_ns_q16 + 0xFFFF) >> 16);
+		return;
+	}
+
+	if (howLong >= SLEEP_MIN_NS) {
+		struct timespec t;
+		t.tv_sec  = howLong / 1000000000;
+		t.tv_nsec = howLong % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, 0, &t, &t));
+		return;
+	}
+
+	start = ts_now();
+	ticks = ((uint64_t)howLong * ticks_per_ns_q16 + 0xFFFF) >> 16;
+
+	/* start was taken somewhere inside a tick: wait one more */
+	while (ts_now() - start <= ticks);
+}
+
+/* Raw timestamp of the delay time source, for the instrumentation */
+uint64_t delay_ticks(void)
+{
+	return ts_now();
+}
+
+uint64_t delay_ticks_to_ns(uint64_t ticks)
+{
+	/* split, so that traces of a long operation do not overflow */
+	return ticks / ts_freq * 1000000000 +
+			ticks % ts_freq * 1000000000 / ts_freq;
+}
+
+void delay_us(unsigned int howLong)
+{
+	while (howLong >= 1000000) {
+		delay_ns(1000000000);
+		howLong -= 1000000;
+	}
+	delay_ns(howLong * 1000);
+}
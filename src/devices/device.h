@@ -21,11 +21,291 @@
 #ifndef DEVICE_H_
 #define DEVICE_H_
  
- struct memory{
-		uint32_t	program_memory_size;   	// size in WORDS (16bits each)
-		uint32_t	code_memory_size;		// size in WORDS (16bits each)
-		uint16_t	*location;		// 16-bit data
-		bool		*filled;		// 1 if the corresponding location is used
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+/*
+ * The memory image is sparse: locations live in pages of MEM_PAGE_SIZE,
+ * allocated the first time one of their locations is written, so that its
+ * size follows the image and not the address space of the device (48M
+ * locations on PIC32). A location of a missing page reads as 0 and not
+ * filled, like the calloc'd arrays it replaces.
+ *
+ * Occupancy is a bitset, and the starts of the rows holding something are
+ * indexed on demand (for one row size at a time, rebuilt when the image
+ * changes), so that write and verify loops go from one occupied row to the
+ * next without looking at the empty ones.
+ */
+#define MEM_PAGE_SHIFT	12
+#define MEM_PAGE_SIZE	(1U << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK	(MEM_PAGE_SIZE - 1)
+#define MEM_NO_ROW		0xFFFFFFFF
+
+struct mem_page{
+		uint16_t	location[MEM_PAGE_SIZE];
+		uint32_t	filled[MEM_PAGE_SIZE / 32];		// 1 bit per location
+
+		bool is_filled(uint32_t i) const {
+			return (filled[i >> 5] >> (i & 31)) & 1;
+		};
+		void set_filled(uint32_t i, bool f){
+			if(f)
+				filled[i >> 5] |= 1U << (i & 31);
+			else
+				filled[i >> 5] &= ~(1U << (i & 31));
+		};
+};
+
+class mem_page_table{
+
+	public:
+		mem_page_table() : row_size(0) {};
+		~mem_page_table(){
+			clear();
+		};
+		mem_page_table(const mem_page_table &) = delete;
+		mem_page_table &operator=(const mem_page_table &) = delete;
+
+		/* page of addr, NULL if nothing was ever written there */
+		mem_page *find(uint32_t addr) const {
+			uint32_t p = addr >> MEM_PAGE_SHIFT;
+			return p < table.size() ? table[p] : NULL;
+		};
+
+		/* page of addr, allocated if needed */
+		mem_page *get(uint32_t addr){
+			uint32_t p = addr >> MEM_PAGE_SHIFT;
+			if(p >= table.size())
+				table.resize(p + 1, NULL);
+			if(table[p] == NULL){
+				table[p] = (mem_page *) calloc(1, sizeof(mem_page));
+				if(table[p] == NULL)
+					abort();
+			}
+			return table[p];
+		};
+
+		/* first filled location in [addr, end), end if there is none */
+		uint32_t next_filled(uint32_t addr, uint32_t end) const {
+			mem_page *page;
+			uint32_t bits;
+
+			while(addr < end){
+				page = find(addr);
+				if(page == NULL){
+					addr = (addr | MEM_PAGE_MASK) + 1;
+					continue;
+				}
+				bits = page->filled[(addr & MEM_PAGE_MASK) >> 5] >> (addr & 31);
+				if(bits)
+					return std::min(addr + __builtin_ctz(bits), end);
+				addr = (addr | 31) + 1;
+			}
+			return end;
+		};
+
+		/* first location in [addr, end) that is not filled, end if none */
+		uint32_t next_empty(uint32_t addr, uint32_t end) const {
+			mem_page *page;
+			uint32_t bits;
+
+			while(addr < end){
+				page = find(addr);
+				if(page == NULL)
+					return addr;
+				bits = ~page->filled[(addr & MEM_PAGE_MASK) >> 5] >> (addr & 31);
+				if(bits)
+					return std::min(addr + __builtin_ctz(bits), end);
+				addr = (addr | 31) + 1;
+			}
+			return end;
+		};
+
+		/*
+		 * addr itself if its row of row locations has a filled location,
+		 * else the start of the next such row; MEM_NO_ROW if there is none.
+		 */
+		uint32_t next_row(uint32_t addr, uint32_t row){
+			std::vector<uint32_t>::iterator r;
+
+			if(row != row_size)
+				index_rows(row);
+			r = std::lower_bound(rows.begin(), rows.end(), addr - addr % row);
+			if(r == rows.end())
+				return MEM_NO_ROW;
+			return std::max(*r, addr);
+		};
+
+		/* the occupancy changed: the row index must be rebuilt */
+		void changed(void){
+			row_size = 0;
+		};
+
+		/* touch the allocated pages, see realtime_prefault() */
+		void prefault(void) const {
+			for(size_t p = 0; p < table.size(); p++)
+				if(table[p] != NULL)
+					for(uint32_t i = 0; i < sizeof(mem_page); i += 4096)
+						(void)((volatile uint8_t *)table[p])[i];
+		};
+
+		void clear(void){
+			for(size_t p = 0; p < table.size(); p++)
+				free(table[p]);
+			table.clear();
+			changed();
+		};
+
+	private:
+		std::vector<mem_page *> table;
+		std::vector<uint32_t> rows;		// starts of the occupied rows
+		uint32_t row_size;				// 0: rows is out of date
+
+		void index_rows(uint32_t row){
+			uint32_t addr, end, bits, w;
+
+			rows.clear();
+			row_size = row;
+			for(size_t p = 0; p < table.size(); p++){
+				if(table[p] == NULL)
+					continue;
+				for(w = 0; w < MEM_PAGE_SIZE / 32; w++){
+					bits = table[p]->filled[w];
+					while(bits){
+						addr = (p << MEM_PAGE_SHIFT) + w * 32 + __builtin_ctz(bits);
+						addr -= addr % row;
+						if(rows.empty() || rows.back() != addr)
+							rows.push_back(addr);
+						/* drop the rest of this row from the word */
+						end = addr + row - ((p << MEM_PAGE_SHIFT) + w * 32);
+						bits = end >= 32 ? 0 : bits & ~((1U << end) - 1);
+					}
+				}
+			}
+		};
+};
+
+/* mem.location[addr]: reads do not allocate, writes go to the page */
+class mem_location_ref{
+
+	public:
+		mem_location_ref(mem_page_table &t, uint32_t a) : pages(t), addr(a) {};
+
+		operator uint16_t() const {
+			mem_page *page = pages.find(addr);
+			return page ? page->location[addr & MEM_PAGE_MASK] : 0;
+		};
+		mem_location_ref &operator=(uint16_t data){
+			pages.get(addr)->location[addr & MEM_PAGE_MASK] = data;
+			return *this;
+		};
+		mem_location_ref &operator=(const mem_location_ref &r){
+			return *this = (uint16_t)r;
+		};
+
+	private:
+		mem_page_table	&pages;
+		uint32_t		addr;
+};
+
+/* mem.filled[addr]: clearing a location of a missing page allocates nothing */
+class mem_filled_ref{
+
+	public:
+		mem_filled_ref(mem_page_table &t, uint32_t a) : pages(t), addr(a) {};
+
+		operator bool() const {
+			mem_page *page = pages.find(addr);
+			return page ? page->is_filled(addr & MEM_PAGE_MASK) : false;
+		};
+		mem_filled_ref &operator=(bool filled){
+			mem_page *page = filled ? pages.get(addr) : pages.find(addr);
+			if(page != NULL){
+				page->set_filled(addr & MEM_PAGE_MASK, filled);
+				pages.changed();
+			}
+			return *this;
+		};
+		mem_filled_ref &operator=(const mem_filled_ref &r){
+			return *this = (bool)r;
+		};
+
+	private:
+		mem_page_table	&pages;
+		uint32_t		addr;
+};
+
+class mem_locations{
+
+	public:
+		mem_locations(mem_page_table &t) : pages(t) {};
+		mem_location_ref operator[](uint32_t addr){
+			return mem_location_ref(pages, addr);
+		};
+		uint16_t operator[](uint32_t addr) const {
+			mem_page *page = pages.find(addr);
+			return page ? page->location[addr & MEM_PAGE_MASK] : 0;
+		};
+
+	private:
+		mem_page_table	&pages;
+};
+
+class mem_filled{
+
+	public:
+		mem_filled(mem_page_table &t) : pages(t) {};
+		mem_filled_ref operator[](uint32_t addr){
+			return mem_filled_ref(pages, addr);
+		};
+		bool operator[](uint32_t addr) const {
+			mem_page *page = pages.find(addr);
+			return page ? page->is_filled(addr & MEM_PAGE_MASK) : false;
+		};
+
+	private:
+		mem_page_table	&pages;
+};
+
+/* rows of a file still being parsed, see read_inhx_erase() */
+struct hex_feed;
+void read_inhx_drop(hex_feed *feed);
+
+struct memory{
+		uint32_t		program_memory_size;   	// size in WORDS (16bits each)
+		uint32_t		code_memory_size;		// size in WORDS (16bits each)
+		mem_page_table	pages;
+		mem_locations	location;		// 16-bit data
+		mem_filled		filled;			// 1 if the corresponding location is used
+		hex_feed		*feed;			// --stream: rows still to come, or NULL
+
+		memory() : program_memory_size(0), code_memory_size(0),
+				location(pages), filled(pages), feed(NULL) {};
+		~memory(){
+			if(feed)
+				read_inhx_drop(feed);
+		};
+
+		/* drop the whole image */
+		void clear(void){
+			pages.clear();
+		};
+
+		/* location[addr] = data and filled[addr] = 1, with one page lookup */
+		void store(uint32_t addr, uint16_t data){
+			mem_page *page = pages.get(addr);
+
+			page->location[addr & MEM_PAGE_MASK] = data;
+			page->set_filled(addr & MEM_PAGE_MASK, true);
+			pages.changed();
+		};
+
+		/* see mem_page_table::next_row() */
+		uint32_t next_row(uint32_t addr, uint32_t row){
+			return pages.next_row(addr, row);
+		};
 };
 
 struct pic_device{
@@ -54,6 +334,7 @@ class Pic{
 		virtual void exit_program_mode(void) = 0;
 		virtual bool setup_pe(void) = 0;
 		virtual bool read_device_id(void) = 0;
+		virtual uint32_t pgc_min_ns(void) = 0;
 		virtual void bulk_erase(void) = 0;
 		virtual void dump_configuration_registers(void) = 0;
 		virtual void read(char *outfile, uint32_t start=0, uint32_t count=0) = 0;
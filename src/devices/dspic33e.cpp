@@ -25,75 +25,66 @@
 
 #include "dspic33e.h"
 
-/* delays (in microseconds; nanoseconds are rounded to 1us) */
-#define DELAY_P1   			1		// 200ns
-#define DELAY_P1A			1		// 80ns
-#define DELAY_P1B			1		// 80ns
-#define DELAY_P2			1		// 15ns
-#define DELAY_P3			1		// 15ns
-#define DELAY_P4			1		// 40ns
-#define DELAY_P4A			1		// 40ns
-#define DELAY_P5			1		// 20ns
-#define DELAY_P6			1		// 100ns
-#define DELAY_P7_DSPIC33E	25000	// 25ms
-#define DELAY_P7_PIC24FJ	50000	// 50ms
-#define DELAY_P8			12		// 12us
-#define DELAY_P9A			10		// 10us
-#define DELAY_P9B			15		// 15us - 23us max!
-#define DELAY_P10			1		// 400ns
-#define DELAY_P11_DSPIC33E	116000	// 116ms
-#define DELAY_P11_PIC24FJ	25000	// 25ms
-#define DELAY_P12_DSPIC33E	23000	// 23ms
-#define DELAY_P12_PIC24FJ	25000	// 25ms
-#define DELAY_P13_DSPIC33E	1600	// 1.6ms
-#define DELAY_P13_PIC24FJ	20		// 20us
-#define DELAY_P14			1		// 1us MAX!
-#define DELAY_P15			1		// 10ns
-#define DELAY_P16			0		// 0s
-#define DELAY_P17   		0		// 0s - 100ns MAX!
-#define DELAY_P18			1000	// 1ms
-#define DELAY_P19			1		// 25ns
-#define DELAY_P20			25000	// 25ms
-#define DELAY_P21			1		// 1us - 500us MAX!
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_P1   			(200, 200, 0);		// 200ns
+static constexpr pgc_param    DELAY_P1A			(80, 80, 0, DELAY_P1.min);		// 80ns, at least P1/2
+static constexpr pgc_param    DELAY_P1B			(80, 80, 0, DELAY_P1.min);		// 80ns, at least P1/2
+static constexpr timing_param DELAY_P2			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P3			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P4			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P4A			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P5			(20, 20, 0);		// 20ns
+static constexpr timing_param DELAY_P6			(100, 100, 0);		// 100ns
+static constexpr timing_param DELAY_P7_DSPIC33E	(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P7_PIC24FJ	(50000000, 50000000, 0);	// 50ms
+static constexpr timing_param DELAY_P8			(12000, 12000, 0);		// 12us
+static constexpr timing_param DELAY_P9A			(10000, 10000, 0);		// 10us
+static constexpr timing_param DELAY_P9B			(15000, 15000, 23000);		// 15us - 23us max!
+static constexpr timing_param DELAY_P10			(400, 400, 0);		// 400ns
+static constexpr timing_param DELAY_P11_DSPIC33E	(116000000, 116000000, 0);	// 116ms
+static constexpr timing_param DELAY_P11_PIC24FJ	(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P12_DSPIC33E	(23000000, 23000000, 0);	// 23ms
+static constexpr timing_param DELAY_P12_PIC24FJ	(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P13_DSPIC33E	(1600000, 1600000, 0);	// 1.6ms
+static constexpr timing_param DELAY_P13_PIC24FJ	(20000, 20000, 0);		// 20us
+static constexpr timing_param DELAY_P14			(0, 1000, 1000);		// 1us MAX!
+static constexpr timing_param DELAY_P15			(10, 10, 0);		// 10ns
+static constexpr timing_param DELAY_P16			(0, 0, 0);		// 0s
+static constexpr timing_param DELAY_P17   		(0, 0, 100);		// 0s - 100ns MAX!
+static constexpr timing_param DELAY_P18			(1000000, 1000000, 0);	// 1ms
+static constexpr timing_param DELAY_P19			(25, 25, 0);		// 25ns
+static constexpr timing_param DELAY_P20			(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P21			(1000, 1000, 500000);		// 1us - 500us MAX!
 
 #define ENTER_PROGRAM_KEY	0x4D434851
 
+/* Programming Executives: executive memory, rows of 128 instructions */
+static const pe_family pe_dspic33e = {"dsPIC33E/PIC24E", "dspic33e", 0x800000, 0x1000, 0x800, 128,
+		0x054, 0x728, 0x72A, 0x72C, 0x72E, 0xF88, 0x4003, 0x4002, 128, true, true};
+static const pe_family pe_pic24fj = {"PIC24FJ", "pic24fj", 0x800000, 0x1000, 0x800, 128,
+		0x054, 0x728, 0x72A, 0x72C, 0x72E, 0xF88, 0x4003, 0x4002, 128, true, true};
+
 #define reset_pc() send_cmd(0x040200)
 #define send_nop() send_cmd(0x000000)
 
-static unsigned int counter=0;
-static uint16_t nvmcon;
+static thread_local unsigned int counter=0;
+static thread_local uint16_t nvmcon;
 
 /* Send a 24-bit command to the PIC (LSB first) through a SIX instruction */
 void dspic33e::send_cmd(uint32_t cmd)
 {
-	uint8_t i;
-
-	GPIO_CLR(pic_data);
+	PGC_BURST();
+	pgd_clr();
 
 	/* send the SIX = 0x0000 instruction */
-	for (i = 0; i < 4; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* send the 24-bit command */
-	for (i = 0; i < 24; i++) {
-		if ( (cmd >> i) & 0x00000001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(cmd, 24, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 
 }
 
@@ -102,110 +93,75 @@ inline void dspic33e::send_prog_nop(void)
 {
 	uint8_t i;
 
-	GPIO_CLR(pic_data);
+	PGC_BURST();
+	pgd_clr();
 
 	/* send 5 NOP commands */
-	for (i = 0; i < 140; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1A);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1B);
-	}
+	for (i = 0; i < 5; i++)
+		shift_out(0x0, 28, true, DELAY_P1A, DELAY_P1B);
 }
 
 /* Read 16-bit data word from the PIC (LSB first) through a REGOUT inst */
 uint16_t dspic33e::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0;
 
-	GPIO_CLR(pic_data);
+	PGC_BURST();
+	pgd_clr();
 	GPIO_CLR(pic_clk);
 
 	/* send the REGOUT=0x0001 instruction */
-	for (i = 0; i < 4; i++) {
-		if ( (0x0001 >> i) & 0x001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(0x1, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* idle for 8 clock cycles, waiting for the data to be ready */
-	for (i = 0; i < 8; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 8, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P5);
+	delay_ns(DELAY_P5);
 
-	GPIO_IN(pic_data);
+	pgd_in();
 
-	/* read a 16-bit data word */
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
+	/* read a 16-bit data word (from every target in gang mode) */
+	if (gang_count) {
+		shift_in_gang(16, DELAY_P1B, DELAY_P1A);
+		data = gang_word[gang_first()];
 	}
+	else
+		data = shift_in(16, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
-	GPIO_OUT(pic_data);
+	delay_ns(DELAY_P4A);
+	pgd_out();
 	return data;
 }
 
 /* enter program mode */
 void dspic33e::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_IN(pic_mclr);
 	GPIO_OUT(pic_mclr);
 
 	GPIO_CLR(pic_clk);
 
 	GPIO_CLR(pic_mclr);		/*  remove VDD from MCLR pin */
-	delay_us(DELAY_P6);
+	delay_ns(DELAY_P6);
 	GPIO_SET(pic_mclr);		/*  apply VDD to MCLR pin */
-	delay_us(DELAY_P21);
+	delay_ns(DELAY_P21);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P18);
+	delay_ns(DELAY_P18);
 
 	/* Shift in the "enter program mode" key sequence (MSB first) */
-	for (i = 31; i > -1; i--) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-
-	}
-	GPIO_CLR(pic_data);
-	delay_us(DELAY_P19);
+	shift_out(ENTER_PROGRAM_KEY, 32, false, DELAY_P1B, DELAY_P1A);
+	pgd_clr();
+	delay_ns(DELAY_P19);
 	GPIO_SET(pic_mclr);
 	if(subfamily == SF_DSPIC33E)
-		delay_us(DELAY_P7_DSPIC33E);
+		delay_ns(DELAY_P7_DSPIC33E);
 	else if(subfamily == SF_PIC24FJ)
-		delay_us(DELAY_P7_PIC24FJ);
+		delay_ns(DELAY_P7_PIC24FJ);
 
 	/* idle for 5 clock cycles */
-	for (i = 0; i < 5; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 5, true, DELAY_P1B, DELAY_P1A);
 
 }
 
@@ -213,19 +169,45 @@ void dspic33e::enter_program_mode(void)
 void dspic33e::exit_program_mode(void)
 {
 	GPIO_CLR(pic_clk);
-	GPIO_CLR(pic_data);
-	delay_us(DELAY_P16);
+	pgd_clr();
+	delay_ns(DELAY_P16);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P17);	/* wait (at least) P17 */
+	delay_ns(DELAY_P17);	/* wait (at least) P17 */
 	GPIO_SET(pic_mclr);
 	GPIO_IN(pic_mclr);
 }
 
+/* use the Programming Executive when there is one (never in gang mode) */
+bool dspic33e::setup_pe(void)
+{
+	pe_setup(subfamily == SF_PIC24FJ ? &pe_pic24fj : &pe_dspic33e);
+	return true;
+}
+
+/* true when id is one of the devices in piclist */
+bool dspic33e::known_id(uint16_t id)
+{
+	for (unsigned short i=0;i < sizeof(piclist)/sizeof(piclist[0]);i++)
+		if (piclist[i].device_id == id)
+			return true;
+
+	return false;
+}
+
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t dspic33e::pgc_min_ns(void)
+{
+	return DELAY_P1A.half_min > DELAY_P1B.half_min ?
+			DELAY_P1A.half_min : DELAY_P1B.half_min;
+}
+
 /* read the device ID and revision; returns only the id */
 bool dspic33e::read_device_id(void)
 {
 	bool found = 0;
 
+	pe_leave();
+
 	send_nop();
 	send_nop();
 	send_nop();
@@ -247,6 +229,15 @@ bool dspic33e::read_device_id(void)
 	send_nop();
 	send_nop();
 	device_id = read_data();
+	if (gang_count){
+		/* the reference is the first target that answers with a known ID */
+		for (int t = 0; t < gang_count; t++)
+			if (known_id(gang_word[t])){
+				device_id = gang_word[t];
+				break;
+			}
+		gang_check(device_id, "device ID");
+	}
 
 	send_cmd(0xBA0BB6);
 	send_nop();
@@ -266,8 +257,7 @@ bool dspic33e::read_device_id(void)
 			strcpy(name, piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0F80018;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -284,6 +274,10 @@ uint8_t dspic33e::blank_check(void)
 	unsigned short i;
 	uint16_t data[8], raw_data[6];
 	uint8_t ret = 0;
+	int pe_ret;
+
+	if(pe && (pe_ret = pe_blank_check()) >= 0)
+		return pe_ret;
 
 	if(!flags.debug) cerr << "[ 0%]";
 
@@ -422,6 +416,7 @@ uint8_t dspic33e::blank_check(void)
 /* Bulk erase the chip */
 void dspic33e::bulk_erase(void)
 {
+	pe_leave();
 
     send_nop();
     send_nop();
@@ -446,9 +441,9 @@ void dspic33e::bulk_erase(void)
 	send_nop();
 
 	if(subfamily == SF_DSPIC33E)
-		delay_us(DELAY_P11_DSPIC33E);
+		delay_ns(DELAY_P11_DSPIC33E);
 	else if(subfamily == SF_PIC24FJ)
-		delay_us(DELAY_P11_PIC24FJ);
+		delay_ns(DELAY_P11_PIC24FJ);
 
 	/* wait while the erase operation completes */
 	do{
@@ -464,7 +459,7 @@ void dspic33e::bulk_erase(void)
 		send_nop();
 		send_nop();
 		send_nop();
-	} while((nvmcon & 0x8000) == 0x8000);
+	} while(((gang_count ? gang_or() : nvmcon) & 0x8000) == 0x8000);
 
 	if(flags.client) fprintf(stdout, "@FIN");
 }
@@ -475,6 +470,7 @@ void dspic33e::read(char *outfile, uint32_t start, uint32_t count)
 	uint32_t addr, startaddr, stopaddr;
 	uint16_t data[8], raw_data[6];
 	int i=0;
+	readback *rb;
 
 	startaddr = start;
 	stopaddr = mem.code_memory_size;
@@ -486,7 +482,13 @@ void dspic33e::read(char *outfile, uint32_t start, uint32_t count)
 
 	if(!flags.debug) cerr << "[ 0%]";
 	if(flags.client) fprintf(stdout, "@000");
-	counter=0;
+
+	/* the erased locations are left unfilled */
+	rb = readback_start(&mem, hex_open(outfile, 0, mem.program_memory_size >= 0x10000),
+			RB_SKIP_HALF, 0x00FFFFFF, stopaddr - startaddr);
+
+	if(pe && pe_read(rb, &startaddr, stopaddr))
+		goto configuration;
 
 	/* exit reset vector */
 	send_nop();
@@ -585,33 +587,20 @@ void dspic33e::read(char *outfile, uint32_t start, uint32_t count)
 		data[7] = (raw_data[4] & 0xFF00) >> 8;
 		data[6] = raw_data[5];
 
-		for(i=0; i<8; i++){
-			if (flags.debug)
+		if (flags.debug)
+			for(i=0; i<8; i++)
 				fprintf(stderr, "\n addr = 0x%06X data = 0x%04X",
 						(addr+i), data[i]);
 
-			if (i%2 == 0 && data[i] != 0xFFFF) {
-				mem.location[addr+i]        = data[i];
-				mem.filled[addr+i]      = 1;
-			}
-
-			if (i%2 == 1 && data[i] != 0x00FF) {
-				mem.location[addr+i]        = data[i];
-				mem.filled[addr+i]      = 1;
-			}
-		}
-
-		if(counter != addr*100/stopaddr){
-			counter = addr*100/stopaddr;
-			if(flags.client)
-				fprintf(stdout,"@%03d", counter);
-			if(!flags.debug)
-				fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
-		}
+		for(i=0; i<8; i+=2)
+			readback_push(rb, addr+i, data[i] | (uint32_t)data[i+1] << 16);
 
 		/* TODO: checksum */
 	}
 
+configuration:
+	pe_leave();
+
 	send_nop();
 	send_nop();
 	send_nop();
@@ -636,10 +625,7 @@ void dspic33e::read(char *outfile, uint32_t start, uint32_t count)
 		send_nop();
 		send_nop();
 		data[0] = read_data();
-		if (data[0] != 0xFFFF) {
-			mem.location[addr+2*i] = data[0];
-			mem.filled[addr+2*i] = 1;
-		}
+		readback_push_location(rb, addr+2*i, data[0], 0xFFFF);
 	}
 
 	send_nop();
@@ -650,32 +636,38 @@ void dspic33e::read(char *outfile, uint32_t start, uint32_t count)
 	send_nop();
 	send_nop();
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile);
 }
 
 /* Write contents of the .hex file to the PIC */
 void dspic33e::write(char *infile)
 {
 	uint16_t i,j,p;
-	uint16_t k;
-	bool skip;
 	uint32_t data[8],raw_data[6];
+	uint32_t gang_raw[GANG_MAX][6];
 	uint32_t addr = 0;
+	int t;
 
 	unsigned int filled_locations=1;
 
 	const char *regname[] = {"FGS","FOSCSEL","FOSC","FWDT","FPOR",
 							"FICD","FAS","FUID0"};
 
-	filled_locations = read_inhx(infile, &mem);
+	filled_locations = read_inhx_erase(infile, this);
 	if(!filled_locations) {
 		fprintf(stderr,"\n\n ERROR No filled locations!\n\n");
-		exit(31);
+		fatal(31);
+
 	}
 
-	bulk_erase();
+	/* with the PE, one PROGP per row; ICSP again if it fails */
+	if(pe){
+		if(pe_write())
+			goto code_written;
+		bulk_erase();
+	}
 
 	/* Exit reset vector */
 	send_nop();
@@ -693,15 +685,10 @@ void dspic33e::write(char *infile)
 
 	for (addr = 0; addr < mem.code_memory_size; ){
 
-		skip = 1;
-
-		for(k=0; k<256; k+=2)
-			if(mem.filled[addr+k]) skip = 0;
-
-		if(skip){
-			addr=addr+256;
-			continue;
-		}
+		/* straight to the next row with something to write */
+		addr = read_inhx_row(&mem, addr, 256);
+		if(addr >= mem.code_memory_size)
+			break;
 
 		/* Set the NVMADRU/NVMADR register-pair to point to the correct row */
 		send_cmd(0x200002 | ((addr & 0x0000FFFF) << 4) );
@@ -775,9 +762,9 @@ void dspic33e::write(char *infile)
 		send_prog_nop();	// FIXME: timing???
 
 		if(subfamily == SF_DSPIC33E)
-			delay_us(DELAY_P13_DSPIC33E);
+			delay_ns(DELAY_P13_DSPIC33E);
 		else if(subfamily == SF_PIC24FJ)
-			delay_us(DELAY_P13_PIC24FJ);
+			delay_ns(DELAY_P13_PIC24FJ);
 
 		do{
 			send_nop();
@@ -793,7 +780,7 @@ void dspic33e::write(char *infile)
 			send_nop();
 			send_nop();
 			send_nop();
-		} while((nvmcon & 0x8000) == 0x8000);
+		} while(((gang_count ? gang_or() : nvmcon) & 0x8000) == 0x8000);
 
 		if(counter != addr*100/filled_locations){
 			if(flags.client)
@@ -804,10 +791,17 @@ void dspic33e::write(char *infile)
 		}
 	};
 
+code_written:
 	if(!flags.debug) cerr << "\b\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@100");
 
+	/* --stream: the rest of the file, configuration words included */
+	filled_locations = read_inhx_wait(&mem, filled_locations);
+	if(!filled_locations)
+		fatal(31);
+
 	delay_us(100000);
+	pe_leave();
 
 	/* WRITE CONFIGURATION REGISTERS */
 	if(flags.debug)
@@ -858,7 +852,7 @@ void dspic33e::write(char *infile)
 			send_nop();
 			send_nop();
 
-			delay_us(DELAY_P20);
+			delay_ns(DELAY_P20);
 
 			do{
 				send_nop();
@@ -874,11 +868,11 @@ void dspic33e::write(char *infile)
 				send_nop();
 				send_nop();
 				send_nop();
-			} while((nvmcon & 0x8000) == 0x8000);
+			} while(((gang_count ? gang_or() : nvmcon) & 0x8000) == 0x8000);
 
 			if(flags.debug)
 				fprintf(stderr,"\n - %s set to 0x%01x",
-						regname[i], mem.location[addr]);
+						regname[i], (uint16_t)mem.location[addr]);
 		}
 		else if(flags.debug)
 				fprintf(stderr,"\n - %s left unchanged", regname[i]);
@@ -891,7 +885,10 @@ void dspic33e::write(char *infile)
 	delay_us(100000);
 
 	/* VERIFY CODE MEMORY */
-	if(!flags.noverify){
+	if(!flags.noverify && pe && pe_verify()){
+		if(flags.client) fprintf(stdout, "@FIN");
+	}
+	else if(!flags.noverify){
 		if(!flags.debug) cerr << "[ 0%]";
 		if(flags.client) fprintf(stdout, "@000");
 		counter = 0;
@@ -906,13 +903,10 @@ void dspic33e::write(char *infile)
 
 		for(addr=0; addr < mem.code_memory_size; addr=addr+8) {
 
-			skip=1;
-
-			for(k=0; k<8; k+=2)
-				if(mem.filled[addr+k])
-					skip = 0;
-
-			if(skip) continue;
+			/* straight to the next block with something to verify */
+			addr = mem.next_row(addr, 8);
+			if(addr >= mem.code_memory_size)
+				break;
 
 			send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) );	// MOV #<DestAddress23:16>, W0
 			send_cmd(0x8802A0);									// MOV W0, TBLPAG
@@ -975,6 +969,8 @@ void dspic33e::write(char *infile)
 				send_cmd(0x887C40 + i);
 				send_nop();
 				raw_data[i] = read_data();
+				for(t=0; t<gang_count; t++)
+					gang_raw[t][i] = gang_word[t];
 				send_nop();
 			}
 
@@ -986,26 +982,40 @@ void dspic33e::write(char *infile)
 			send_nop();
 			send_nop();
 
-			/* store data correctly */
-			data[0] = raw_data[0];
-			data[1] = raw_data[1] & 0x00FF;
-			data[3] = (raw_data[1] & 0xFF00) >> 8;
-			data[2] = raw_data[2];
-			data[4] = raw_data[3];
-			data[5] = raw_data[4] & 0x00FF;
-			data[7] = (raw_data[4] & 0xFF00) >> 8;
-			data[6] = raw_data[5];
-
-			for(i=0; i<8; i++){
-				if (flags.debug)
-					fprintf(stderr, "\n addr = 0x%06X data = 0x%04X", (addr+i), data[i]);
+			/* every target of the gang gets its own verify */
+			for(t=0; t < (gang_count ? gang_count : 1); t++){
 
-				if(mem.filled[addr+i] && data[i] != mem.location[addr+i]){
-					fprintf(stderr,"\n\n ERROR at address %06X: written %04X but %04X read!\n\n",
-									addr+i, mem.location[addr+i], data[i]);
-					exit(32);
+				if(gang_count){
+					if(!GANG_ALIVE(t)) continue;
+					for(i=0; i<6; i++)
+						raw_data[i] = gang_raw[t][i];
 				}
 
+				/* store data correctly */
+				data[0] = raw_data[0];
+				data[1] = raw_data[1] & 0x00FF;
+				data[3] = (raw_data[1] & 0xFF00) >> 8;
+				data[2] = raw_data[2];
+				data[4] = raw_data[3];
+				data[5] = raw_data[4] & 0x00FF;
+				data[7] = (raw_data[4] & 0xFF00) >> 8;
+				data[6] = raw_data[5];
+
+				for(i=0; i<8; i++){
+					if (flags.debug)
+						fprintf(stderr, "\n addr = 0x%06X data = 0x%04X", (addr+i), data[i]);
+
+					if(mem.filled[addr+i] && data[i] != mem.location[addr+i]){
+						if(gang_count){
+							gang_fail(t, addr+i, mem.location[addr+i], data[i]);
+							break;
+						}
+						fprintf(stderr,"\n\n ERROR at address %06X: written %04X but %04X read!\n\n",
+										addr+i, (uint16_t)mem.location[addr+i], data[i]);
+						fatal(32);
+					}
+
+				}
 			}
 
 			if(counter != addr*100/filled_locations){
@@ -1032,6 +1042,8 @@ void dspic33e::dump_configuration_registers(void)
 	const char *regname[] = {"FGS","FOSCSEL","FOSC","FWDT","FPOR",
 							"FICD","FAS","FUID0"};
 
+	pe_leave();
+
 	cerr << endl << "Configuration registers:" << endl << endl;
 
 	send_nop();
@@ -22,13 +22,14 @@
 
 #include "../common.h"
 #include "device.h"
+#include "eicsp.h"
 
 using namespace std;
 
 #define SF_DSPIC33E		0x00
 #define SF_PIC24FJ		0x01
 
-class dspic33e : public Pic{
+class dspic33e : public eicsp_pic{
 
 	public:
 		dspic33e(uint8_t sf){
@@ -36,8 +37,9 @@ class dspic33e : public Pic{
 		};
 		void enter_program_mode(void);
 		void exit_program_mode(void);
-		bool setup_pe(void){return true;};
+		bool setup_pe(void);
 		bool read_device_id(void);
+		uint32_t pgc_min_ns(void);
 		void bulk_erase(void);
 		void dump_configuration_registers(void);
 		void read(char *outfile, uint32_t start, uint32_t count);
@@ -48,6 +50,7 @@ class dspic33e : public Pic{
 		void send_cmd(uint32_t cmd);
 		inline void send_prog_nop(void);
 		uint16_t read_data(void);
+		bool known_id(uint16_t id);
 
 		/*
 		* DEVICES SECTION
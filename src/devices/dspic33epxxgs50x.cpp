@@ -25,73 +25,58 @@
 
 #include "dspic33epxxgs50x.h"
 
-/* delays (in microseconds; nanoseconds are rounded to 1us) */
-#define DELAY_P1   			1		// 200ns
-#define DELAY_P1A			1		// 80ns
-#define DELAY_P1B			1		// 80ns
-#define DELAY_P2			1		// 15ns
-#define DELAY_P3			1		// 15ns
-#define DELAY_P4			1		// 40ns
-#define DELAY_P4A			1		// 40ns
-#define DELAY_P5			1		// 20ns
-#define DELAY_P6			1		// 100ns
-#define DELAY_P7			50000	// 50ms
-#define DELAY_P8			12		// 12us
-#define DELAY_P9A			10		// 10us
-#define DELAY_P9B			15		// 15us - 23us max!
-#define DELAY_P10			1		// 400ns
-#define DELAY_P11			25000	// 25ms
-#define DELAY_P12			25000	// 25ms
-#define DELAY_P13A			1000	// 1ms
-#define DELAY_P13B			50		// 50us
-#define DELAY_P14			1		// 1us MAX!
-#define DELAY_P15			1		// 10ns
-#define DELAY_P16			0		// 0s
-#define DELAY_P17   		10		// 100ns
-#define DELAY_P18			1000	// 1ms
-#define DELAY_P19			1		// 25ns
-#define DELAY_P20			25000	// 25ms
-#define DELAY_P21			10		// 1us - 500us MAX!
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_P1   			(200, 200, 0);		// 200ns
+static constexpr pgc_param    DELAY_P1A			(80, 80, 0, DELAY_P1.min);		// 80ns, at least P1/2
+static constexpr pgc_param    DELAY_P1B			(80, 80, 0, DELAY_P1.min);		// 80ns, at least P1/2
+static constexpr timing_param DELAY_P2			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P3			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P4			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P4A			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P5			(20, 20, 0);		// 20ns
+static constexpr timing_param DELAY_P6			(100, 100, 0);		// 100ns
+static constexpr timing_param DELAY_P7			(50000000, 50000000, 0);	// 50ms
+static constexpr timing_param DELAY_P8			(12000, 12000, 0);		// 12us
+static constexpr timing_param DELAY_P9A			(10000, 10000, 0);		// 10us
+static constexpr timing_param DELAY_P9B			(15000, 15000, 23000);		// 15us - 23us max!
+static constexpr timing_param DELAY_P10			(400, 400, 0);		// 400ns
+static constexpr timing_param DELAY_P11			(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P12			(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P13A			(1000000, 1000000, 0);	// 1ms
+static constexpr timing_param DELAY_P13B			(50000, 50000, 0);		// 50us
+static constexpr timing_param DELAY_P14			(0, 1000, 1000);		// 1us MAX!
+static constexpr timing_param DELAY_P15			(10, 10, 0);		// 10ns
+static constexpr timing_param DELAY_P16			(0, 0, 0);		// 0s
+static constexpr timing_param DELAY_P17   		(10000, 10000, 0);		// 100ns
+static constexpr timing_param DELAY_P18			(1000000, 1000000, 0);	// 1ms
+static constexpr timing_param DELAY_P19			(25, 25, 0);		// 25ns
+static constexpr timing_param DELAY_P20			(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P21			(10000, 10000, 500000);		// 1us - 500us MAX!
 
 #define ENTER_PROGRAM_KEY	0x4D434851
 
 #define reset_pc() send_cmd(0x040200)
 #define send_nop() send_cmd(0x000000)
 
-static unsigned int counter=0;
-static uint16_t nvmcon;
+static thread_local unsigned int counter=0;
+static thread_local uint16_t nvmcon;
 
 /* Send a 24-bit command to the PIC (LSB first) through a SIX instruction */
 void dspic33epxxgs50x::send_cmd(uint32_t cmd)
 {
-	uint8_t i;
-
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 
 	/* send the SIX = 0x0000 instruction */
-	for (i = 0; i < 4; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* send the 24-bit command */
-	for (i = 0; i < 24; i++) {
-		if ( (cmd >> i) & 0x00000001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(cmd, 24, true, DELAY_P1B, DELAY_P1A);
 
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 
 }
 
@@ -100,62 +85,39 @@ inline void dspic33epxxgs50x::send_prog_nop(void)
 {
 	uint8_t i;
 
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 
 	/* send 5 NOP commands */
-	for (i = 0; i < 140; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1A);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1B);
-	}
+	for (i = 0; i < 5; i++)
+		shift_out(0x0, 28, true, DELAY_P1A, DELAY_P1B);
 }
 
 /* Read 16-bit data word from the PIC (LSB first) through a REGOUT inst */
 uint16_t dspic33epxxgs50x::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0;
 
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 	GPIO_CLR(pic_clk);
 
 	/* send the REGOUT=0x0001 instruction */
-	for (i = 0; i < 4; i++) {
-		if ( (0x0001 >> i) & 0x001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(0x1, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* idle for 8 clock cycles, waiting for the data to be ready */
-	for (i = 0; i < 8; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 8, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P5);
+	delay_ns(DELAY_P5);
 
 	GPIO_IN(pic_data);
 
 	/* read a 16-bit data word */
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	data = shift_in(16, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 	GPIO_OUT(pic_data);
 	return data;
 }
@@ -163,45 +125,28 @@ uint16_t dspic33epxxgs50x::read_data(void)
 /* enter program mode */
 void dspic33epxxgs50x::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_IN(pic_mclr);
 	GPIO_OUT(pic_mclr);
 
 	GPIO_CLR(pic_clk);
 
 	GPIO_CLR(pic_mclr);		/*  remove VDD from MCLR pin */
-	delay_us(DELAY_P6);
+	delay_ns(DELAY_P6);
 	GPIO_SET(pic_mclr);		/*  apply VDD to MCLR pin */
-	delay_us(DELAY_P21);
+	delay_ns(DELAY_P21);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P18);
+	delay_ns(DELAY_P18);
 
 	/* Shift in the "enter program mode" key sequence (MSB first) */
-	for (i = 31; i > -1; i--) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, false, DELAY_P1B, DELAY_P1A);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P19);
+	delay_ns(DELAY_P19);
 	GPIO_SET(pic_mclr);
-	delay_us(DELAY_P7);
-	delay_us(DELAY_P1*5);
+	delay_ns(DELAY_P7);
+	delay_ns(5 * TIMING(DELAY_P1));
 
 	/* idle for 5 clock cycles */
-	for (i = 0; i < 5; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 5, true, DELAY_P1B, DELAY_P1A);
 
 }
 
@@ -210,13 +155,20 @@ void dspic33epxxgs50x::exit_program_mode(void)
 {
 	GPIO_CLR(pic_clk);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P16);
+	delay_ns(DELAY_P16);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P17);	/* wait (at least) P17 */
+	delay_ns(DELAY_P17);	/* wait (at least) P17 */
 	GPIO_SET(pic_mclr);
 	GPIO_IN(pic_mclr);
 }
 
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t dspic33epxxgs50x::pgc_min_ns(void)
+{
+	return DELAY_P1A.half_min > DELAY_P1B.half_min ?
+			DELAY_P1A.half_min : DELAY_P1B.half_min;
+}
+
 /* read the device ID and revision; returns only the id */
 bool dspic33epxxgs50x::read_device_id(void)
 {
@@ -263,8 +215,7 @@ bool dspic33epxxgs50x::read_device_id(void)
 			strcpy(name, piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0F80018;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -443,7 +394,7 @@ void dspic33epxxgs50x::bulk_erase(void)
 	send_nop();
 	send_nop();
 
-	delay_us(DELAY_P11);
+	delay_ns(DELAY_P11);
 
 	/* wait while the erase operation completes */
 	do{
@@ -472,6 +423,7 @@ void dspic33epxxgs50x::read(char *outfile, uint32_t start, uint32_t count)
 	uint32_t addr, startaddr, stopaddr;
 	uint16_t data[8], raw_data[6];
 	int i=0;
+	readback *rb;
 
 	startaddr = start;
 	stopaddr = mem.code_memory_size;
@@ -483,7 +435,10 @@ void dspic33epxxgs50x::read(char *outfile, uint32_t start, uint32_t count)
 
 	if(!flags.debug) cerr << "[ 0%]";
 	if(flags.client) fprintf(stdout, "@000");
-	counter=0;
+
+	/* the erased locations are left unfilled */
+	rb = readback_start(&mem, hex_open(outfile, 0, mem.program_memory_size >= 0x10000),
+			RB_SKIP_HALF, 0x00FFFFFF, stopaddr - startaddr);
 
 	/* exit reset vector */
 	send_nop();
@@ -582,29 +537,13 @@ void dspic33epxxgs50x::read(char *outfile, uint32_t start, uint32_t count)
 		data[7] = (raw_data[4] & 0xFF00) >> 8;
 		data[6] = raw_data[5];
 
-		for(i=0; i<8; i++){
-			if (flags.debug)
+		if (flags.debug)
+			for(i=0; i<8; i++)
 				fprintf(stderr, "\n addr = 0x%06X data = 0x%04X",
 						(addr+i), data[i]);
 
-			if (i%2 == 0 && data[i] != 0xFFFF) {
-				mem.location[addr+i]        = data[i];
-				mem.filled[addr+i]      = 1;
-			}
-
-			if (i%2 == 1 && data[i] != 0x00FF) {
-				mem.location[addr+i]        = data[i];
-				mem.filled[addr+i]      = 1;
-			}
-		}
-
-		if(counter != addr*100/stopaddr){
-			counter = addr*100/stopaddr;
-			if(flags.client)
-				fprintf(stdout,"@%03d", counter);
-			if(!flags.debug)
-				fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
-		}
+		for(i=0; i<8; i+=2)
+			readback_push(rb, addr+i, data[i] | (uint32_t)data[i+1] << 16);
 
 		/* TODO: checksum */
 	}
@@ -633,10 +572,7 @@ void dspic33epxxgs50x::read(char *outfile, uint32_t start, uint32_t count)
 		send_nop();
 		send_nop();
 		data[0] = read_data();
-		if (data[0] != 0xFFFF) {
-			mem.location[addr+2*i] = data[0];
-			mem.filled[addr+2*i] = 1;
-		}
+		readback_push_location(rb, addr+2*i, data[0], 0xFFFF);
 	}
 
 	send_nop();
@@ -647,17 +583,15 @@ void dspic33epxxgs50x::read(char *outfile, uint32_t start, uint32_t count)
 	send_nop();
 	send_nop();
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile);
 }
 
 /* Write contents of the .hex file to the PIC */
 void dspic33epxxgs50x::write(char *infile)
 {
 	uint16_t i;
-	uint16_t k;
-	bool skip;
 	uint32_t data[8],raw_data[6];
 	uint32_t addr = 0;
 	uint16_t hbyte = 0, lbyte = 0;
@@ -668,13 +602,12 @@ void dspic33epxxgs50x::write(char *infile)
 	const char *regname[] = {"FSEC","FBSLIM","FOSCSEL","FOSC","FWDT","FICD", "FDEVOPT", "FALTREG"};
 	const int config_addr[] = {0x005780, 0x005790, 0x005798, 0x00579C, 0x0057A0, 0x0057A8, 0x0057AC, 0x0057B0};
 
-	filled_locations = read_inhx(infile, &mem);
+	filled_locations = read_inhx_erase(infile, this);
 	if(!filled_locations) {
 		fprintf(stderr,"\n\n ERROR No filled locations!\n\n");
-		exit(31);
-	}
+		fatal(31);
 
-	bulk_erase();
+	}
 
 	if(flags.debug) cerr << "Writing FBOOT register...\n";
 
@@ -776,15 +709,10 @@ void dspic33epxxgs50x::write(char *infile)
 
 	for (addr = 0; addr < mem.code_memory_size; ){
 
-		skip = 1;
-
-		for (k = 0; k < 4; k += 2)
-			if (mem.filled[addr + k]) skip = 0;
-
-		if (skip) {
-			addr = addr + 4;
-			continue;
-		}
+		/* straight to the next row with something to write */
+		addr = read_inhx_row(&mem, addr, 4);
+		if (addr >= mem.code_memory_size)
+			break;
 
 		send_cmd(0x200000 | (mem.location[addr] << 4)); // MOV #<LSW0>, W0
 		send_cmd(0x200001 | (0x00FFFF & ((mem.location[addr+3] << 8) | (mem.location[addr+1] & 0x00FF))) <<4); // MOV #<MSB1:MSB0>, W1
@@ -861,6 +789,11 @@ void dspic33epxxgs50x::write(char *infile)
 	if(!flags.debug) cerr << "\b\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@100");
 
+	/* --stream: the rest of the file, configuration words included */
+	filled_locations = read_inhx_wait(&mem, filled_locations);
+	if(!filled_locations)
+		fatal(31);
+
 	delay_us(100000);
 
 	/* WRITE CONFIGURATION WORDS */
@@ -976,13 +909,10 @@ void dspic33epxxgs50x::write(char *infile)
 
 		for(addr=0; addr < mem.code_memory_size; addr=addr+8) {
 
-			skip=1;
-
-			for(k=0; k<8; k+=2)
-				if(mem.filled[addr+k])
-					skip = 0;
-
-			if(skip) continue;
+			/* straight to the next block with something to verify */
+			addr = mem.next_row(addr, 8);
+			if(addr >= mem.code_memory_size)
+				break;
 
 			send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) );	// MOV #<DestAddress23:16>, W0
 			send_cmd(0x8802A0);									// MOV W0, TBLPAG
@@ -1072,8 +1002,8 @@ void dspic33epxxgs50x::write(char *infile)
 
 				if(mem.filled[addr+i] && data[i] != mem.location[addr+i]){
 					fprintf(stderr,"\n\n ERROR at address %06X: written %04X but %04X read!\n\n",
-									addr+i, mem.location[addr+i], data[i]);
-					exit(32);
+									addr+i, (uint16_t)mem.location[addr+i], data[i]);
+					fatal(32);
 				}
 
 			}
@@ -1128,8 +1058,8 @@ void dspic33epxxgs50x::write(char *infile)
 			if(mem.filled[config_addr[i]] && config_data != mem.location[config_addr[i]])
 			{
 				fprintf(stderr,"\n\n ERROR at config address %06X: written %04X but %04X read!\n\n",
-								config_addr[i], mem.location[config_addr[i]], config_data);
-				exit(33);
+								config_addr[i], (uint16_t)mem.location[config_addr[i]], config_data);
+				fatal(33);
 			}
 		}
 
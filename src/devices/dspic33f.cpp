@@ -25,119 +25,88 @@
 
 #include "dspic33f.h"
 
-/* delays (in microseconds; nanoseconds are rounded to 1us) */
-#define DELAY_P1   		1		// 200ns
-#define DELAY_P1A		1		// 80ns
-#define DELAY_P1B		1		// 80ns
-#define DELAY_P2		1		// 15ns
-#define DELAY_P3		1		// 15ns
-#define DELAY_P4		1		// 40ns
-#define DELAY_P4A		1		// 40ns
-#define DELAY_P5		1		// 20ns
-#define DELAY_P6		1		// 100ns
-#define DELAY_P7		25000	// 25ms
-#define DELAY_P8		12		// 12us
-#define DELAY_P9A		10		// 10us
-#define DELAY_P9B		15		// 15us - 23us max!
-#define DELAY_P10		1		// 400ns
-#define DELAY_P11		330000	// 330ms
-#define DELAY_P12		19500	// 19.5ms
-#define DELAY_P13		1280	// 1.28ms
-#define DELAY_P14		1		// 1us MAX!
-#define DELAY_P15		1		// 10ns
-#define DELAY_P16		0		// 0s
-#define DELAY_P17   	0		// 0s - 100ns MAX!
-#define DELAY_P18		1		// 1us
-#define DELAY_P19		1		// 25ns
-#define DELAY_P20		1		// 1us - 25ms MAX!
-#define DELAY_P21		1		// 1us - 500us MAX!
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_P1   		(200, 200, 0);		// 200ns
+static constexpr pgc_param    DELAY_P1A		(80, 80, 0, DELAY_P1.min);		// 80ns, at least P1/2
+static constexpr pgc_param    DELAY_P1B		(80, 80, 0, DELAY_P1.min);		// 80ns, at least P1/2
+static constexpr timing_param DELAY_P2		(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P3		(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P4		(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P4A		(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P5		(20, 20, 0);		// 20ns
+static constexpr timing_param DELAY_P6		(100, 100, 0);		// 100ns
+static constexpr timing_param DELAY_P7		(25000000, 25000000, 0);	// 25ms
+static constexpr timing_param DELAY_P8		(12000, 12000, 0);		// 12us
+static constexpr timing_param DELAY_P9A		(10000, 10000, 0);		// 10us
+static constexpr timing_param DELAY_P9B		(15000, 15000, 23000);		// 15us - 23us max!
+static constexpr timing_param DELAY_P10		(400, 400, 0);		// 400ns
+static constexpr timing_param DELAY_P11		(330000000, 330000000, 0);	// 330ms
+static constexpr timing_param DELAY_P12		(19500000, 19500000, 0);	// 19.5ms
+static constexpr timing_param DELAY_P13		(1280000, 1280000, 0);	// 1.28ms
+static constexpr timing_param DELAY_P14		(0, 1000, 1000);		// 1us MAX!
+static constexpr timing_param DELAY_P15		(10, 10, 0);		// 10ns
+static constexpr timing_param DELAY_P16		(0, 0, 0);		// 0s
+static constexpr timing_param DELAY_P17   	(0, 0, 100);		// 0s - 100ns MAX!
+static constexpr timing_param DELAY_P18		(1000, 1000, 0);		// 1us
+static constexpr timing_param DELAY_P19		(25, 25, 0);		// 25ns
+static constexpr timing_param DELAY_P20		(1000, 1000, 25000000);		// 1us - 25ms MAX!
+static constexpr timing_param DELAY_P21		(1000, 1000, 500000);		// 1us - 500us MAX!
 
 #define ENTER_PROGRAM_KEY	0x4D434851
 
+/* Programming Executive: executive memory, rows of 64 instructions */
+static const pe_family pe_dspic33f = {"dsPIC33F/PIC24H", "dspic33f", 0x800000, 0x1000, 0x400, 64,
+		0x032, 0x760, 0, 0, 0, 0x784, 0x4042, 0x4001, 64, false, false};
+
 #define reset_pc() send_cmd(0x040200)
 #define send_nop() send_cmd(0x000000)
 
-static unsigned int counter=0;
-static uint16_t nvmcon;
+static thread_local unsigned int counter=0;
+static thread_local uint16_t nvmcon;
 
 /* Send a 24-bit command to the PIC (LSB first) through a SIX instruction */
 void dspic33f::send_cmd(uint32_t cmd)
 {
-	uint8_t i;
-
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 
 	/* send the SIX = 0x0000 instruction */
-	for (i = 0; i < 4; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* send the 24-bit command */
-	for (i = 0; i < 24; i++) {
-		if ( (cmd >> i) & 0x00000001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(cmd, 24, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 
 }
 
 /* Read 16-bit data word from the PIC (LSB first) through a REGOUT inst */
 uint16_t dspic33f::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0;
 
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 	GPIO_CLR(pic_clk);
 
 	/* send the REGOUT=0x0001 instruction */
-	for (i = 0; i < 4; i++) {
-		if ( (0x0001 >> i) & 0x001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(0x1, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* idle for 8 clock cycles, waiting for the data to be ready */
-	for (i = 0; i < 8; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 8, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P5);
+	delay_ns(DELAY_P5);
 
 	GPIO_IN(pic_data);
 
 	/* read a 16-bit data word */
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	data = shift_in(16, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 	GPIO_OUT(pic_data);
 	return data;
 }
@@ -145,44 +114,27 @@ uint16_t dspic33f::read_data(void)
 /* enter program mode */
 void dspic33f::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_IN(pic_mclr);
 	GPIO_OUT(pic_mclr);
 
 	GPIO_CLR(pic_clk);
 
 	GPIO_CLR(pic_mclr);		/*  remove VDD from MCLR pin */
-	delay_us(DELAY_P6);
+	delay_ns(DELAY_P6);
 	GPIO_SET(pic_mclr);		/*  apply VDD to MCLR pin */
-	delay_us(DELAY_P21);
+	delay_ns(DELAY_P21);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P18);
+	delay_ns(DELAY_P18);
 
 	/* Shift in the "enter program mode" key sequence (MSB first) */
-	for (i = 31; i > -1; i--) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, false, DELAY_P1B, DELAY_P1A);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P19);
+	delay_ns(DELAY_P19);
 	GPIO_SET(pic_mclr);
-	delay_us(DELAY_P7);
+	delay_ns(DELAY_P7);
 
 	/* idle for 5 clock cycles */
-	for (i = 0; i < 5; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 5, true, DELAY_P1B, DELAY_P1A);
 
 }
 
@@ -191,18 +143,34 @@ void dspic33f::exit_program_mode(void)
 {
 	GPIO_CLR(pic_clk);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P16);
+	delay_ns(DELAY_P16);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P17);	/* wait (at least) P17 */
+	delay_ns(DELAY_P17);	/* wait (at least) P17 */
 	GPIO_SET(pic_mclr);
 	GPIO_IN(pic_mclr);
 }
 
+/* use the Programming Executive when there is one */
+bool dspic33f::setup_pe(void)
+{
+	pe_setup(&pe_dspic33f);
+	return true;
+}
+
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t dspic33f::pgc_min_ns(void)
+{
+	return DELAY_P1A.half_min > DELAY_P1B.half_min ?
+			DELAY_P1A.half_min : DELAY_P1B.half_min;
+}
+
 /* read the device ID and revision; returns only the id */
 bool dspic33f::read_device_id(void)
 {
 	bool found = 0;
 
+	pe_leave();
+
 	reset_pc();
 	reset_pc();
 	send_nop();
@@ -233,8 +201,7 @@ bool dspic33f::read_device_id(void)
 			strcpy(name,piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0F80018;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -250,6 +217,10 @@ uint8_t dspic33f::blank_check(void)
 	unsigned short i;
 	uint16_t data[8], raw_data[6];
 	uint8_t ret = 0;
+	int pe_ret;
+
+	if(pe && (pe_ret = pe_blank_check()) >= 0)
+		return pe_ret;
 
 	if(!flags.debug) cerr << "[ 0%]";
 
@@ -348,6 +319,7 @@ uint8_t dspic33f::blank_check(void)
 /* Bulk erase the chip */
 void dspic33f::bulk_erase(void)
 {
+	pe_leave();
 
     reset_pc();
     reset_pc();
@@ -381,6 +353,7 @@ void dspic33f::read(char *outfile, uint32_t start, uint32_t count)
 	uint32_t addr, startaddr, stopaddr;
 	uint16_t data[8], raw_data[6];
 	int i=0;
+	readback *rb;
 
 	startaddr = start;
 	stopaddr = mem.code_memory_size;
@@ -392,7 +365,13 @@ void dspic33f::read(char *outfile, uint32_t start, uint32_t count)
 
 	if(!flags.debug) cerr << "[ 0%]";
 	if(flags.client) fprintf(stdout, "@000");
-	counter=0;
+
+	/* the erased locations are left unfilled */
+	rb = readback_start(&mem, hex_open(outfile, 0, mem.program_memory_size >= 0x10000),
+			RB_SKIP_HALF, 0x00FFFFFF, stopaddr - startaddr);
+
+	if(pe && pe_read(rb, &startaddr, stopaddr))
+		goto configuration;
 
 	/* exit reset vector */
 	reset_pc();
@@ -459,33 +438,20 @@ void dspic33f::read(char *outfile, uint32_t start, uint32_t count)
 		data[7] = (raw_data[4] & 0xFF00) >> 8;
 		data[6] = raw_data[5];
 
-		for(i=0; i<8; i++){
-			if (flags.debug)
+		if (flags.debug)
+			for(i=0; i<8; i++)
 				fprintf(stderr, "\n addr = 0x%06X data = 0x%04X",
 						(addr+i), data[i]);
 
-			if (i%2 == 0 && data[i] != 0xFFFF) {
-				mem.location[addr+i]        = data[i];
-				mem.filled[addr+i]      = 1;
-			}
-
-			if (i%2 == 1 && data[i] != 0x00FF) {
-				mem.location[addr+i]        = data[i];
-				mem.filled[addr+i]      = 1;
-			}
-		}
-
-		if(counter != addr*100/stopaddr){
-			counter = addr*100/stopaddr;
-			if(flags.client)
-				fprintf(stdout,"@%03d", counter);
-			if(!flags.debug)
-				fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
-		}
+		for(i=0; i<8; i+=2)
+			readback_push(rb, addr+i, data[i] | (uint32_t)data[i+1] << 16);
 
 		/* TODO: checksum */
 	}
 
+configuration:
+	pe_leave();
+
 	reset_pc();
 	reset_pc();
 	send_nop();
@@ -503,15 +469,12 @@ void dspic33f::read(char *outfile, uint32_t start, uint32_t count)
 		send_nop();
 		send_nop();
 		data[0] = read_data();
-		if (data[0] != 0xFFFF) {
-			mem.location[addr+2*i] = data[0];
-			mem.filled[addr+2*i] = 1;
-		}
+		readback_push_location(rb, addr+2*i, data[0], 0xFFFF);
 	}
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile);
 }
 
 /* Write contents of the .hex file to the PIC */
@@ -527,13 +490,19 @@ void dspic33f::write(char *infile)
 	const char *regname[] = {"FBS","FSS","FGS","FOSCSEL","FOSC","FWDT","FPOR",
 								"FICD","FUID0","FUID1","FUID2","FUID3"};
 
-	filled_locations = read_inhx(infile, &mem);
+	filled_locations = read_inhx_erase(infile, this);
 	if(!filled_locations) {
 		fprintf(stderr,"\n\n ERROR No filled locations!\n\n");
-		exit(31);
+		fatal(31);
+
 	}
 
-	bulk_erase();
+	/* with the PE, one PROGP per row; ICSP again if it fails */
+	if(pe){
+		if(pe_write())
+			goto code_written;
+		bulk_erase();
+	}
 
 	/* Exit reset vector */
 	reset_pc();
@@ -551,15 +520,10 @@ void dspic33f::write(char *infile)
 
 	for (addr = 0; addr < mem.code_memory_size; ){
 
-		skip = 1;
-
-		for(k=0; k<128; k+=2)
-			if(mem.filled[addr+k]) skip = 0;
-
-		if(skip){
-			addr=addr+128;
-			continue;
-		}
+		/* straight to the next row with something to write */
+		addr = read_inhx_row(&mem, addr, 128);
+		if(addr >= mem.code_memory_size)
+			break;
 
 		send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) );
 		send_cmd(0x880190);
@@ -636,9 +600,17 @@ void dspic33f::write(char *infile)
 		}
 	};
 
+code_written:
 	if(!flags.debug) cerr << "\b\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@100");
 
+	/* --stream: the rest of the file, configuration words included */
+	filled_locations = read_inhx_wait(&mem, filled_locations);
+	if(!filled_locations)
+		fatal(31);
+
+	pe_leave();
+
 	/* WRITE CONFIGURATION REGISTERS */
 	if(flags.debug)
 		cerr << endl << "Writing Configuration registers..." << endl;
@@ -678,14 +650,17 @@ void dspic33f::write(char *infile)
 
 			if(flags.debug)
 				fprintf(stderr,"\n - %s set to 0x%02x",
-						regname[i], mem.location[addr+2*i]);
+						regname[i], (uint16_t)mem.location[addr+2*i]);
 		}
 
 	}
 	if(flags.debug) cerr << endl;
 
 	/* VERIFY CODE MEMORY */
-	if(!flags.noverify){
+	if(!flags.noverify && pe && pe_verify()){
+		if(flags.client) fprintf(stdout, "@FIN");
+	}
+	else if(!flags.noverify){
 		if(!flags.debug) cerr << "[ 0%]";
 		if(flags.client) fprintf(stdout, "@000");
 		counter = 0;
@@ -769,8 +744,8 @@ void dspic33f::write(char *infile)
 
 				if(mem.filled[addr+i] && data[i] != mem.location[addr+i]){
 					fprintf(stderr,"\n\n ERROR at address %06X: written %04X but %04X read!\n\n",
-									addr+i, mem.location[addr+i], data[i]);
-					exit(32);
+									addr+i, (uint16_t)mem.location[addr+i], data[i]);
+					fatal(32);
 				}
 
 			}
@@ -799,6 +774,8 @@ void dspic33f::dump_configuration_registers(void)
 	const char *regname[] = {"FBS","FSS","FGS","FOSCSEL","FOSC","FWDT","FPOR",
 							"FICD","FUID0","FUID1","FUID2","FUID3"};
 
+	pe_leave();
+
 	cerr << endl << "Configuration registers:" << endl << endl;
 
 	reset_pc();
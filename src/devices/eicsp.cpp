@@ -0,0 +1,629 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "eicsp.h"
+
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr pgc_param    DELAY_P1A	(100, 100, 0);		// 100ns, PGC <= 5MHz
+static constexpr pgc_param    DELAY_P1B	(100, 100, 0);		// 100ns
+static constexpr timing_param DELAY_P6	(100, 100, 0);		// 100ns
+static constexpr timing_param DELAY_P7	(50000000, 50000000, 0);	// 50ms, slowest family
+static constexpr timing_param DELAY_P8	(12000, 12000, 0);		// 12us
+static constexpr timing_param DELAY_P9A	(10000, 10000, 0);		// 10us
+static constexpr timing_param DELAY_P18	(1000000, 1000000, 0);	// 1ms
+static constexpr timing_param DELAY_P19	(25, 25, 0);		// 25ns
+static constexpr timing_param DELAY_P21	(1000, 1000, 500000);	// 1us - 500us MAX!
+
+#define ENTER_EICSP_KEY		0x4D434850
+
+/* PE commands: opcode in the upper nibble, length (in words) in the rest */
+#define PE_SCHECK			0x0
+#define PE_READP			0x2
+#define PE_PROGP			0x5
+#define PE_ERASEB			0x7
+#define PE_QBLANK			0xA
+#define PE_QVER				0xB
+#define PE_CRCP				0xC
+
+#define PE_RESPONSE_PASS	0x1
+#define PE_QBLANK_BLANK		0xF0
+
+#define PE_TIMEOUT_NS		5000000000ULL	/* longest command: CRCP/QBLANK */
+#define PE_SCHECK_TIMEOUT_NS	100000000ULL	/* no PE: do not wait for long */
+#define PE_READ_CHUNK		1024			/* instructions per READP */
+#define PE_ROW_MAX			128
+#define PE_NVM_POLLS		1000
+
+/* SIX instructions of the PE download */
+#define MOV_LIT_W(lit, w)	(0x200000 | (((uint32_t)(lit) & 0xFFFF) << 4) | (w))
+#define MOV_W_F(w, f)		(0x880000 | (((f) >> 1) << 4) | (w))
+#define MOV_F_W(f, w)		(0x800000 | (((f) >> 1) << 4) | (w))
+#define BSET_F_15(f)		(0xA8E001 | ((f) & 0x1FFE))
+#define TBLWTL_W0_W2		0xBB0900		/* TBLWTL W0, [W2] */
+#define TBLWTH_W1_W2		0xBB8901		/* TBLWTH W1, [W2] */
+#define GOTO_200			0x040200
+
+static thread_local unsigned int counter = 0;
+
+/* PE words are MSB first, shift_in() returns the first bit in bit 0 */
+static inline uint16_t msb_first(uint32_t bits)
+{
+	uint16_t word = 0;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		word |= ((bits >> i) & 0x01) << (15 - i);
+	return word;
+}
+
+/* Location of an image, the erased value when it is not filled */
+static inline uint16_t image_word(const memory *image, uint32_t i)
+{
+	if (image->filled[i])
+		return image->location[i];
+	return (i & 1) ? 0x00FF : 0xFFFF;
+}
+
+static void progress(uint32_t done, uint32_t total)
+{
+	if (total == 0 || counter == done * 100 / total)
+		return;
+	counter = done * 100 / total;
+	if (flags.client)
+		fprintf(stdout, "@%03d", counter);
+	if (!flags.debug)
+		fprintf(stderr, "\b\b\b\b\b[%2d%%]", counter);
+}
+
+/*
+ * CRC of n instructions as computed by CRCP: CRC-16-CCITT (polynomial
+ * 0x1021, seed 0xFFFF) over the three bytes of every instruction, LSB first.
+ */
+uint16_t eicsp_pic::pe_crc(const memory *image, uint32_t n)
+{
+	uint16_t crc = 0xFFFF, lsw, msb;
+	uint8_t bytes[3];
+	uint32_t i;
+	int b, k;
+
+	for (i = 0; i < n; i++) {
+		lsw = image_word(image, 2 * i);
+		msb = image_word(image, 2 * i + 1);
+		bytes[0] = lsw & 0xFF;
+		bytes[1] = lsw >> 8;
+		bytes[2] = msb & 0xFF;
+		for (b = 0; b < 3; b++) {
+			crc ^= bytes[b] << 8;
+			for (k = 0; k < 8; k++)
+				crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/* Reset the target into Enhanced ICSP, where the PE takes the commands */
+void eicsp_pic::pe_enter(void)
+{
+	GPIO_IN(pic_mclr);
+	GPIO_OUT(pic_mclr);
+
+	GPIO_CLR(pic_clk);
+	pgd_out();
+
+	GPIO_CLR(pic_mclr);		/*  remove VDD from MCLR pin */
+	delay_ns(DELAY_P6);
+	GPIO_SET(pic_mclr);		/*  apply VDD to MCLR pin */
+	delay_ns(DELAY_P21);
+	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
+	delay_ns(DELAY_P18);
+
+	/* Shift in the "enter enhanced ICSP" key sequence (MSB first) */
+	shift_out(ENTER_EICSP_KEY, 32, false, DELAY_P1B, DELAY_P1A);
+	pgd_clr();
+	delay_ns(DELAY_P19);
+	GPIO_SET(pic_mclr);
+	delay_ns(DELAY_P7);
+
+	pe_mode = true;
+}
+
+/* Back to plain ICSP, through the entry sequence of the family */
+void eicsp_pic::icsp_enter(void)
+{
+	exit_program_mode();
+	enter_program_mode();
+	pe_mode = false;
+}
+
+void eicsp_pic::pe_leave(void)
+{
+	if (pe_mode)
+		icsp_enter();
+}
+
+/* The PE stopped answering: the rest of the session goes through ICSP */
+void eicsp_pic::pe_abandon(const char *what)
+{
+	fprintf(stderr, "\nProgramming Executive failed (%s), "
+			"going on with ICSP.\n", what);
+	pe = NULL;
+	pe_leave();
+}
+
+/*
+ * Send a command and fetch the whole response (header and length word
+ * included) into resp. Returns the number of words stored, -1 when the PE
+ * did not answer within timeout_ns or did not pass the command.
+ */
+int eicsp_pic::pe_command(const uint16_t *cmd, uint16_t *resp, int max,
+		uint64_t timeout_ns)
+{
+	int i, len = cmd[0] & 0x0FFF;
+	uint16_t word;
+	uint64_t start;
+
+	PGC_BURST();
+	pgd_out();
+	for (i = 0; i < len; i++)
+		shift_out(cmd[i], 16, false, DELAY_P1B, DELAY_P1A);
+
+	/* the PE holds PGD high while busy, then low when the response is ready */
+	pgd_in();
+	delay_ns(DELAY_P9A);
+	start = delay_ticks();
+	while (GPIO_LEV(pic_data))
+		if (delay_ticks_to_ns(delay_ticks() - start) > timeout_ns) {
+			pgd_out();
+			return -1;
+		}
+	delay_ns(DELAY_P8);
+
+	PGC_BURST();
+	resp[0] = msb_first(shift_in(16, DELAY_P1B, DELAY_P1A));
+	resp[1] = msb_first(shift_in(16, DELAY_P1B, DELAY_P1A));
+	len = resp[1];
+
+	/* clock out all the response anyway, the PE expects it */
+	for (i = 2; i < len; i++) {
+		word = msb_first(shift_in(16, DELAY_P1B, DELAY_P1A));
+		if (i < max)
+			resp[i] = word;
+	}
+	pgd_out();
+
+	if (flags.debug)
+		fprintf(stderr, "\n PE command 0x%04X: response 0x%04X, %d words",
+				cmd[0], resp[0], len);
+
+	if ((resp[0] >> 12) != PE_RESPONSE_PASS ||
+		((resp[0] >> 8) & 0x0F) != (cmd[0] >> 12) || len < 2 || len > max)
+		return -1;
+	return len;
+}
+
+bool eicsp_pic::pe_scheck(void)
+{
+	uint16_t cmd[1] = {PE_SCHECK << 12 | 1}, resp[2];
+
+	return pe_command(cmd, resp, 2, PE_SCHECK_TIMEOUT_NS) == 2;
+}
+
+/* Read n instructions from addr into location[0..2n-1] */
+bool eicsp_pic::pe_readp(uint32_t addr, uint32_t n, uint16_t *location)
+{
+	uint16_t cmd[4] = {PE_READP << 12 | 4, (uint16_t)n,
+					   (uint16_t)(addr >> 16), (uint16_t)(addr & 0xFFFF)};
+	uint16_t resp[2 + PE_READ_CHUNK * 3 / 2 + 2], *w = &resp[2];
+	uint32_t i;
+
+	if (n > PE_READ_CHUNK ||
+		pe_command(cmd, resp, sizeof(resp) / sizeof(resp[0]),
+				PE_TIMEOUT_NS) !=
+			(int)(2 + n / 2 * 3 + (n & 1) * 2))
+		return false;
+
+	/* two instructions every three words: LSW0, MSB1:MSB0, LSW1 */
+	for (i = 0; i + 1 < n; i += 2, w += 3) {
+		location[2 * i] = w[0];
+		location[2 * i + 1] = w[1] & 0x00FF;
+		location[2 * i + 2] = w[2];
+		location[2 * i + 3] = w[1] >> 8;
+	}
+	if (n & 1) {
+		location[2 * i] = w[0];
+		location[2 * i + 1] = w[1] & 0x00FF;
+	}
+	return true;
+}
+
+/* Program the row of image starting at addr, with the unfilled locations erased */
+bool eicsp_pic::pe_progp(uint32_t addr, const memory *image)
+{
+	uint16_t cmd[3 + PE_ROW_MAX * 3 / 2], resp[2], *w = &cmd[3];
+	uint32_t i;
+
+	cmd[0] = PE_PROGP << 12 | (3 + pe->row * 3 / 2);
+	cmd[1] = addr >> 16;
+	cmd[2] = addr & 0xFFFF;
+	for (i = 0; i < pe->row; i += 2, w += 3) {
+		w[0] = image_word(image, addr + 2 * i);
+		w[1] = (image_word(image, addr + 2 * i + 3) << 8) |
+				(image_word(image, addr + 2 * i + 1) & 0x00FF);
+		w[2] = image_word(image, addr + 2 * i + 2);
+	}
+
+	return pe_command(cmd, resp, 2, PE_TIMEOUT_NS) == 2;
+}
+
+/* 1: the n instructions from addr are blank, 0: they are not, -1: error */
+int eicsp_pic::pe_qblank(uint32_t addr, uint32_t n)
+{
+	uint16_t cmd[5] = {PE_QBLANK << 12 | 5,
+					   (uint16_t)(n >> 16), (uint16_t)(n & 0xFFFF),
+					   (uint16_t)(addr >> 16), (uint16_t)(addr & 0xFFFF)};
+	uint16_t resp[2];
+
+	if (pe_command(cmd, resp, 2, PE_TIMEOUT_NS) != 2)
+		return -1;
+	return (resp[0] & 0xFF) == PE_QBLANK_BLANK;
+}
+
+bool eicsp_pic::pe_crcp(uint32_t addr, uint32_t n, uint16_t *crc)
+{
+	uint16_t cmd[5] = {PE_CRCP << 12 | 5,
+					   (uint16_t)(addr >> 16), (uint16_t)(addr & 0xFFFF),
+					   (uint16_t)(n >> 16), (uint16_t)(n & 0xFFFF)};
+	uint16_t resp[3];
+
+	if (pe_command(cmd, resp, 3, PE_TIMEOUT_NS) != 3)
+		return false;
+	*crc = resp[2];
+	return true;
+}
+
+/* Exit reset vector */
+void eicsp_pic::six_reset(void)
+{
+	send_cmd(0x000000);
+	send_cmd(0x000000);
+	send_cmd(0x000000);
+	send_cmd(GOTO_200);
+	send_cmd(0x000000);
+	send_cmd(0x000000);
+	send_cmd(0x000000);
+}
+
+/*
+ * Start an NVM operation on addr (page erase or row write of the latches)
+ * and wait for WR to clear.
+ */
+bool eicsp_pic::six_nvm_write(uint16_t nvmcon, uint32_t addr)
+{
+	uint16_t v;
+	int polls;
+
+	if (pe->nvmadr) {
+		send_cmd(MOV_LIT_W(addr & 0xFFFF, 0));
+		send_cmd(MOV_W_F(0, pe->nvmadr));
+		send_cmd(MOV_LIT_W(addr >> 16, 0));
+		send_cmd(MOV_W_F(0, pe->nvmadru));
+	}
+	else if (nvmcon == pe->erase_page) {
+		/* a dummy table write selects the page */
+		send_cmd(MOV_LIT_W(addr >> 16, 0));
+		send_cmd(MOV_W_F(0, pe->tblpag));
+		send_cmd(MOV_LIT_W(addr & 0xFFFF, 2));
+		send_cmd(TBLWTL_W0_W2);
+		send_cmd(0x000000);
+		send_cmd(0x000000);
+	}
+
+	send_cmd(MOV_LIT_W(nvmcon, 0));
+	send_cmd(MOV_W_F(0, pe->nvmcon));
+	if (pe->nvmkey) {
+		send_cmd(MOV_LIT_W(0x55, 0));
+		send_cmd(MOV_W_F(0, pe->nvmkey));
+		send_cmd(MOV_LIT_W(0xAA, 0));
+		send_cmd(MOV_W_F(0, pe->nvmkey));
+	}
+	send_cmd(BSET_F_15(pe->nvmcon));
+	send_cmd(0x000000);
+	send_cmd(0x000000);
+	send_cmd(0x000000);
+
+	for (polls = 0; polls < PE_NVM_POLLS; polls++) {
+		send_cmd(MOV_F_W(pe->nvmcon, 0));
+		send_cmd(MOV_W_F(0, pe->visi));
+		send_cmd(0x000000);
+		v = read_data();
+		send_cmd(0x000000);
+		six_reset();
+		if (!(v & 0x8000))
+			return true;
+		delay_us(100);
+	}
+	return false;
+}
+
+/* Program the PE image of file into executive memory, through ICSP */
+bool eicsp_pic::pe_download(const char *file)
+{
+	memory image;
+	uint32_t addr, latch, i;
+	bool ok = true;
+
+	image.program_memory_size = pe->exec_size;
+	if (!read_inhx((char *)file, &image, pe->exec_base * 2)) {
+		fprintf(stderr, "Cannot load the Programming Executive from %s\n", file);
+		return false;
+	}
+
+	fprintf(stderr, "Downloading the %s Programming Executive...\n", pe->name);
+	six_reset();
+
+	for (addr = 0; addr < pe->exec_size && ok; addr += pe->page)
+		ok = six_nvm_write(pe->erase_page, pe->exec_base + addr);
+
+	for (addr = 0; addr < pe->exec_size && ok; addr += 2 * pe->write_size) {
+		addr = image.next_row(addr, 2 * pe->write_size);
+		if (addr >= pe->exec_size)
+			break;
+
+		latch = pe->latches_fa ? 0xFA0000 : pe->exec_base + addr;
+		send_cmd(MOV_LIT_W(latch >> 16, 0));
+		send_cmd(MOV_W_F(0, pe->tblpag));
+		for (i = 0; i < pe->write_size; i++) {
+			send_cmd(MOV_LIT_W(image_word(&image, addr + 2 * i), 0));
+			send_cmd(MOV_LIT_W(image_word(&image, addr + 2 * i + 1), 1));
+			send_cmd(MOV_LIT_W((latch + 2 * i) & 0xFFFF, 2));
+			send_cmd(TBLWTL_W0_W2);
+			send_cmd(0x000000);
+			send_cmd(0x000000);
+			send_cmd(TBLWTH_W1_W2);
+			send_cmd(0x000000);
+			send_cmd(0x000000);
+		}
+		ok = six_nvm_write(pe->write_row, pe->exec_base + addr);
+	}
+
+	if (!ok)
+		fprintf(stderr, "Executive memory write timed out.\n");
+	return ok;
+}
+
+/* The --pe image of a family: the file itself, or <file>.hex in a directory */
+static const char *pe_image(const pe_family *family, char *path, size_t size)
+{
+	struct stat st;
+
+	if (flags.pe_file == NULL || stat(flags.pe_file, &st) != 0 ||
+		!S_ISDIR(st.st_mode))
+		return flags.pe_file;
+
+	snprintf(path, size, "%s/%s.hex", flags.pe_file, family->file);
+	return path;
+}
+
+/*
+ * Look for a working PE (already resident, or downloaded from --pe) and
+ * leave the target in ICSP mode: the device ID, the configuration
+ * registers and the erase keep going through SIX.
+ */
+bool eicsp_pic::pe_setup(const pe_family *family)
+{
+	uint16_t cmd[1] = {PE_QVER << 12 | 1}, resp[2];
+	char path[PATH_MAX];
+	const char *image;
+
+	pe = NULL;
+	if (gang_count || flags.nope)
+		return false;
+
+	pe = family;
+	pe_enter();
+	if (!pe_scheck()) {
+		icsp_enter();
+		image = pe_image(family, path, sizeof(path));
+		if (image == NULL || !pe_download(image)) {
+			if (flags.debug || image)
+				fprintf(stderr, "No %s Programming Executive, using ICSP.\n",
+						family->name);
+			pe = NULL;
+			return false;
+		}
+		pe_enter();
+		if (!pe_scheck()) {
+			fprintf(stderr, "The %s Programming Executive does not answer, "
+					"using ICSP.\n", family->name);
+			icsp_enter();
+			pe = NULL;
+			return false;
+		}
+	}
+
+	if (pe_command(cmd, resp, 2, PE_TIMEOUT_NS) == 2)
+		pe_version = resp[0] & 0xFF;
+	fprintf(stderr, "Using the %s Programming Executive v%d.%d\n",
+			family->name, pe_version >> 4, pe_version & 0x0F);
+
+	icsp_enter();
+	return true;
+}
+
+/* Erase the whole user memory (not the executive memory) with ERASEB */
+bool eicsp_pic::pe_bulk_erase(void)
+{
+	uint16_t cmd[1] = {PE_ERASEB << 12 | 1}, resp[2];
+
+	if (!pe_mode)
+		pe_enter();
+	if (pe_command(cmd, resp, 2, PE_TIMEOUT_NS) != 2) {
+		pe_abandon("erase");
+		return false;
+	}
+	return true;
+}
+
+/* Blank check of the code memory with QBLANK; -1: PE failure */
+int eicsp_pic::pe_blank_check(void)
+{
+	int blank;
+
+	if (!pe_mode)
+		pe_enter();
+	blank = pe_qblank(0, (mem.code_memory_size + 1) / 2);
+	if (blank < 0) {
+		pe_abandon("blank check");
+		return -1;
+	}
+	return !blank;
+}
+
+/*
+ * Read [*startaddr, stopaddr) of code memory with READP into the readback
+ * of the caller. On a PE failure *startaddr is left at the first location
+ * not read, for the ICSP read to go on from there.
+ */
+bool eicsp_pic::pe_read(readback *rb, uint32_t *startaddr, uint32_t stopaddr)
+{
+	uint16_t data[2 * PE_READ_CHUNK];
+	uint32_t addr, n, i;
+
+	if (!pe_mode)
+		pe_enter();
+
+	*startaddr &= ~1;
+	for (addr = *startaddr; addr < stopaddr; addr += 2 * n) {
+		n = (stopaddr - addr + 1) / 2;
+		if (n > PE_READ_CHUNK)
+			n = PE_READ_CHUNK;
+
+		if (!pe_readp(addr, n, data)) {
+			*startaddr = addr;
+			pe_abandon("read");
+			return false;
+		}
+
+		if (flags.debug)
+			for (i = 0; i < 2 * n; i++)
+				fprintf(stderr, "\n addr = 0x%06X data = 0x%04X",
+						addr + i, data[i]);
+
+		for (i = 0; i < 2 * n; i += 2)
+			readback_push(rb, addr + i, data[i] | (uint32_t)data[i + 1] << 16);
+	}
+
+	return true;
+}
+
+/* Program every non-empty row of code memory with PROGP */
+bool eicsp_pic::pe_write(void)
+{
+	uint32_t addr, rowsize = 2 * pe->row;
+
+	if (!pe_mode)
+		pe_enter();
+
+	if (!flags.debug) cerr << "[ 0%]";
+	if (flags.client) fprintf(stdout, "@000");
+	counter = 0;
+
+	for (addr = 0; addr < mem.code_memory_size; addr += rowsize) {
+		/* straight to the next row with something to write */
+		addr = read_inhx_row(&mem, addr, rowsize);
+		if (addr >= mem.code_memory_size)
+			break;
+
+		if (flags.debug)
+			fprintf(stderr, "\n  Writing row at 0x%06X", addr);
+
+		if (!pe_progp(addr, &mem)) {
+			if (!flags.debug) cerr << "\b\b\b\b\b";
+			pe_abandon("write");
+			return false;
+		}
+
+		progress(addr, mem.code_memory_size);
+	}
+
+	return true;
+}
+
+/*
+ * Verify code memory: a single CRCP over all of it when the PE has it,
+ * READP and compare to locate the error (or when there is no CRCP).
+ * A mismatch is fatal, as with ICSP; false means that the PE failed.
+ */
+bool eicsp_pic::pe_verify(void)
+{
+	uint16_t data[2 * PE_READ_CHUNK], crc;
+	uint32_t n = (mem.code_memory_size + 1) / 2;
+	uint32_t addr, i, chunk;
+
+	if (!pe_mode)
+		pe_enter();
+
+	if (pe->crcp) {
+		if (!pe_crcp(0, n, &crc)) {
+			pe_abandon("verify");
+			return false;
+		}
+		if (crc == pe_crc(&mem, n))
+			return true;
+		fprintf(stderr, "\nCode memory CRC mismatch, looking for the error...");
+	}
+
+	for (addr = 0; addr < 2 * n; addr += 2 * chunk) {
+		chunk = n - addr / 2;
+		if (chunk > PE_READ_CHUNK)
+			chunk = PE_READ_CHUNK;
+
+		for (i = 0; i < 2 * chunk; i++)
+			if (mem.filled[addr + i])
+				break;
+		if (i == 2 * chunk)
+			continue;
+
+		if (!pe_readp(addr, chunk, data)) {
+			pe_abandon("verify");
+			return false;
+		}
+
+		for (i = 0; i < 2 * chunk; i++)
+			if (mem.filled[addr + i] && data[i] != mem.location[addr + i]) {
+				fprintf(stderr, "\n\n ERROR at address %06X: written %04X but %04X read!\n\n",
+						addr + i, (uint16_t)mem.location[addr + i], data[i]);
+				fatal(32);
+			}
+	}
+
+	if (pe->crcp) {
+		fprintf(stderr, "\n\n ERROR: code memory CRC mismatch outside of the written locations!\n\n");
+		fatal(32);
+	}
+	return true;
+}
@@ -0,0 +1,102 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EICSP_H_
+#define EICSP_H_
+
+#include <iostream>
+
+#include "../common.h"
+#include "device.h"
+
+using namespace std;
+
+/*
+ * Programming Executive of the dsPIC33/PIC24 families, reached through the
+ * Enhanced ICSP protocol: instead of clocking every TBLWT and NVMCON poll
+ * through SIX instructions, the host sends one command per row (PROGP) or
+ * per memory range (READP, QBLANK, CRCP) and the PE runs the flash loops on
+ * the target.
+ *
+ * The PE is used when it answers a sanity check: either it is already in
+ * executive memory, or it is downloaded there (through the family SIX path)
+ * from the file given with --pe, or from <file>.hex when --pe names a
+ * directory. Otherwise, and in gang mode, the drivers keep using plain ICSP.
+ */
+struct pe_family {
+	const char *name;
+	const char *file;			/* PE image in a --pe directory */
+	uint32_t exec_base;			/* executive memory holding the PE */
+	uint32_t exec_size;			/* PC units */
+	uint32_t page;				/* erase page, PC units */
+	uint16_t row;				/* instructions per PROGP */
+	/* SFR byte addresses, nvmadr = 0: the page/row is selected by TBLWT */
+	uint16_t tblpag, nvmcon, nvmadr, nvmadru, nvmkey, visi;
+	uint16_t erase_page;		/* NVMCON values */
+	uint16_t write_row;
+	uint16_t write_size;		/* instructions of a write_row: row or double word */
+	bool latches_fa;			/* write latches at 0xFA0000 */
+	bool crcp;					/* PE implements CRCP */
+};
+
+class eicsp_pic : public Pic {
+
+	public:
+		eicsp_pic(uint8_t sf=0) : Pic(sf) {};
+
+	protected:
+		/* ICSP primitives of the family driver */
+		virtual void send_cmd(uint32_t cmd) = 0;
+		virtual uint16_t read_data(void) = 0;
+
+		const pe_family *pe = NULL;		/* PE in use, NULL: plain ICSP */
+		bool pe_mode = false;			/* in Enhanced ICSP right now */
+		uint8_t pe_version = 0;
+
+		bool pe_setup(const pe_family *family);
+		void pe_enter(void);
+		void icsp_enter(void);
+		void pe_leave(void);
+		void pe_abandon(const char *what);
+
+		bool pe_readp(uint32_t addr, uint32_t n, uint16_t *location);
+		bool pe_progp(uint32_t addr, const memory *image);
+		int pe_qblank(uint32_t addr, uint32_t n);
+		bool pe_crcp(uint32_t addr, uint32_t n, uint16_t *crc);
+
+		/* whole operations on mem; on a PE failure they fall back to ICSP */
+		bool pe_bulk_erase(void);
+		int pe_blank_check(void);
+		bool pe_read(readback *rb, uint32_t *startaddr, uint32_t stopaddr);
+		bool pe_write(void);
+		bool pe_verify(void);
+
+		static uint16_t pe_crc(const memory *image, uint32_t n);
+
+	private:
+		int pe_command(const uint16_t *cmd, uint16_t *resp, int max,
+				uint64_t timeout_ns);
+		bool pe_scheck(void);
+		void six_reset(void);
+		bool six_nvm_write(uint16_t nvmcon, uint32_t addr);
+		bool pe_download(const char *file);
+};
+
+#endif /* EICSP_H_ */
@@ -25,19 +25,22 @@
 
 #include "pic10f322.h"
 
-/* delays (in microseconds) */
-#define DELAY_SETUP	1
-#define	DELAY_HOLD	1
-#define DELAY_TENTS	1
-#define DELAY_TENTH	250
-#define DELAY_TCKH	1
-#define DELAY_TCKL 	1
-#define DELAY_TCO 	1
-#define DELAY_TDLY	1
-#define DELAY_TERAB	5000
-#define DELAY_TEXIT	1
-#define DELAY_TPINT_DATA	2500
-#define DELAY_TPINT_CONF	5000
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_SETUP	(100, 100, 0);
+static constexpr timing_param DELAY_HOLD	(100, 100, 0);
+static constexpr timing_param DELAY_TENTS	(100, 100, 0);
+static constexpr timing_param DELAY_TENTH	(250000, 250000, 0);
+static constexpr pgc_param    DELAY_TCKH	(100, 100, 0);
+static constexpr pgc_param    DELAY_TCKL 	(100, 100, 0);
+static constexpr timing_param DELAY_TCO 	(80, 80, 0);
+static constexpr timing_param DELAY_TDLY	(1000, 1000, 0);
+static constexpr timing_param DELAY_TERAB	(5000000, 5000000, 0);
+static constexpr timing_param DELAY_TEXIT	(1000, 1000, 0);
+static constexpr timing_param DELAY_TPINT_DATA	(2500000, 2500000, 0);
+static constexpr timing_param DELAY_TPINT_CONF	(5000000, 5000000, 0);
+
+/* read_data() samples PGD at the end of TCKH, also at a tuned PGC rate */
+static_assert(DELAY_TCKH.half_min > DELAY_TCO.typ, "TCKH must cover TCO");
 
 /* commands for programming */
 #define COMM_LOAD_CONFIG	0x00
@@ -52,35 +55,22 @@
 
 void pic10f322::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_IN(pic_mclr);
 	GPIO_OUT(pic_mclr);
 
 	GPIO_SET(pic_mclr);			/* apply VDD to MCLR pin */
-	delay_us(DELAY_TENTS);	/* wait TENTS */
+	delay_ns(DELAY_TENTS);	/* wait TENTS */
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
 	GPIO_CLR(pic_clk);
-	delay_us(DELAY_TENTH);		/* wait TENTH */
+	delay_ns(DELAY_TENTH);		/* wait TENTH */
 	/* Shift in the "enter program mode" key sequence (LSB! first) */
-	for (i = 0; i < 32; i++) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-
-		delay_us(DELAY_TCKL);	/* Setup time */
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_TCKH);	/* Hold time */
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, true, DELAY_TCKH, DELAY_TCKL);
 	GPIO_CLR(pic_data);
 
 	//Last clock(Don't care data)
-	delay_us(DELAY_TCKL);	/* Setup time */
+	delay_ns(DELAY_TCKL);	/* Setup time */
 	GPIO_SET(pic_clk);
-	delay_us(DELAY_TCKH);	/* Hold time */
+	delay_ns(DELAY_TCKH);	/* Hold time */
 	GPIO_CLR(pic_clk);
 
 }
@@ -95,40 +85,23 @@ void pic10f322::exit_program_mode(void)
 }
 
 /* Send a 4-bit command to the PIC (LSB first) */
-void pic10f322::send_cmd(uint8_t cmd, unsigned int delay)
+void pic10f322::send_cmd(uint8_t cmd, const timing_param &delay)
 {
-	int i;
-
-	for (i = 0; i < 6; i++) {
-		GPIO_SET(pic_clk);
-		if ( (cmd >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_TCKH);	/* Setup time */
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_TCKL);	/* Hold time */
-	}
+	PGC_BURST();
+	shift_out(cmd, 6, true, DELAY_TCKH, DELAY_TCKL);
 	GPIO_CLR(pic_data);
-	delay_us(delay);
+	delay_ns(delay);
 }
 
 /* Read 8-bit data from the PIC (LSB first) */
 uint16_t pic10f322::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0x0000;
 
+	PGC_BURST();
 	GPIO_IN(pic_data);
 
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_TCKH);
-		delay_us(DELAY_TCO);	/* Wait for data to be valid */
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_TCKL);
-	}
+	data = shift_in(16, DELAY_TCKH, DELAY_TCKL);	/* TCKH > TCO */
 
 	GPIO_IN(pic_data);
 	GPIO_OUT(pic_data);
@@ -139,19 +112,10 @@ uint16_t pic10f322::read_data(void)
 /* Load 16-bit data to the PIC (LSB first) */
 void pic10f322::write_data(uint16_t data)
 {
-	int i;
 	data <<= 1;
 
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		if ( (data >> i) & 0x0001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_SETUP);	/* Setup time */
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_HOLD);	/* Hold time */
-	}
+	PGC_BURST();
+	shift_out(data, 16, true, DELAY_SETUP, DELAY_HOLD);
 	GPIO_CLR(pic_data);
 }
 
@@ -161,6 +125,13 @@ void pic10f322::reset_mem_location(void)
 	send_cmd(COMM_RESET_ADDR, DELAY_TDLY);
 }
 
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t pic10f322::pgc_min_ns(void)
+{
+	return DELAY_TCKH.half_min > DELAY_TCKL.half_min ?
+			DELAY_TCKH.half_min : DELAY_TCKL.half_min;
+}
+
 /* Read PIC device id word */
 bool pic10f322::read_device_id(void)
 {
@@ -185,8 +156,7 @@ bool pic10f322::read_device_id(void)
 			strcpy(name,piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0F80018;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -286,16 +256,29 @@ void pic10f322::bulk_erase(void)
 void pic10f322::read(char *outfile, uint32_t start, uint32_t count)
 {
 	uint16_t addr, data = 0x0000;
+	uint32_t stopaddr;
+	readback *rb;
+
+	stopaddr = mem.code_memory_size;
+	if(count != 0 && start + count < stopaddr){
+		stopaddr = start + count;
+		fprintf(stderr, "Read only %d memory locations, from %04X to %04X\n",
+				count, start, stopaddr);
+	}
 
 	if(!flags.debug) cerr << "[ 0%]";
 	if(flags.client) fprintf(stdout, "@000");
-	unsigned int lcounter = 0;
+
+	rb = readback_start(&mem, hex_open(outfile, 0, mem.program_memory_size >= 0x10000),
+			RB_SKIP_HALF, 0xFFFFFFFF, stopaddr - start);
 
 	/* Read Memory */
 
 	reset_mem_location();
+	for (addr = 0; addr < start && addr < stopaddr; addr++)
+		send_cmd(COMM_INC_ADDR, DELAY_TDLY);
 
-	for (addr = 0; addr < mem.code_memory_size; addr++) {
+	for (addr = start; addr < stopaddr; addr++) {
 		send_cmd(COMM_READ_FROM_PROG, DELAY_TDLY);
 		data = read_data() & 0x3FFF;
 		send_cmd(COMM_INC_ADDR, DELAY_TDLY);
@@ -303,18 +286,7 @@ void pic10f322::read(char *outfile, uint32_t start, uint32_t count)
 		if (flags.debug)
 			fprintf(stderr, "  addr = 0x%04X  data = 0x%04X\n", addr, data);
 
-		if (data != 0x3FFF) {
-			mem.location[addr]        = data;
-			mem.filled[addr]      = 1;
-		}
-
-		if(lcounter != addr*100/mem.code_memory_size){
-			if(flags.client)
-				fprintf(stderr,"RED@%2d\n", (addr*100/mem.code_memory_size));
-			if(!flags.debug)
-				fprintf(stderr,"\b\b\b\b%2d%%]", addr*100/mem.code_memory_size);
-			lcounter = addr*100/mem.code_memory_size;
-		}
+		readback_push_location(rb, addr, data, 0x3FFF);
 	}
 	/* Read Confuguration Fuses */
 	send_cmd(COMM_LOAD_CONFIG, DELAY_TDLY);
@@ -335,10 +307,7 @@ void pic10f322::read(char *outfile, uint32_t start, uint32_t count)
 	if (flags.debug)
 		fprintf(stderr, "  addr = 0x%04X  data = 0x%04X\n", addr, data);
 
-	if (data != 0x3FFF) {
-		mem.location[addr]        = data;
-		mem.filled[addr]      = 1;
-	}
+	readback_push_location(rb, addr, data, 0x3FFF);
 	/* Config Word 2 */
 	if((detailed_subfamily == SF_PIC12F1822) || (detailed_subfamily == SF_PIC16LF1826)){
 		uint16_t mask = 0x3FFF;
@@ -355,15 +324,12 @@ void pic10f322::read(char *outfile, uint32_t start, uint32_t count)
 		if (flags.debug)
 			fprintf(stderr, "  addr = 0x%04X  data = 0x%04X\n", addr, data);
 
-		if (data != mask) {
-			mem.location[addr]        = data;
-			mem.filled[addr]      = 1;
-		}
+		readback_push_location(rb, addr, data, mask);
 	}
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile);
 }
 
 /* Bulk erase the chip, and then write contents of the .hex file to the PIC */
@@ -391,7 +357,7 @@ void pic10f322::write(char *infile)
 		for(i=0; i<latch_size-1; i++){		                        /* write the first 62 bytes */
 			if (mem.filled[addr+i]) {
 				if (flags.debug)
-					fprintf(stderr, "  Writing 0x%04X to address 0x%06X \n", mem.location[addr + i], (addr+i) );
+					fprintf(stderr, "  Writing 0x%04X to address 0x%06X \n", (uint16_t)mem.location[addr + i], (addr+i) );
 				send_cmd(COMM_LOAD_FOR_PROG, DELAY_TDLY);
 				write_data(mem.location[addr+i]);
 			}
@@ -407,7 +373,7 @@ void pic10f322::write(char *infile)
 		/* write the last 2 bytes and start programming */
 		if (mem.filled[addr+latch_size-1]) {
 			if (flags.debug)
-				fprintf(stderr, "  Writing 0x%04X to address 0x%06X and then start programming...\n", mem.location[addr+latch_size-1], (addr+latch_size-1));
+				fprintf(stderr, "  Writing 0x%04X to address 0x%06X and then start programming...\n", (uint16_t)mem.location[addr+latch_size-1], (addr+latch_size-1));
 			send_cmd(COMM_LOAD_FOR_PROG, DELAY_TDLY);
 			write_data(mem.location[addr+latch_size-1]);
 		}
@@ -485,8 +451,8 @@ void pic10f322::write(char *infile)
 
 			if ( (data != mem.location[addr]) & ( mem.filled[addr]) ) {
 				fprintf(stderr, "Error at addr = 0x%06X:  pic = 0x%04X, file = 0x%04X.\nExiting...",
-						addr, data, mem.location[addr]);
-				exit(32);
+						addr, data, (uint16_t)mem.location[addr]);
+				fatal(32);
 			}
 			if(lcounter != addr*100/mem.code_memory_size){
 				lcounter = addr*100/mem.code_memory_size;
@@ -523,7 +489,7 @@ void pic10f322::write(char *infile)
 		if ( ( data != fileconf ) & ( mem.filled[addr] ) ) {
 			fprintf(stderr, "Error at addr = 0x%06X:  pic = 0x%04X, file = 0x%04X.\nExiting...",
 					addr, data, mem.location[addr] & mask);
-			exit(32);
+			fatal(32);
 		}
 
 		/* Config Word 2 */
@@ -544,7 +510,7 @@ void pic10f322::write(char *infile)
 			if ( ( data != fileconf ) & ( mem.filled[addr] ) ) {
 				fprintf(stderr, "Error at addr = 0x%06X:  pic = 0x%04X, file = 0x%04X.\nExiting...",
 						addr, data & mask, mem.location[addr] & mask);
-				exit(32);
+				fatal(32);
 			}
 		}
 
@@ -47,6 +47,7 @@ class pic10f322: public Pic{
 		void exit_program_mode(void);
 		bool setup_pe(void){return true;};
 		bool read_device_id(void);
+		uint32_t pgc_min_ns(void);
 		void bulk_erase(void);
 		void dump_configuration_registers(void);
 		void read(char *outfile, uint32_t start, uint32_t count);
@@ -54,7 +55,7 @@ class pic10f322: public Pic{
 		uint8_t blank_check(void);
 
 	protected:
-		void send_cmd(uint8_t cmd, unsigned int delay);
+		void send_cmd(uint8_t cmd, const timing_param &delay);
 		uint16_t read_data(void);
 		void write_data(uint16_t data);
 		void reset_mem_location(void);
@@ -26,19 +26,22 @@
 
 #include "pic16f183xx.h"
 
-/* delays (in microseconds) */
-#define DELAY_SETUP	1
-#define	DELAY_HOLD	1
-#define DELAY_TENTS	1
-#define DELAY_TENTH	250
-#define DELAY_TCKH	1
-#define DELAY_TCKL 	1
-#define DELAY_TCO 	1
-#define DELAY_TDLY	1
-#define DELAY_TERAB	5000
-#define DELAY_TEXIT	1
-#define DELAY_TPINT_DATA	2500
-#define DELAY_TPINT_CONF	5000
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_SETUP	(100, 100, 0);
+static constexpr timing_param DELAY_HOLD	(100, 100, 0);
+static constexpr timing_param DELAY_TENTS	(100, 100, 0);
+static constexpr timing_param DELAY_TENTH	(250000, 250000, 0);
+static constexpr pgc_param    DELAY_TCKH	(100, 100, 0);
+static constexpr pgc_param    DELAY_TCKL 	(100, 100, 0);
+static constexpr timing_param DELAY_TCO 	(80, 80, 0);
+static constexpr timing_param DELAY_TDLY	(1000, 1000, 0);
+static constexpr timing_param DELAY_TERAB	(5000000, 5000000, 0);
+static constexpr timing_param DELAY_TEXIT	(1000, 1000, 0);
+static constexpr timing_param DELAY_TPINT_DATA	(2500000, 2500000, 0);
+static constexpr timing_param DELAY_TPINT_CONF	(5000000, 5000000, 0);
+
+/* read_data() samples PGD at the end of TCKH, also at a tuned PGC rate */
+static_assert(DELAY_TCKH.half_min > DELAY_TCO.typ, "TCKH must cover TCO");
 
 /* commands for programming */
 #define COMM_LOAD_CONFIG			0x00
@@ -58,35 +61,22 @@
 
 void pic16f183xx::enter_program_mode(void)
 {
-	int i;
-
 	//GPIO_IN(pic_mclr);
 	GPIO_OUT(pic_mclr);
 
 	GPIO_SET(pic_mclr);			/* apply VDD to MCLR pin */
-	delay_us(DELAY_TENTS);	/* wait TENTS */
+	delay_ns(DELAY_TENTS);	/* wait TENTS */
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
 	GPIO_CLR(pic_clk);
-	delay_us(DELAY_TENTH);		/* wait TENTH */
+	delay_ns(DELAY_TENTH);		/* wait TENTH */
 	/* Shift in the "enter program mode" key sequence (LSB! first) */
-	for (i = 0; i < 32; i++) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-
-		delay_us(DELAY_TCKL);	/* Setup time */
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_TCKH);	/* Hold time */
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, true, DELAY_TCKH, DELAY_TCKL);
 	GPIO_CLR(pic_data);
 
 	//Last clock(Don't care data)
-	delay_us(DELAY_TCKL);	/* Setup time */
+	delay_ns(DELAY_TCKL);	/* Setup time */
 	GPIO_SET(pic_clk);
-	delay_us(DELAY_TCKH);	/* Hold time */
+	delay_ns(DELAY_TCKH);	/* Hold time */
 	GPIO_CLR(pic_clk);
 
 	delay_us(10);	/* Hold time */
@@ -102,40 +92,23 @@ void pic16f183xx::exit_program_mode(void)
 }
 
 /* Send a 6-bit command to the PIC (LSB first) */
-void pic16f183xx::send_cmd(uint8_t cmd, unsigned int delay)
+void pic16f183xx::send_cmd(uint8_t cmd, const timing_param &delay)
 {
-	int i;
-
-	for (i = 0; i < 6; i++) {
-		GPIO_SET(pic_clk);
-		if ( (cmd >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_TCKH);	/* Setup time */
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_TCKL);	/* Hold time */
-	}
+	PGC_BURST();
+	shift_out(cmd, 6, true, DELAY_TCKH, DELAY_TCKL);
 	GPIO_CLR(pic_data);
-	delay_us(delay);
+	delay_ns(delay);
 }
 
 /* Read 16-bit data from the PIC (LSB first) */
 uint16_t pic16f183xx::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0x0000;
 
+	PGC_BURST();
 	GPIO_IN(pic_data);
 
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_TCKH);
-		delay_us(DELAY_TCO);	/* Wait for data to be valid */
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_TCKL);
-	}
+	data = shift_in(16, DELAY_TCKH, DELAY_TCKL);	/* TCKH > TCO */
 
 	GPIO_IN(pic_data);
 	GPIO_OUT(pic_data);
@@ -146,19 +119,10 @@ uint16_t pic16f183xx::read_data(void)
 /* Load 16-bit data to the PIC (LSB first) */
 void pic16f183xx::write_data(uint16_t data)
 {
-	int i;
 	data <<= 1;
 
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		if ( (data >> i) & 0x0001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_SETUP);	/* Setup time */
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_HOLD);	/* Hold time */
-	}
+	PGC_BURST();
+	shift_out(data, 16, true, DELAY_SETUP, DELAY_HOLD);
 	GPIO_CLR(pic_data);
 }
 
@@ -167,23 +131,21 @@ void pic16f183xx::set_address(uint32_t addr)
 {
 	send_cmd(COMM_LOAD_PC_ADDR, DELAY_TDLY);
 
-	int i;
 	addr <<= 1;
 
-	for (i = 0; i < 24; i++) {
-		GPIO_SET(pic_clk);
-		if ( (addr >> i) & 0x0001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_SETUP);	/* Setup time */
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_HOLD);	/* Hold time */
-	}
+	PGC_BURST();
+	shift_out(addr, 24, true, DELAY_SETUP, DELAY_HOLD);
 	GPIO_CLR(pic_data);
 	delay_us(10);
 }
 
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t pic16f183xx::pgc_min_ns(void)
+{
+	return DELAY_TCKH.half_min > DELAY_TCKL.half_min ?
+			DELAY_TCKH.half_min : DELAY_TCKL.half_min;
+}
+
 /* Read PIC device id word */
 bool pic16f183xx::read_device_id(void)
 {
@@ -214,8 +176,7 @@ bool pic16f183xx::read_device_id(void)
 			strcpy(name,piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0F80018;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -286,7 +247,7 @@ void pic16f183xx::bulk_erase(void)
 void pic16f183xx::read(char *outfile, uint32_t start, uint32_t count)
 {
 	fprintf(stderr, "\nERROR: Read Chip is not implemented!\n");
-	exit(99);
+	fatal(99);
 }
 
 /* Bulk erase the chip, and then write contents of the .hex file to the PIC */
@@ -313,7 +274,7 @@ void pic16f183xx::write(char *infile)
 		for(i=0; i<latch_size-1; i++){		                        /* write the first 62 bytes */
 			if (mem.filled[addr+i]) {
 				if (flags.debug)
-					fprintf(stderr, "  Writing 0x%04X to address 0x%06X \n", mem.location[addr + i], (addr+i) );
+					fprintf(stderr, "  Writing 0x%04X to address 0x%06X \n", (uint16_t)mem.location[addr + i], (addr+i) );
 				send_cmd(COMM_LOAD_FOR_NVM_J, DELAY_TDLY);
 				write_data(mem.location[addr+i]);
 			}
@@ -328,7 +289,7 @@ void pic16f183xx::write(char *infile)
 		/* write the last 2 bytes and start programming */
 		if (mem.filled[addr+latch_size-1]) {
 			if (flags.debug)
-				fprintf(stderr, "  Writing 0x%04X to address 0x%06X and then start programming...\n", mem.location[addr+latch_size-1], (addr+latch_size-1));
+				fprintf(stderr, "  Writing 0x%04X to address 0x%06X and then start programming...\n", (uint16_t)mem.location[addr+latch_size-1], (addr+latch_size-1));
 			send_cmd(COMM_LOAD_FOR_NVM, DELAY_TDLY);
 			write_data(mem.location[addr+latch_size-1]);
 		}
@@ -366,7 +327,7 @@ void pic16f183xx::write(char *infile)
 	for(i=0; i<3; i++){
 		if (mem.filled[addr+i]) {
 			if (flags.debug)
-				fprintf(stderr, "  Writing 0x%04X to config address 0x%06X \n", mem.location[addr + i], (addr+i) );
+				fprintf(stderr, "  Writing 0x%04X to config address 0x%06X \n", (uint16_t)mem.location[addr + i], (addr+i) );
 			send_cmd(COMM_LOAD_FOR_NVM, DELAY_TDLY);
 			write_data(mem.location[addr+i]);
 			send_cmd(COMM_BEGIN_IN_TIMED_PROG, DELAY_TPINT_CONF);
@@ -394,8 +355,8 @@ void pic16f183xx::write(char *infile)
 
 			if ( (data != mem.location[addr]) & ( mem.filled[addr]) ) {
 				fprintf(stderr, "Error at addr = 0x%06X:  pic = 0x%04X, file = 0x%04X.\nExiting...",
-						addr, data, mem.location[addr]);
-				exit(32);
+						addr, data, (uint16_t)mem.location[addr]);
+				fatal(32);
 			}
 			if(lcounter != addr*100/mem.code_memory_size){
 				lcounter = addr*100/mem.code_memory_size;
@@ -420,7 +381,7 @@ void pic16f183xx::write(char *infile)
 			if ( ( data != fileconf ) & ( mem.filled[addr+i] ) ) {
 				fprintf(stderr, "Error at fuse addr = 0x%06X:  pic = 0x%04X, file = 0x%04X.\nExiting...",
 						addr+i, data, mem.location[addr+i] & mask);
-				exit(34);
+				fatal(34);
 			}
 			send_cmd(COMM_INC_ADDR, DELAY_TDLY);
 		}
@@ -432,7 +393,7 @@ void pic16f183xx::write(char *infile)
 
 	if (mem.filled[addr]) {
 		if (flags.debug)
-			fprintf(stderr, "  Writing 0x%04X to config address 0x%06X \n", mem.location[addr], (addr) );
+			fprintf(stderr, "  Writing 0x%04X to config address 0x%06X \n", (uint16_t)mem.location[addr], (addr) );
 		send_cmd(COMM_LOAD_FOR_NVM, DELAY_TDLY);
 		write_data(mem.location[addr]);
 		send_cmd(COMM_BEGIN_IN_TIMED_PROG, DELAY_TPINT_CONF);
@@ -443,5 +404,5 @@ void pic16f183xx::write(char *infile)
 void pic16f183xx::dump_configuration_registers(void)
 {
 	fprintf(stderr, "\nERROR: Dump config register is not implemented!\n");
-	exit(99);
+	fatal(99);
 }
@@ -33,6 +33,7 @@ class pic16f183xx : public Pic {
 		void exit_program_mode(void);
 		bool setup_pe(void){return true;};
 		bool read_device_id(void);
+		uint32_t pgc_min_ns(void);
 		void bulk_erase(void);
 		void dump_configuration_registers(void);
 		void read(char *outfile, uint32_t start, uint32_t count);
@@ -40,7 +41,7 @@ class pic16f183xx : public Pic {
 		uint8_t blank_check(void);
 
 	protected:
-		void send_cmd(uint8_t cmd, unsigned int delay);
+		void send_cmd(uint8_t cmd, const timing_param &delay);
 		uint16_t read_data(void);
 		void write_data(uint16_t data);
 		void set_address(uint32_t addr);
@@ -25,26 +25,29 @@
 
 #include "pic18fj.h"
 
-/* delays (in microseconds) */
-#define DELAY_P1   	1
-#define DELAY_P2   	1
-#define DELAY_P2A  	1
-#define DELAY_P2B  	1
-#define DELAY_P3   	1
-#define DELAY_P4   	1
-#define DELAY_P5   	1
-#define DELAY_P5A  	1
-#define DELAY_P6   	1
-#define DELAY_P9  	3400
-#define DELAY_P10  	54000
-#define DELAY_P11  	524000
-#define DELAY_P12  	400
-#define DELAY_P13  	1
-#define DELAY_P14  	1
-#define DELAY_P16  	1
-#define DELAY_P17  	3
-#define DELAY_P19	4000
-#define DELAY_P20	1
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_P1   	(100, 100, 0);
+static constexpr timing_param DELAY_P2   	(100, 100, 0);
+static constexpr pgc_param    DELAY_P2A  	(40, 40, 0, DELAY_P2.min);
+static constexpr pgc_param    DELAY_P2B  	(40, 40, 0, DELAY_P2.min);
+static constexpr timing_param DELAY_P3   	(15, 15, 0);
+static constexpr timing_param DELAY_P4   	(15, 15, 0);
+static constexpr timing_param DELAY_P5   	(40, 40, 0);
+static constexpr timing_param DELAY_P5A  	(40, 40, 0);
+static constexpr timing_param DELAY_P6   	(20, 20, 0);
+static constexpr timing_param DELAY_P9  	(3400000, 3400000, 0);
+static constexpr timing_param DELAY_P10  	(54000000, 54000000, 0);
+static constexpr timing_param DELAY_P11  	(524000000, 524000000, 0);
+static constexpr timing_param DELAY_P12  	(400000, 400000, 0);
+static constexpr timing_param DELAY_P13  	(100, 100, 0);
+static constexpr timing_param DELAY_P14  	(10, 10, 0);
+static constexpr timing_param DELAY_P16  	(1000, 1000, 0);
+static constexpr timing_param DELAY_P17  	(3000, 3000, 0);
+static constexpr timing_param DELAY_P19	(4000000, 4000000, 0);
+static constexpr timing_param DELAY_P20	(1000, 1000, 0);
+
+/* read_data() samples PGD at the end of P2B, also at a tuned PGC rate */
+static_assert(DELAY_P2B.half_min > DELAY_P14.typ, "P2B must cover P14");
 
 /* commands for programming */
 #define COMM_CORE_INSTRUCTION 				0x00
@@ -60,39 +63,27 @@
 
 #define ENTER_PROGRAM_KEY	0x4D434850
 
-unsigned int lcounter = 0;
+static thread_local unsigned int lcounter = 0;
 
 void pic18fj::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_IN(pic_mclr);
 	GPIO_OUT(pic_mclr);
 
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
-	delay_us(DELAY_P13);	/* wait P13 */
+	delay_ns(DELAY_P13);	/* wait P13 */
 	GPIO_SET(pic_mclr);			/* apply VDD to MCLR pin */
 	delay_us(10);		/* wait (no minimum time requirement) */
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
-	delay_us(DELAY_P19);	/* wait P19 */
+	delay_ns(DELAY_P19);	/* wait P19 */
 
 	GPIO_CLR(pic_clk);
 	/* Shift in the "enter program mode" key sequence (MSB first) */
-	for (i = 31; i > -1; i--) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P2B);	/* Setup time */
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P2A);	/* Hold time */
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, false, DELAY_P2A, DELAY_P2B);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P20);	/* Wait P20 */
+	delay_ns(DELAY_P20);	/* Wait P20 */
 	GPIO_SET(pic_mclr);			/* apply VDD to MCLR pin */
-	delay_us(DELAY_P12);	/* Wait (at least) P12 */
+	delay_ns(DELAY_P12);	/* Wait (at least) P12 */
 }
 
 void pic18fj::exit_program_mode(void)
@@ -100,9 +91,9 @@ void pic18fj::exit_program_mode(void)
 
 	GPIO_CLR(pic_clk);			/* stop clock on PGC */
 	GPIO_CLR(pic_data);			/* clear data pin PGD */
-	delay_us(DELAY_P16);	/* wait P16 */
+	delay_ns(DELAY_P16);	/* wait P16 */
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
-	delay_us(DELAY_P17);	/* wait (at least) P17 */
+	delay_ns(DELAY_P17);	/* wait (at least) P17 */
 	GPIO_SET(pic_mclr);
 	GPIO_IN(pic_mclr);
 }
@@ -110,49 +101,27 @@ void pic18fj::exit_program_mode(void)
 /* Send a 4-bit command to the PIC (LSB first) */
 void pic18fj::send_cmd(uint8_t cmd)
 {
-	int i;
-
-	for (i = 0; i < 4; i++) {
-		GPIO_SET(pic_clk);
-		if ( (cmd >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P2B);	/* Setup time */
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P2A);	/* Hold time */
-	}
+	PGC_BURST();
+	shift_out(cmd, 4, true, DELAY_P2B, DELAY_P2A);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P5);
+	delay_ns(DELAY_P5);
 }
 
 /* Read 8-bit data from the PIC (LSB first) */
 uint16_t pic18fj::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0x0000;
 
-	for (i = 0; i < 8; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P2B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P2A);
-	}
+	PGC_BURST();
+	shift_out(0x0, 8, true, DELAY_P2B, DELAY_P2A);
 
-	delay_us(DELAY_P6);	/* wait for the data... */
+	delay_ns(DELAY_P6);	/* wait for the data... */
 
 	GPIO_IN(pic_data);
 
-	for (i = 0; i < 8; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P14);	/* Wait for data to be valid */
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		delay_us(DELAY_P2B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P2A);
-	}
+	data = shift_in(8, DELAY_P2B, DELAY_P2A);	/* P2B > P14 */
 
-	delay_us(DELAY_P5A);
+	delay_ns(DELAY_P5A);
 	GPIO_IN(pic_data);
 	GPIO_OUT(pic_data);
 	return data;
@@ -161,20 +130,10 @@ uint16_t pic18fj::read_data(void)
 /* Load 16-bit data to the PIC (LSB first) */
 void pic18fj::write_data(uint16_t data)
 {
-	int i;
-
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		if ( (data >> i) & 0x0001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P2B);	/* Setup time */
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P2A);	/* Hold time */
-	}
+	PGC_BURST();
+	shift_out(data, 16, true, DELAY_P2B, DELAY_P2A);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P5A);
+	delay_ns(DELAY_P5A);
 }
 
 /* set Table Pointer */
@@ -197,6 +156,13 @@ void pic18fj::goto_mem_location(uint32_t data)
 	write_data(0x6EF6);					/* MOVWF TBLPTRL */
 }
 
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t pic18fj::pgc_min_ns(void)
+{
+	return DELAY_P2A.half_min > DELAY_P2B.half_min ?
+			DELAY_P2A.half_min : DELAY_P2B.half_min;
+}
+
 /* Read PIC device id word, located at 0x3FFFFE:0x3FFFFF */
 bool pic18fj::read_device_id(void)
 {
@@ -219,8 +185,7 @@ bool pic18fj::read_device_id(void)
 			strcpy(name,piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0F80018;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -277,25 +242,36 @@ void pic18fj::bulk_erase(void)
 	send_cmd(COMM_CORE_INSTRUCTION);
 	write_data(0x0000);                 /* NOP */
 	GPIO_CLR(pic_data);	                /* Hold PGD low until erase completes. */
-	delay_us(DELAY_P11);
-	delay_us(DELAY_P10);
+	delay_ns(DELAY_P11);
+	delay_ns(DELAY_P10);
 	if(flags.client) fprintf(stdout, "@FIN");
 }
 
 /* Read PIC memory and write the contents to a .hex file */
 void pic18fj::read(char *outfile, uint32_t start, uint32_t count)
 {
-	uint16_t addr, data = 0x0000;
+	uint32_t addr, stopaddr;
+	uint16_t data = 0x0000;
+	readback *rb;
+
+	stopaddr = mem.code_memory_size;
+	if(count != 0 && start + count < stopaddr){
+		stopaddr = start + count;
+		fprintf(stderr, "Read only %d memory locations, from %06X to %06X\n",
+				count, start, stopaddr);
+	}
 
 	if(!flags.debug) cerr << "[ 0%]";
 	if(flags.client) fprintf(stdout, "@000");
-	lcounter = 0;
+
+	rb = readback_start(&mem, hex_open(outfile, 0, mem.program_memory_size >= 0x10000),
+			RB_SKIP_HALF, 0xFFFFFFFF, stopaddr - start);
 
 	/* Read Memory */
 
-	goto_mem_location(0x000000);
+	goto_mem_location(start*2);
 
-	for (addr = 0; addr < mem.code_memory_size; addr++) {
+	for (addr = start; addr < stopaddr; addr++) {
 
 		send_cmd(COMM_TABLE_READ_POST_INC);
 		data = read_data();
@@ -305,23 +281,12 @@ void pic18fj::read(char *outfile, uint32_t start, uint32_t count)
 		if (flags.debug)
 			fprintf(stderr, "  addr = 0x%04X  data = 0x%04X\n", addr*2, data);
 
-		if (data != 0xFFFF) {
-			mem.location[addr]        = data;
-			mem.filled[addr]      = 1;
-		}
-
-		if(lcounter != addr*100/mem.code_memory_size){
-			if(flags.client)
-				fprintf(stderr,"RED@%2d\n", (addr*100/mem.code_memory_size));
-			if(!flags.debug)
-				fprintf(stderr,"\b\b\b\b%2d%%]", addr*100/mem.code_memory_size);
-			lcounter = addr*100/mem.code_memory_size;
-		}
+		readback_push_location(rb, addr, data, 0xFFFF);
 	}
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile);
 }
 
 /* Bulk erase the chip, and then write contents of the .hex file to the PIC */
@@ -352,7 +317,7 @@ void pic18fj::write(char *infile)
 		for(i=0; i<31; i++){		                        /* write the first 62 bytes */
 			if (mem.filled[addr+i]) {
 				if (flags.debug)
-					fprintf(stderr, "  Writing 0x%04X to address 0x%06X \n", mem.location[addr + i], (addr+i)*2 );
+					fprintf(stderr, "  Writing 0x%04X to address 0x%06X \n", (uint16_t)mem.location[addr + i], (addr+i)*2 );
 				send_cmd(COMM_TABLE_WRITE_POST_INC_2);
 				write_data(mem.location[addr+i]);
 			}
@@ -367,7 +332,7 @@ void pic18fj::write(char *infile)
 		/* write the last 2 bytes and start programming */
 		if (mem.filled[addr+31]) {
 			if (flags.debug)
-				fprintf(stderr, "  Writing 0x%04X to address 0x%06X and then start programming...\n", mem.location[addr+31], (addr+31)*2);
+				fprintf(stderr, "  Writing 0x%04X to address 0x%06X and then start programming...\n", (uint16_t)mem.location[addr+31], (addr+31)*2);
 			send_cmd(COMM_TABLE_WRITE_STARTP);
 			write_data(mem.location[addr+31]);
 		}
@@ -382,14 +347,14 @@ void pic18fj::write(char *infile)
 		GPIO_CLR(pic_data);
 		for (i = 0; i < 3; i++) {
 			GPIO_SET(pic_clk);
-			delay_us(DELAY_P2B);       /* Setup time */
+			delay_ns(DELAY_P2B);       /* Setup time */
 			GPIO_CLR(pic_clk);
-			delay_us(DELAY_P2A);       /* Hold time */
+			delay_ns(DELAY_P2A);       /* Hold time */
 		}
 		GPIO_SET(pic_clk);
-		delay_us(DELAY_P9);        /* Programming time */
+		delay_ns(DELAY_P9);        /* Programming time */
 		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P5);
+		delay_ns(DELAY_P5);
 		write_data(0x0000);
 		/* end of Programming Sequence */
 		if(lcounter != addr*100/filled_locations){
@@ -425,7 +390,7 @@ void pic18fj::write(char *infile)
 
 			if ( (data != mem.location[addr]) & ( mem.filled[addr]) ) {
 				fprintf(stderr, "Error at addr = 0x%06X:  pic = 0x%04X, file = 0x%04X.\nExiting...",
-						addr*2, data, mem.location[addr]);
+						addr*2, data, (uint16_t)mem.location[addr]);
 				break;
 			}
 			if(lcounter != addr*100/filled_locations){
@@ -33,6 +33,7 @@ class pic18fj: public Pic{
 		void exit_program_mode(void);
 		bool setup_pe(void){return true;};
 		bool read_device_id(void);
+		uint32_t pgc_min_ns(void);
 		void bulk_erase(void);
 		void dump_configuration_registers(void);
 		void read(char *outfile, uint32_t start, uint32_t count);
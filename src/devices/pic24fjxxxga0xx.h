@@ -22,16 +22,18 @@
 
 #include "../common.h"
 #include "device.h"
+#include "eicsp.h"
 
 using namespace std;
 
-class pic24fjxxxga0xx : public Pic {
+class pic24fjxxxga0xx : public eicsp_pic {
 
 	public:
 		void enter_program_mode(void);
 		void exit_program_mode(void);
-		bool setup_pe(void){return true;};
+		bool setup_pe(void);
 		bool read_device_id(void);
+		uint32_t pgc_min_ns(void);
 		void bulk_erase(void);
 		void dump_configuration_registers(void);
 		void read(char *outfile, uint32_t start, uint32_t count);
@@ -25,117 +25,86 @@
 
 #include "pic24fjxxxga1_gb1.h"
 
-/* delays (in microseconds; nanoseconds are rounded to 1us) */
-#define DELAY_P1   			1		// 100ns
-#define DELAY_P1A			1		// 40ns
-#define DELAY_P1B			1		// 40ns
-#define DELAY_P2			1		// 15ns
-#define DELAY_P3			1		// 15ns
-#define DELAY_P4			1		// 40ns
-#define DELAY_P4A			1		// 40ns
-#define DELAY_P5			1		// 20ns
-#define DELAY_P6			1		// 100ns
-#define DELAY_P7			25000		// 25ms
-#define DELAY_P8			12		// 12us
-#define DELAY_P9			40		// 40us
-#define DELAY_P10			1		// 400ns
-#define DELAY_P11			400000		// 400ms
-#define DELAY_P12			40000		// 40ms
-#define DELAY_P13			2000		// 2ms
-#define DELAY_P14			1		// 1us MAX!
-#define DELAY_P15			1		// 10ns
-#define DELAY_P16			0		// 0s
-#define DELAY_P17   			0		// 0s
-#define DELAY_P18			1		// 40ns
-#define DELAY_P19			1000		// 1ms
-#define DELAY_P20			23		// 23us
-#define DELAY_P21			1		// 8ns
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_P1   			(100, 100, 0);		// 100ns
+static constexpr pgc_param    DELAY_P1A			(40, 40, 0, DELAY_P1.min);		// 40ns, at least P1/2
+static constexpr pgc_param    DELAY_P1B			(40, 40, 0, DELAY_P1.min);		// 40ns, at least P1/2
+static constexpr timing_param DELAY_P2			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P3			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P4			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P4A			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P5			(20, 20, 0);		// 20ns
+static constexpr timing_param DELAY_P6			(100, 100, 0);		// 100ns
+static constexpr timing_param DELAY_P7			(25000000, 25000000, 0);		// 25ms
+static constexpr timing_param DELAY_P8			(12000, 12000, 0);		// 12us
+static constexpr timing_param DELAY_P9			(40000, 40000, 0);		// 40us
+static constexpr timing_param DELAY_P10			(400, 400, 0);		// 400ns
+static constexpr timing_param DELAY_P11			(400000000, 400000000, 0);		// 400ms
+static constexpr timing_param DELAY_P12			(40000000, 40000000, 0);		// 40ms
+static constexpr timing_param DELAY_P13			(2000000, 2000000, 0);		// 2ms
+static constexpr timing_param DELAY_P14			(0, 1000, 1000);		// 1us MAX!
+static constexpr timing_param DELAY_P15			(10, 10, 0);		// 10ns
+static constexpr timing_param DELAY_P16			(0, 0, 0);		// 0s
+static constexpr timing_param DELAY_P17   			(0, 0, 0);		// 0s
+static constexpr timing_param DELAY_P18			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P19			(1000000, 1000000, 0);		// 1ms
+static constexpr timing_param DELAY_P20			(23000, 23000, 0);		// 23us
+static constexpr timing_param DELAY_P21			(8, 8, 0);		// 8ns
 
 #define ENTER_PROGRAM_KEY	0x4D434851
 
+/* Programming Executive: executive memory, rows of 64 instructions */
+static const pe_family pe_pic24fjxxxga1_gb1 = {"PIC24FJ GA1/GB1", "pic24fjxxxga1_gb1", 0x800000, 0x800, 0x400, 64,
+		0x032, 0x760, 0, 0, 0, 0x784, 0x4042, 0x4001, 64, false, false};
+
 #define reset_pc() send_cmd(0x040200)
 #define send_nop() send_cmd(0x000000)
 
-static unsigned int counter=0;
-static uint16_t nvmcon;
+static thread_local unsigned int counter=0;
+static thread_local uint16_t nvmcon;
 
 /* Send a 24-bit command to the PIC (LSB first) through a SIX instruction */
 void pic24fjxxxga1_gb1::send_cmd(uint32_t cmd)
 {
-	uint8_t i;
-
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 
 	/* send the SIX = 0x0000 instruction */
-	for (i = 0; i < 4; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* send the 24-bit command */
-	for (i = 0; i < 24; i++) {
-		if ( (cmd >> i) & 0x00000001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(cmd, 24, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 }
 
 /* Read 16-bit data word from the PIC (LSB first) through a REGOUT inst */
 uint16_t pic24fjxxxga1_gb1::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0;
 
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 	GPIO_CLR(pic_clk);
 
 	/* send the REGOUT=0x0001 instruction */
-	for (i = 0; i < 4; i++) {
-		if ( (0x0001 >> i) & 0x001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(0x1, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* idle for 8 clock cycles, waiting for the data to be ready */
-	for (i = 0; i < 8; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 8, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P5);
+	delay_ns(DELAY_P5);
 
 	GPIO_IN(pic_data);
 
 	/* read a 16-bit data word */
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	data = shift_in(16, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 	GPIO_OUT(pic_data);
 	return data;
 }
@@ -143,37 +112,25 @@ uint16_t pic24fjxxxga1_gb1::read_data(void)
 /* Enter program mode */
 void pic24fjxxxga1_gb1::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_OUT(pic_mclr);
 	GPIO_OUT(pic_data);
 
 	GPIO_CLR(pic_clk);
 
 	GPIO_CLR(pic_mclr);		/*  remove VDD from MCLR pin */
-	delay_us(DELAY_P6);
+	delay_ns(DELAY_P6);
 	GPIO_SET(pic_mclr);		/*  apply VDD to MCLR pin */
-	delay_us(DELAY_P21);
+	delay_ns(DELAY_P21);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P18);
+	delay_ns(DELAY_P18);
 
 	/* Shift in the "enter program mode" key sequence (MSB first) */
-	for (i = 31; i > -1; i--) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, false, DELAY_P1B, DELAY_P1A);
 
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P19);
+	delay_ns(DELAY_P19);
 	GPIO_SET(pic_mclr);
-	delay_us(DELAY_P7);
+	delay_ns(DELAY_P7);
 
 	/*
 	 * Coming out of Reset, ther first 4-bit control code is always forced
@@ -181,12 +138,7 @@ void pic24fjxxxga1_gb1::enter_program_mode(void)
 	 * additional PGCx clocks are needed on start-up, resulting in a 9-bit
 	 * SIX command instead of the normal 4-bit SIX command.
 	 */
-	for (i = 0; i < 5; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1A);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1B);
-	}
+	shift_out(0x0, 5, true, DELAY_P1A, DELAY_P1B);
 }
 
 /* Exit program mode */
@@ -194,17 +146,33 @@ void pic24fjxxxga1_gb1::exit_program_mode(void)
 {
 	GPIO_CLR(pic_clk);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P16);
+	delay_ns(DELAY_P16);
 	GPIO_CLR(pic_mclr);	/* remove VDD from MCLR pin */
-	delay_us(DELAY_P17);	/* wait (at least) P17 */
+	delay_ns(DELAY_P17);	/* wait (at least) P17 */
 	GPIO_IN(pic_mclr);
 }
 
+/* Use the Programming Executive when there is one */
+bool pic24fjxxxga1_gb1::setup_pe(void)
+{
+	pe_setup(&pe_pic24fjxxxga1_gb1);
+	return true;
+}
+
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t pic24fjxxxga1_gb1::pgc_min_ns(void)
+{
+	return DELAY_P1A.half_min > DELAY_P1B.half_min ?
+			DELAY_P1A.half_min : DELAY_P1B.half_min;
+}
+
 /* Read the device ID and revision; returns only the id */
 bool pic24fjxxxga1_gb1::read_device_id(void)
 {
 	bool found = 0;
 
+	pe_leave();
+
 	/* Exit Reset vector */
 	send_nop();
 	reset_pc();
@@ -255,8 +223,7 @@ bool pic24fjxxxga1_gb1::read_device_id(void)
 			strcpy(name, piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0F80018;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -272,6 +239,10 @@ uint8_t pic24fjxxxga1_gb1::blank_check(void)
 	unsigned short i;
 	uint16_t data[8], raw_data[6];
 	uint8_t ret = 0;
+	int pe_ret;
+
+	if (pe && (pe_ret = pe_blank_check()) >= 0)
+		return pe_ret;
 
 	if(!flags.debug)
 	  cerr << "[ 0%]";
@@ -383,6 +354,8 @@ uint8_t pic24fjxxxga1_gb1::blank_check(void)
 /* Bulk erase the chip */
 void pic24fjxxxga1_gb1::bulk_erase(void)
 {
+	pe_leave();
+
 	/* Exit the Reset vector */
 	send_nop();
 	reset_pc();
@@ -408,7 +381,7 @@ void pic24fjxxxga1_gb1::bulk_erase(void)
 	send_nop();
 	send_nop();
 
-	delay_us(DELAY_P11);
+	delay_ns(DELAY_P11);
 
 	/* Wait while the erase operation completes */
 	do {
@@ -431,6 +404,7 @@ void pic24fjxxxga1_gb1::read(char *outfile, uint32_t start, uint32_t count)
 	uint32_t addr, startaddr, stopaddr;
 	uint16_t data[8], raw_data[6];
 	int i = 0;
+	readback *rb;
 
 	startaddr = start;
 	stopaddr = mem.code_memory_size;
@@ -444,7 +418,12 @@ void pic24fjxxxga1_gb1::read(char *outfile, uint32_t start, uint32_t count)
 	if (!flags.debug) cerr << "[ 0%]";
 	if (flags.client) fprintf(stdout, "@000");
 
-	counter = 0;
+	/* the erased locations are left unfilled */
+	rb = readback_start(&mem, hex_open(outfile, 0, mem.program_memory_size >= 0x10000),
+			RB_SKIP_HALF, 0x00FFFFFF, stopaddr - startaddr);
+
+	if (pe && pe_read(rb, &startaddr, stopaddr))
+		goto configuration;
 
 	/* Exit Reset vector */
 	send_nop();
@@ -514,33 +493,20 @@ void pic24fjxxxga1_gb1::read(char *outfile, uint32_t start, uint32_t count)
 		data[7] = (raw_data[4] & 0xFF00) >> 8;
 		data[6] = raw_data[5];
 
-		for (i = 0; i < 8; i++) {
-			if (flags.debug)
+		if (flags.debug)
+			for (i = 0; i < 8; i++)
 				fprintf(stderr, "\n addr = 0x%06X data = 0x%04X",
 					(addr + i), data[i]);
 
-			if (i % 2 == 0 && data[i] != 0xFFFF) {
-				mem.location[addr + i] = data[i];
-				mem.filled[addr + i] = 1;
-			}
-
-			if (i % 2 == 1 && data[i] != 0x00FF) {
-				mem.location[addr+i] = data[i];
-				mem.filled[addr+i] = 1;
-			}
-		}
-
-		if (counter != addr * 100 / stopaddr) {
-			counter = addr * 100 / stopaddr;
-			if (flags.client)
-				fprintf(stdout,"@%03d", counter);
-			if (!flags.debug)
-				fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
-		}
+		for (i = 0; i < 8; i += 2)
+			readback_push(rb, addr + i, data[i] | (uint32_t)data[i + 1] << 16);
 
 		/* TODO: checksum */
 	}
 
+configuration:
+	pe_leave();
+
 	/* READ CONFIGURATION REGISTERS */
 	addr = mem.code_memory_size;
 
@@ -555,7 +521,7 @@ void pic24fjxxxga1_gb1::read(char *outfile, uint32_t start, uint32_t count)
 	 */
 	send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) ); // MOV #<DestAddress23:16>, W0
 	send_cmd(0x880190); // MOV W0, TBLPAG
-	send_cmd(0x200007 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
+	send_cmd(0x200006 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
 	send_cmd(0x207847); // MOV #VISI, W7
 	send_nop();
 
@@ -565,26 +531,21 @@ void pic24fjxxxga1_gb1::read(char *outfile, uint32_t start, uint32_t count)
 		send_nop();
 		data[0] = read_data();
 
-		if (data[0] != 0xFFFF) {
-			mem.location[addr + 2 * i] = data[0];
-			mem.filled[addr + 2 * i] = 1;
-		}
+		readback_push_location(rb, addr + 2 * i, data[0], 0xFFFF);
 	}
 
 	reset_pc();
 	send_nop();
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile);
 }
 
 /* Write contents of the .hex file to the PIC */
 void pic24fjxxxga1_gb1::write(char *infile)
 {
 	uint16_t i,j,p;
-	uint16_t k;
-	bool skip;
 	uint32_t data[8], raw_data[6];
 	uint32_t addr = 0;
 
@@ -592,13 +553,19 @@ void pic24fjxxxga1_gb1::write(char *infile)
 
 	const char *regname[] = {"CW3","CW2","CW1"};
 
-	filled_locations = read_inhx(infile, &mem);
+	filled_locations = read_inhx_erase(infile, this);
 	if (!filled_locations) {
 		fprintf(stderr,"\n\n ERROR No filled locations!\n\n");
-		exit(31);
+		fatal(31);
+
 	}
 
-	bulk_erase();
+	/* with the PE, one PROGP per row; ICSP again if it fails */
+	if (pe) {
+		if (pe_write())
+			goto code_written;
+		bulk_erase();
+	}
 
 	/* WRITE CODE MEMORY */
 
@@ -618,15 +585,10 @@ void pic24fjxxxga1_gb1::write(char *infile)
 
 	for (addr = 0; addr < mem.code_memory_size; ){
 
-		skip = 1;
-
-		for (k = 0; k < 128; k += 2)
-			if (mem.filled[addr + k]) skip = 0;
-
-		if (skip) {
-			addr = addr + 128;
-			continue;
-		}
+		/* straight to the next row with something to write */
+		addr = read_inhx_row(&mem, addr, 128);
+		if (addr >= mem.code_memory_size)
+			break;
 
 		/* Initialize the Write Pointer (W7) for TBLWT instruction */
 		send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) ); // MOV #<DestinationAddress23:16>, W0
@@ -686,7 +648,7 @@ void pic24fjxxxga1_gb1::write(char *infile)
 		send_nop();
 		send_nop();
 
-		delay_us(DELAY_P13);
+		delay_ns(DELAY_P13);
 
 		/* Wait while the erase operation completes */
 		do {
@@ -711,9 +673,17 @@ void pic24fjxxxga1_gb1::write(char *infile)
 		}
 	};
 
+code_written:
 	if (!flags.debug) cerr << "\b\b\b\b\b\b";
 	if (flags.client) fprintf(stdout, "@100");
 
+	/* --stream: the rest of the file, configuration words included */
+	filled_locations = read_inhx_wait(&mem, filled_locations);
+	if (!filled_locations)
+		fatal(31);
+
+	pe_leave();
+
 	delay_us(100000);
 
 	/* WRITE CONFIGURATION REGISTERS */
@@ -770,7 +740,7 @@ void pic24fjxxxga1_gb1::write(char *infile)
 			send_nop();
 			send_nop();
 
-			delay_us(DELAY_P20);
+			delay_ns(DELAY_P20);
 
 			/* Wait while the erase operation completes */
 			do {
@@ -785,7 +755,7 @@ void pic24fjxxxga1_gb1::write(char *infile)
 
 			if(flags.debug)
 				fprintf(stderr,"\n - %s set to 0x%01x",
-						regname[i], mem.location[addr]);
+						regname[i], (uint16_t)mem.location[addr]);
 		} else if(flags.debug) {
 			fprintf(stderr,"\n - %s left unchanged", regname[i]);
 		}
@@ -798,7 +768,9 @@ void pic24fjxxxga1_gb1::write(char *infile)
 	delay_us(100000);
 
 	/* VERIFY CODE MEMORY */
-	if (!flags.noverify){
+	if (!flags.noverify && pe && pe_verify()) {
+		if (flags.client) fprintf(stdout, "@FIN");
+	} else if (!flags.noverify) {
 		if (!flags.debug) cerr << "[ 0%]";
 		if (flags.client) fprintf(stdout, "@000");
 
@@ -809,13 +781,10 @@ void pic24fjxxxga1_gb1::write(char *infile)
 		send_nop();
 
 		for (addr = 0; addr < mem.code_memory_size; addr = addr + 8) {
-			skip = 1;
-
-			for(k = 0; k < 8; k += 2)
-				if (mem.filled[addr + k])
-					skip = 0;
-
-			if (skip) continue;
+			/* straight to the next block with something to verify */
+			addr = mem.next_row(addr, 8);
+			if (addr >= mem.code_memory_size)
+				break;
 
 			send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) ); // MOV #<DestAddress23:16>, W0
 			send_cmd(0x880190); // MOV W0, TBLPAG
@@ -881,8 +850,8 @@ void pic24fjxxxga1_gb1::write(char *infile)
 
 				if (mem.filled[addr + i] && data[i] != mem.location[addr + i]) {
 					fprintf(stderr,"\n\n ERROR at address %06X: written %04X but %04X read!\n\n",
-						addr + i, mem.location[addr + i], data[i]);
-					exit(32);
+						addr + i, (uint16_t)mem.location[addr + i], data[i]);
+					fatal(32);
 				}
 			}
 
@@ -907,6 +876,8 @@ void pic24fjxxxga1_gb1::dump_configuration_registers(void)
 {
 	uint32_t addr = mem.code_memory_size;
 
+	pe_leave();
+
 	cerr << endl << "Configuration registers:" << endl << endl;
 
 	/* Exit Reset vector */
@@ -921,7 +892,7 @@ void pic24fjxxxga1_gb1::dump_configuration_registers(void)
 
 	send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) ); // MOV #<DestAddress23:16>, W0
 	send_cmd(0x880190); // MOV W0, TBLPAG
-	send_cmd(0x200007 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
+	send_cmd(0x200006 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
 	send_cmd(0x207847); // MOV #VISI, W7
 	send_nop();
 
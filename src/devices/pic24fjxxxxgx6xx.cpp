@@ -26,117 +26,86 @@
 
 #include "pic24fjxxxxgx6xx.h"
 
-/* delays (in microseconds; nanoseconds are rounded to 1us) */
-#define DELAY_P1   			1		// 100ns
-#define DELAY_P1A			1		// 40ns
-#define DELAY_P1B			1		// 40ns
-#define DELAY_P2			1		// 15ns
-#define DELAY_P3			1		// 15ns
-#define DELAY_P4			1		// 40ns
-#define DELAY_P4A			1		// 40ns
-#define DELAY_P5			1		// 20ns
-#define DELAY_P6			1		// 100ns
-#define DELAY_P7			50000		// 50ms
-#define DELAY_P8			12		// 12us
-#define DELAY_P9			40		// 40us
-#define DELAY_P10			1		// 400ns
-#define DELAY_P11			20000		// 20ms
-#define DELAY_P12			20000		// 20ms
-#define DELAY_P13			20		// 20us
-#define DELAY_P14			1		// 1us MAX!
-#define DELAY_P15			1		// 10ns
-#define DELAY_P16			0		// 0s
-#define DELAY_P17   		1		// 0s
-#define DELAY_P18			1000		// 1ms
-#define DELAY_P19			1		// 1ms
-#define DELAY_P20			23		// 23us
-#define DELAY_P21			100		// 100us
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_P1   			(100, 100, 0);		// 100ns
+static constexpr pgc_param    DELAY_P1A			(40, 40, 0, DELAY_P1.min);		// 40ns, at least P1/2
+static constexpr pgc_param    DELAY_P1B			(40, 40, 0, DELAY_P1.min);		// 40ns, at least P1/2
+static constexpr timing_param DELAY_P2			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P3			(15, 15, 0);		// 15ns
+static constexpr timing_param DELAY_P4			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P4A			(40, 40, 0);		// 40ns
+static constexpr timing_param DELAY_P5			(20, 20, 0);		// 20ns
+static constexpr timing_param DELAY_P6			(100, 100, 0);		// 100ns
+static constexpr timing_param DELAY_P7			(50000000, 50000000, 0);		// 50ms
+static constexpr timing_param DELAY_P8			(12000, 12000, 0);		// 12us
+static constexpr timing_param DELAY_P9			(40000, 40000, 0);		// 40us
+static constexpr timing_param DELAY_P10			(400, 400, 0);		// 400ns
+static constexpr timing_param DELAY_P11			(20000000, 20000000, 0);		// 20ms
+static constexpr timing_param DELAY_P12			(20000000, 20000000, 0);		// 20ms
+static constexpr timing_param DELAY_P13			(20000, 20000, 0);		// 20us
+static constexpr timing_param DELAY_P14			(0, 1000, 1000);		// 1us MAX!
+static constexpr timing_param DELAY_P15			(10, 10, 0);		// 10ns
+static constexpr timing_param DELAY_P16			(0, 0, 0);		// 0s
+static constexpr timing_param DELAY_P17   		(1000, 1000, 0);		// 0s
+static constexpr timing_param DELAY_P18			(1000000, 1000000, 0);		// 1ms
+static constexpr timing_param DELAY_P19			(1000, 1000, 0);		// 1ms
+static constexpr timing_param DELAY_P20			(23000, 23000, 0);		// 23us
+static constexpr timing_param DELAY_P21			(100000, 100000, 0);		// 100us
 
 #define ENTER_PROGRAM_KEY	0x4D434851
 
+/* Programming Executive: executive memory, rows of 128 instructions */
+static const pe_family pe_pic24fjxxxxgx6xx = {"PIC24FJ GA6/GB6", "pic24fjxxxxgx6xx", 0x800000, 0x1000, 0x800, 128,
+		0x054, 0x760, 0x762, 0x764, 0x766, 0x784, 0x4003, 0x4002, 128, true, true};
+
 #define reset_pc() send_cmd(0x040200)
 #define send_nop() send_cmd(0x000000)
 
-static unsigned int counter=0;
-static uint16_t nvmcon;
+static thread_local unsigned int counter=0;
+static thread_local uint16_t nvmcon;
 
 /* Send a 24-bit command to the PIC (LSB first) through a SIX instruction */
 void pic24fjxxxxgx6xx::send_cmd(uint32_t cmd)
 {
-	uint8_t i;
-
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 
 	/* send the SIX = 0x0000 instruction */
-	for (i = 0; i < 4; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* send the 24-bit command */
-	for (i = 0; i < 24; i++) {
-		if ( (cmd >> i) & 0x00000001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(cmd, 24, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 }
 
 /* Read 16-bit data word from the PIC (LSB first) through a REGOUT inst */
 uint16_t pic24fjxxxxgx6xx::read_data(void)
 {
-	uint8_t i;
 	uint16_t data = 0;
 
+	PGC_BURST();
 	GPIO_CLR(pic_data);
 	GPIO_CLR(pic_clk);
 
 	/* send the REGOUT=0x0001 instruction */
-	for (i = 0; i < 4; i++) {
-		if ( (0x0001 >> i) & 0x001 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-	}
+	shift_out(0x1, 4, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4);
+	delay_ns(DELAY_P4);
 
 	/* idle for 8 clock cycles, waiting for the data to be ready */
-	for (i = 0; i < 8; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	shift_out(0x0, 8, true, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P5);
+	delay_ns(DELAY_P5);
 
 	GPIO_IN(pic_data);
 
 	/* read a 16-bit data word */
-	for (i = 0; i < 16; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		data |= ( GPIO_LEV(pic_data) & 0x00000001 ) << i;
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1A);
-	}
+	data = shift_in(16, DELAY_P1B, DELAY_P1A);
 
-	delay_us(DELAY_P4A);
+	delay_ns(DELAY_P4A);
 	GPIO_OUT(pic_data);
 	return data;
 }
@@ -144,38 +113,26 @@ uint16_t pic24fjxxxxgx6xx::read_data(void)
 /* Enter program mode */
 void pic24fjxxxxgx6xx::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_OUT(pic_mclr);
 	GPIO_OUT(pic_data);
 
 	GPIO_CLR(pic_clk);
 
 	GPIO_CLR(pic_mclr);		/*  remove VDD from MCLR pin */
-	delay_us(DELAY_P6);
+	delay_ns(DELAY_P6);
 	GPIO_SET(pic_mclr);		/*  apply VDD to MCLR pin */
-	delay_us(DELAY_P21);
+	delay_ns(DELAY_P21);
 	GPIO_CLR(pic_mclr);		/* remove VDD from MCLR pin */
-	delay_us(DELAY_P18);
+	delay_ns(DELAY_P18);
 
 	/* Shift in the "enter program mode" key sequence (MSB first) */
-	for (i = 31; i > -1; i--) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, false, DELAY_P1B, DELAY_P1A);
 
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P19);
+	delay_ns(DELAY_P19);
 	GPIO_SET(pic_mclr);
-	delay_us(DELAY_P7);
-	delay_us(DELAY_P1*5);
+	delay_ns(DELAY_P7);
+	delay_ns(5 * TIMING(DELAY_P1));
 
 	/*
 	 * Coming out of Reset, ther first 4-bit control code is always forced
@@ -183,12 +140,7 @@ void pic24fjxxxxgx6xx::enter_program_mode(void)
 	 * additional PGCx clocks are needed on start-up, resulting in a 9-bit
 	 * SIX command instead of the normal 4-bit SIX command.
 	 */
-	for (i = 0; i < 5; i++) {
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1A);
-		GPIO_CLR(pic_clk);
-		delay_us(DELAY_P1B);
-	}
+	shift_out(0x0, 5, true, DELAY_P1A, DELAY_P1B);
 }
 
 /* Exit program mode */
@@ -196,17 +148,33 @@ void pic24fjxxxxgx6xx::exit_program_mode(void)
 {
 	GPIO_CLR(pic_clk);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P16);
+	delay_ns(DELAY_P16);
 	GPIO_CLR(pic_mclr);	/* remove VDD from MCLR pin */
-	delay_us(DELAY_P17);	/* wait (at least) P17 */
+	delay_ns(DELAY_P17);	/* wait (at least) P17 */
 	GPIO_IN(pic_mclr);
 }
 
+/* Use the Programming Executive when there is one */
+bool pic24fjxxxxgx6xx::setup_pe(void)
+{
+	pe_setup(&pe_pic24fjxxxxgx6xx);
+	return true;
+}
+
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t pic24fjxxxxgx6xx::pgc_min_ns(void)
+{
+	return DELAY_P1A.half_min > DELAY_P1B.half_min ?
+			DELAY_P1A.half_min : DELAY_P1B.half_min;
+}
+
 /* Read the device ID and revision; returns only the id */
 bool pic24fjxxxxgx6xx::read_device_id(void)
 {
 	bool found = 0;
 
+	pe_leave();
+
 	/* Exit Reset vector */
 	send_nop();
 	reset_pc();
@@ -256,8 +224,7 @@ bool pic24fjxxxxgx6xx::read_device_id(void)
 			strcpy(name, piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x0ABFFE;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = 1;
 			break;
 		}
@@ -273,6 +240,10 @@ uint8_t pic24fjxxxxgx6xx::blank_check(void)
 	unsigned short i;
 	uint16_t data[8], raw_data[6];
 	uint8_t ret = 0;
+	int pe_ret;
+
+	if (pe && (pe_ret = pe_blank_check()) >= 0)
+		return pe_ret;
 
 	if(!flags.debug)
 	  cerr << "[ 0%]";
@@ -384,6 +355,8 @@ uint8_t pic24fjxxxxgx6xx::blank_check(void)
 /* Bulk erase the chip */
 void pic24fjxxxxgx6xx::bulk_erase(void)
 {
+	pe_leave();
+
 	/* Exit the Reset vector */
 	send_nop();
 	reset_pc();
@@ -403,7 +376,7 @@ void pic24fjxxxxgx6xx::bulk_erase(void)
 	send_nop();
 	send_nop();
 
-	delay_us(DELAY_P11);
+	delay_ns(DELAY_P11);
 
 	/* Wait while the erase operation completes */
 	do {
@@ -430,6 +403,7 @@ void pic24fjxxxxgx6xx::read(char *outfile, uint32_t start, uint32_t count)
 	uint32_t addr, startaddr, stopaddr;
 	uint16_t data[8], raw_data[6];
 	int i = 0;
+	readback *rb;
 
 	startaddr = start;
 	stopaddr = mem.code_memory_size;
@@ -443,7 +417,12 @@ void pic24fjxxxxgx6xx::read(char *outfile, uint32_t start, uint32_t count)
 	if (!flags.debug) cerr << "[ 0%]";
 	if (flags.client) fprintf(stdout, "@000");
 
-	counter = 0;
+	/* the erased locations are left unfilled */
+	rb = readback_start(&mem, hex_open(outfile, 0, mem.program_memory_size >= 0x10000),
+			RB_SKIP_HALF, 0x00FFFFFF, stopaddr - startaddr);
+
+	if (pe && pe_read(rb, &startaddr, stopaddr))
+		goto configuration;
 
 	/* Exit Reset vector */
 	send_nop();
@@ -513,33 +492,20 @@ void pic24fjxxxxgx6xx::read(char *outfile, uint32_t start, uint32_t count)
 		data[7] = (raw_data[4] & 0xFF00) >> 8;
 		data[6] = raw_data[5];
 
-		for (i = 0; i < 8; i++) {
-			if (flags.debug)
+		if (flags.debug)
+			for (i = 0; i < 8; i++)
 				fprintf(stderr, "\n addr = 0x%06X data = 0x%04X",
 					(addr + i), data[i]);
 
-			if (i % 2 == 0 && data[i] != 0xFFFF) {
-				mem.location[addr + i] = data[i];
-				mem.filled[addr + i] = 1;
-			}
-
-			if (i % 2 == 1 && data[i] != 0x00FF) {
-				mem.location[addr+i] = data[i];
-				mem.filled[addr+i] = 1;
-			}
-		}
-
-		if (counter != addr * 100 / stopaddr) {
-			counter = addr * 100 / stopaddr;
-			if (flags.client)
-				fprintf(stdout,"@%03d", counter);
-			if (!flags.debug)
-				fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
-		}
+		for (i = 0; i < 8; i += 2)
+			readback_push(rb, addr + i, data[i] | (uint32_t)data[i + 1] << 16);
 
 		/* TODO: checksum */
 	}
 
+configuration:
+	pe_leave();
+
 	/* READ CONFIGURATION REGISTERS */
 	addr = mem.code_memory_size;
 
@@ -554,7 +520,7 @@ void pic24fjxxxxgx6xx::read(char *outfile, uint32_t start, uint32_t count)
 	 */
 	send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) ); // MOV #<DestAddress23:16>, W0
 	send_cmd(0x880190); // MOV W0, TBLPAG
-	send_cmd(0x200007 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
+	send_cmd(0x200006 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
 	send_cmd(0x207847); // MOV #VISI, W7
 	send_nop();
 
@@ -564,26 +530,21 @@ void pic24fjxxxxgx6xx::read(char *outfile, uint32_t start, uint32_t count)
 		send_nop();
 		data[0] = read_data();
 
-		if (data[0] != 0xFFFF) {
-			mem.location[addr + 2 * i] = data[0];
-			mem.filled[addr + 2 * i] = 1;
-		}
+		readback_push_location(rb, addr + 2 * i, data[0], 0xFFFF);
 	}
 
 	reset_pc();
 	send_nop();
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile);
 }
 
 /* Write contents of the .hex file to the PIC */
 void pic24fjxxxxgx6xx::write(char *infile)
 {
 	uint16_t i;
-	uint16_t k;
-	bool skip;
 	uint32_t data[8], raw_data[6];
 	uint32_t addr = 0;
 
@@ -591,13 +552,19 @@ void pic24fjxxxxgx6xx::write(char *infile)
 
 	const char *regname[] = {"FSEC","FBSLIM", "FSIGN", "FOSCSEL", "FOSC", "FWDT", "FPOR", "FICD", "FDEVOPT"};
 
-	filled_locations = read_inhx(infile, &mem);
+	filled_locations = read_inhx_erase(infile, this);
 	if (!filled_locations) {
 		fprintf(stderr,"\n\n ERROR No filled locations!\n\n");
-		exit(31);
+		fatal(31);
+
 	}
 
-	bulk_erase();
+	/* with the PE, one PROGP per row; ICSP again if it fails */
+	if (pe) {
+		if (pe_write())
+			goto code_written;
+		bulk_erase();
+	}
 
 	/* WRITE CODE MEMORY */
 
@@ -617,15 +584,10 @@ void pic24fjxxxxgx6xx::write(char *infile)
 
 	for (addr = 0; addr < mem.code_memory_size; ){
 
-		skip = 1;
-
-		for (k = 0; k < 4; k += 2)
-			if (mem.filled[addr + k]) skip = 0;
-
-		if (skip) {
-			addr = addr + 4;
-			continue;
-		}
+		/* straight to the next row with something to write */
+		addr = read_inhx_row(&mem, addr, 4);
+		if (addr >= mem.code_memory_size)
+			break;
 
 		/* Set the NVMADRU/NVMADR register pair to point to the correct address */
 		send_cmd(0x200003 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestinationAddress15:0>, W3
@@ -695,9 +657,17 @@ void pic24fjxxxxgx6xx::write(char *infile)
 	send_cmd(0x200000);	//MOV #0000, W0
 	send_cmd(0x883B00);	//MOV W0, NVMCON
 
+code_written:
 	if (!flags.debug) cerr << "\b\b\b\b\b\b";
 	if (flags.client) fprintf(stdout, "@100");
 
+	/* --stream: the rest of the file, configuration words included */
+	filled_locations = read_inhx_wait(&mem, filled_locations);
+	if (!filled_locations)
+		fatal(31);
+
+	pe_leave();
+
 	delay_us(100000);
 
 	/* WRITE CONFIGURATION REGISTERS */
@@ -763,7 +733,7 @@ void pic24fjxxxxgx6xx::write(char *infile)
 			send_nop();
 			send_nop();
 
-			delay_us(DELAY_P20);
+			delay_ns(DELAY_P20);
 
 			/* Wait while the erase operation completes */
 			do {
@@ -778,7 +748,7 @@ void pic24fjxxxxgx6xx::write(char *infile)
 
 			if(flags.debug)
 				fprintf(stderr,"\n - %s set to 0x%01x",
-						regname[i], mem.location[addr]);
+						regname[i], (uint16_t)mem.location[addr]);
 		} else if(flags.debug) {
 			fprintf(stderr,"\n - %s left unchanged", regname[i]);
 		}
@@ -789,7 +759,9 @@ void pic24fjxxxxgx6xx::write(char *infile)
 	delay_us(100000);
 
 	/* VERIFY CODE MEMORY */
-	if (!flags.noverify){
+	if (!flags.noverify && pe && pe_verify()) {
+		if (flags.client) fprintf(stdout, "@FIN");
+	} else if (!flags.noverify) {
 		if (!flags.debug) cerr << "[ 0%]";
 		if (flags.client) fprintf(stdout, "@000");
 
@@ -800,13 +772,10 @@ void pic24fjxxxxgx6xx::write(char *infile)
 		send_nop();
 
 		for (addr = 0; addr < mem.code_memory_size; addr = addr + 4) {
-			skip = 1;
-
-			for(k = 0; k < 4; k += 2)
-				if (mem.filled[addr + k])
-					skip = 0;
-
-			if (skip) continue;
+			/* straight to the next block with something to verify */
+			addr = mem.next_row(addr, 4);
+			if (addr >= mem.code_memory_size)
+				break;
 
 			/* Initialize the TBLPAG register and the Read Pointer (W6) for a TBLRD instruction */
 			send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12)); // MOV #<DestAddress23:16>, W0
@@ -858,8 +827,8 @@ void pic24fjxxxxgx6xx::write(char *infile)
 
 				if (mem.filled[addr + i] && data[i] != mem.location[addr + i]) {
 					fprintf(stderr,"\n\n ERROR at address %06X: written %04X but %04X read!\n\n",
-						addr + i, mem.location[addr + i], data[i]);
-					exit(32);
+						addr + i, (uint16_t)mem.location[addr + i], data[i]);
+					fatal(32);
 				}
 			}
 
@@ -884,6 +853,8 @@ void pic24fjxxxxgx6xx::dump_configuration_registers(void)
 {
 	uint32_t addr = mem.code_memory_size;
 
+	pe_leave();
+
 	cerr << endl << "Configuration registers:" << endl << endl;
 
 	/* Exit Reset vector */
@@ -898,7 +869,7 @@ void pic24fjxxxxgx6xx::dump_configuration_registers(void)
 
 	send_cmd(0x200000 | ((addr & 0x00FF0000) >> 12) ); // MOV #<DestAddress23:16>, W0
 	send_cmd(0x880190); // MOV W0, TBLPAG
-	send_cmd(0x200007 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
+	send_cmd(0x200006 | ((addr & 0x0000FFFF) << 4) ); // MOV #<DestAddress15:0>, W6
 	send_cmd(0x207847); // MOV #VISI, W7
 	send_nop();
 
@@ -26,20 +26,20 @@
 
 #include "pic32.h"
 
-/* delays (in microseconds) */
-#define DELAY_P1   	1
-#define DELAY_P1A  	1
-#define DELAY_P1B  	1
-#define DELAY_P6   	1
-#define DELAY_P7   	1
-#define DELAY_P9A  	40
-#define DELAY_P9B  	15
-#define DELAY_P14  	1
-#define DELAY_P16  	1
-#define DELAY_P17  	1
-#define DELAY_P18  	1
-#define DELAY_P19	1
-#define DELAY_P20	500
+/* timing profile (in nanoseconds): min, typ, max (0 = no maximum) */
+static constexpr timing_param DELAY_P1   	(100, 100, 0);
+static constexpr pgc_param    DELAY_P1A  	(40, 40, 0, DELAY_P1.min);
+static constexpr pgc_param    DELAY_P1B  	(40, 40, 0, DELAY_P1.min);
+static constexpr timing_param DELAY_P6   	(1000, 1000, 0);
+static constexpr timing_param DELAY_P7   	(1000, 1000, 0);
+static constexpr timing_param DELAY_P9A  	(40000, 40000, 0);
+static constexpr timing_param DELAY_P9B  	(15000, 15000, 0);
+static constexpr timing_param DELAY_P14  	(1000, 1000, 0);
+static constexpr timing_param DELAY_P16  	(1000, 1000, 0);
+static constexpr timing_param DELAY_P17  	(1000, 1000, 0);
+static constexpr timing_param DELAY_P18  	(1000, 1000, 0);
+static constexpr timing_param DELAY_P19	(1000, 1000, 0);
+static constexpr timing_param DELAY_P20	(500000, 500000, 0);
 
 #define ENTER_PROGRAM_KEY	0x4D434850
 
@@ -89,37 +89,29 @@
 #define PROGRAM_AREA			0
 #define BOOT_AREA				1
 
+/* seconds to wait for the CPU to take or give a word (PrACC) */
+#define PRACC_TIMEOUT			5.0		/* the longest PE command */
+#define PRACC_PROBE_TIMEOUT		0.1		/* a PE left in RAM, pe_alive() */
+
 void pic32::enter_program_mode(void)
 {
-	int i;
-
 	GPIO_IN(pic_mclr);
 	GPIO_OUT(pic_mclr);
 
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
-	delay_us(DELAY_P6);			/* wait P13 */
+	delay_ns(DELAY_P6);			/* wait P13 */
 	GPIO_SET(pic_mclr);			/* apply VDD to MCLR pin */
-	delay_us(DELAY_P20);		/* wait P20 */
+	delay_ns(DELAY_P20);		/* wait P20 */
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
-	delay_us(DELAY_P18);	/* wait P19 */
+	delay_ns(DELAY_P18);	/* wait P19 */
 
 	GPIO_CLR(pic_clk);
 	/* Shift in the "enter program mode" key sequence (MSB first) */
-	for (i = 31; i > -1; i--) {
-		if ( (ENTER_PROGRAM_KEY >> i) & 0x01 )
-			GPIO_SET(pic_data);
-		else
-			GPIO_CLR(pic_data);
-		delay_us(DELAY_P1A);	/* Setup time */
-		GPIO_SET(pic_clk);
-		delay_us(DELAY_P1B);	/* Hold time */
-		GPIO_CLR(pic_clk);
-
-	}
+	shift_out(ENTER_PROGRAM_KEY, 32, false, DELAY_P1B, DELAY_P1A);
 	GPIO_CLR(pic_data);
-	delay_us(DELAY_P19);		/* Wait P19 */
+	delay_ns(DELAY_P19);		/* Wait P19 */
 	GPIO_SET(pic_mclr);			/* apply VDD to MCLR pin */
-	delay_us(DELAY_P7);			/* Wait (at least) P7 */
+	delay_ns(DELAY_P7);			/* Wait (at least) P7 */
 }
 
 void pic32::exit_program_mode(void)
@@ -128,9 +120,9 @@ void pic32::exit_program_mode(void)
 	SetMode(5, 0b11111);
 	GPIO_CLR(pic_clk);			/* stop clock on PGC */
 	GPIO_CLR(pic_data);			/* clear data pin PGD */
-	delay_us(DELAY_P16);		/* wait P16 */
+	delay_ns(DELAY_P16);		/* wait P16 */
 	GPIO_CLR(pic_mclr);			/* remove VDD from MCLR pin */
-	delay_us(DELAY_P17);		/* wait (at least) P17 */
+	delay_ns(DELAY_P17);		/* wait (at least) P17 */
 	GPIO_SET(pic_mclr);
 	GPIO_IN(pic_mclr);
 }
@@ -142,27 +134,8 @@ uint8_t pic32::Data4Phase(uint8_t tdi, uint8_t tms){
 	// data pin to output
 	GPIO_OUT(pic_data);
 
-	// write TDI - sampling is on the falling edge
-	if(tdi & 0x01)
-		GPIO_SET(pic_data);
-	else
-		GPIO_CLR(pic_data);
-
-	GPIO_SET(pic_clk);
-	delay_us(DELAY_P1B);
-	GPIO_CLR(pic_clk);
-	delay_us(DELAY_P1A);
-
-	// write TMS - sampling is on the falling edge
-	if(tms & 0x01)
-		GPIO_SET(pic_data);
-	else
-		GPIO_CLR(pic_data);
-
-	GPIO_SET(pic_clk);
-	delay_us(DELAY_P1B);
-	GPIO_CLR(pic_clk);
-	delay_us(DELAY_P1A);
+	// write TDI, then TMS - sampling is on the falling edge
+	shift_out((tdi & 0x01) | (tms & 0x01) << 1, 2, true, DELAY_P1B, DELAY_P1A);
 
 	// data pin to input
 	GPIO_CLR(pic_data);
@@ -170,16 +143,20 @@ uint8_t pic32::Data4Phase(uint8_t tdi, uint8_t tms){
 
 	// "empty" clock pulse
 	GPIO_SET(pic_clk);
-	delay_us(DELAY_P1B);
+	PGC_EDGE();
+	delay_ns(DELAY_P1B);
 	GPIO_CLR(pic_clk);
-	delay_us(DELAY_P1A);
+	PGC_EDGE();
+	delay_ns(DELAY_P1A);
 
 	// read TDO, sampling on the rising edge
 	GPIO_SET(pic_clk);
+	PGC_EDGE();
 	tdo = GPIO_LEV(pic_data);
-	delay_us(DELAY_P1B);
+	delay_ns(DELAY_P1B);
 	GPIO_CLR(pic_clk);
-	delay_us(DELAY_P1A);
+	PGC_EDGE();
+	delay_ns(DELAY_P1A);
 
 	return (tdo & 0x01);
 }
@@ -188,30 +165,12 @@ void pic32::Data2Phase(uint8_t tdi, uint8_t tms){
 	// data pin to output
 	GPIO_OUT(pic_data);
 
-	// write TDI - sampling is on the falling edge
-	if(tdi & 0x01)
-		GPIO_SET(pic_data);
-	else
-		GPIO_CLR(pic_data);
-
-	GPIO_SET(pic_clk);
-	delay_us(DELAY_P1B);
-	GPIO_CLR(pic_clk);
-	delay_us(DELAY_P1A);
-
-	// write TMS - sampling is on the falling edge
-	if(tms & 0x01)
-		GPIO_SET(pic_data);
-	else
-		GPIO_CLR(pic_data);
-
-	GPIO_SET(pic_clk);
-	delay_us(DELAY_P1B);
-	GPIO_CLR(pic_clk);
-	delay_us(DELAY_P1A);
+	// write TDI, then TMS - sampling is on the falling edge
+	shift_out((tdi & 0x01) | (tms & 0x01) << 1, 2, true, DELAY_P1B, DELAY_P1A);
 }
 
 void pic32::SetMode(uint8_t length, uint8_t mode){
+	PGC_BURST();
 	for(int i=0; i < length; i++)
 		Data4Phase(0, (mode >> i));
 }
@@ -219,6 +178,8 @@ void pic32::SetMode(uint8_t length, uint8_t mode){
 void pic32::SendCommand(uint8_t command){
 	int i;
 
+	PGC_BURST();
+
 	// TMS header 1100 (TDI set to 0)
     Data4Phase(0, 1);
 	Data4Phase(0, 1);
@@ -240,6 +201,8 @@ uint32_t pic32::XferData(uint8_t length, uint32_t iData){
 	int i;
 	uint32_t oData;
 
+	PGC_BURST();
+
 	// TMS header 100 (TDI set to 0)
     Data4Phase(0, 1);
 	Data4Phase(0, 0);
@@ -262,6 +225,8 @@ uint32_t pic32::XferData(uint8_t length, uint32_t iData){
 void pic32::XferFastData2P(uint32_t iData){
 	uint8_t i;
 
+	PGC_BURST();
+
 	// TMS header 100 (TDI set to 0)
     Data2Phase(0, 1);
 	Data2Phase(0, 0);
@@ -284,14 +249,22 @@ void pic32::XferFastData2P(uint32_t iData){
 
 uint32_t pic32::XferFastData4P(uint32_t iData){
 	uint8_t i = 0;
-	uint32_t oData = 0;
+	uint32_t oData = 0, n = 0;
+	clock_t start;
+
+	if(pracc_lost)
+		return 0;
+
+	PGC_BURST();
 
 	do{
 		// TMS header 100 (TDI set to 0)
 		Data4Phase(0, 1);
 		Data4Phase(0, 0);
 		i = Data4Phase(0, 0);
-	} while(!i);
+	} while(!i && pracc_retry(n++, &start));
+	if(pracc_lost)
+		return 0;
 
 	// prAcc
 	oData |= Data4Phase(0, 0);
@@ -311,14 +284,20 @@ uint32_t pic32::XferFastData4P(uint32_t iData){
 }
 
 void pic32::XferInstruction(uint32_t instruction){
-	uint32_t controlVal;
+	uint32_t controlVal, n = 0;
+	clock_t start;
+
+	if(pracc_lost)
+		return;
 	// Select Control Register
 	SendCommand(ETAP_CONTROL);
 	// Wait until CPU is ready
 	// Check if Processor Access bit (bit 18) is set
 	do {
 		controlVal = XferData(32, 0x0004C000);
-	} while(!((controlVal >> 18) & 0x01));
+	} while(!((controlVal >> 18) & 0x01) && pracc_retry(n++, &start));
+	if(pracc_lost)
+		return;
 	// Select Data Register
 	SendCommand(ETAP_DATA);
 	// Send the instruction
@@ -353,8 +332,36 @@ uint32_t pic32::ReadFromAddress(uint32_t address){
 	return oData;
 }
 
+/*
+ * Poll of the PrACC bit number n, started at *start: false when the CPU
+ * did not answer in time. A PE that stops answering during an operation
+ * is fatal; while pe_alive() probes a PE left in RAM, the poll gives up
+ * after a short while and marks the link as lost instead.
+ */
+bool pic32::pracc_retry(uint32_t n, clock_t *start){
+	if(n == 0){
+		*start = clock();
+		return true;
+	}
+	if((clock() - *start) / (double) CLOCKS_PER_SEC <
+			(pe_probing ? PRACC_PROBE_TIMEOUT : PRACC_TIMEOUT))
+		return true;
+
+	if(!pe_probing){
+		fprintf(stderr, "Timeout waiting for the PIC32 CPU!\n");
+		if(flags.client) fprintf(stdout, "@ERR");
+		fatal(36);
+	}
+	pracc_lost = true;
+	return false;
+}
+
 uint32_t pic32::GetPEResponse(void){
-	uint32_t response;
+	uint32_t response, n = 0;
+	clock_t start;
+
+	if(pracc_lost)
+		return 0;
 
 	// Wait until CPU is ready
 	SendCommand(ETAP_CONTROL);
@@ -362,7 +369,9 @@ uint32_t pic32::GetPEResponse(void){
 	// Check if Processor Access bit (bit 18) is set
 	do {
 		response = XferData(32, 0x0004c000);
-	} while(!( (response >> 18) & 0x01 ));
+	} while(!( (response >> 18) & 0x01 ) && pracc_retry(n++, &start));
+	if(pracc_lost)
+		return 0;
 
 	// Select Data Register
 	SendCommand(ETAP_DATA);
@@ -433,9 +442,8 @@ bool pic32::enter_serial_exec_mode(void){
 	return true;
 }
 
-void pic32::download_pe(vector<uint32_t> pe_pointer){
-
-	uint32_t i;
+/* Let the CPU execute from RAM, where the PE lives */
+void pic32::init_pe_ram(void){
 
 	if(subfamily == SF_PIC32MX1 || subfamily == SF_PIC32MX2 || subfamily == SF_PIC32MX3){
 		// PIC32MX devices only: Initialize BMXCON to 0x1F0040
@@ -452,6 +460,85 @@ void pic32::download_pe(vector<uint32_t> pe_pointer){
 		XferInstruction(0xac850020);
 		XferInstruction(0xac850030);
 	}
+}
+
+/* CRC-16/CCITT (poly 0x1021) of a 32-bit word, LSB first, as the PE computes it */
+static uint16_t crc16_word(uint16_t crc, uint32_t w){
+	uint8_t b;
+
+	for(int i=0; i<4; i++){
+		crc ^= (uint16_t)((w >> (8*i)) & 0xFF) << 8;
+		for(b=0; b<8; b++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/* CRC of words, as PE_CMD_GET_CRC returns it (seed 0xFFFF) */
+static uint16_t pe_crc16(const vector<uint32_t> &words){
+	uint16_t crc = 0xFFFF;
+
+	for(uint32_t w : words)
+		crc = crc16_word(crc, w);
+	return crc;
+}
+
+/*
+ * RAM survives the reset of a new ICSP session, so the PE of a previous one
+ * may still be there. Look at its first and last words through the ETAP,
+ * with the CPU still in serial execution mode.
+ */
+bool pic32::pe_resident(const vector<uint32_t> &pe_pointer){
+	return ReadFromAddress(0xA0000000 | PE_BASEADDR) == pe_pointer[0] &&
+		   ReadFromAddress(0xA0000000 | (PE_BASEADDR + 4)) == pe_pointer[1] &&
+		   ReadFromAddress(0xA0000000 | (PE_BASEADDR + 4*(pe_pointer.size()-1))) ==
+				pe_pointer.back();
+}
+
+/*
+ * Jump to a resident PE and check that it answers EXEC_VERSION and that
+ * the CRC of its RAM matches the image: only then the download is skipped.
+ * On false the CPU has left serial execution mode and may be running
+ * garbage, so the caller must start the session over.
+ */
+bool pic32::pe_alive(const vector<uint32_t> &pe_pointer){
+	uint32_t rxp;
+	bool alive = false;
+
+	pe_probing = true;
+	pracc_lost = false;
+
+	// Jump to the PE
+	XferInstruction(0x3c19a000);
+	XferInstruction(0x37390000 | PE_BASEADDR);
+	XferInstruction(0x03200008);
+	XferInstruction(0x00000000);
+
+	SendCommand(ETAP_FASTDATA);
+	XferFastData4P(PE_CMD_EXEC_VERSION);
+	rxp = GetPEResponse();
+	if(!pracc_lost && (rxp & 0xFFFF0000) == PE_CMD_EXEC_VERSION){
+		pe_version = rxp & 0x0000FFFF;
+
+		XferFastData4P(PE_CMD_GET_CRC);
+		XferFastData4P(PE_BASEADDR);
+		XferFastData4P(pe_pointer.size()*4);
+		if(GetPEResponse() == PE_CMD_GET_CRC && !pracc_lost)
+			alive = (GetPEResponse() & 0x0000FFFF) == pe_crc16(pe_pointer) &&
+					!pracc_lost;
+	}
+
+	pe_probing = false;
+	pracc_lost = false;
+
+	if(alive && flags.debug)
+		fprintf(stderr, "PE v%04x resident, download skipped\n", pe_version);
+	return alive;
+}
+
+void pic32::download_pe(const vector<uint32_t> &pe_pointer){
+
+	uint32_t i;
 
 	// Set up PIC32 RAM address for PE.
 	XferInstruction(0x3c04a000);
@@ -487,10 +574,11 @@ void pic32::download_pe(vector<uint32_t> pe_pointer){
 	XferFastData4P(0xdead0000);
 
 	XferFastData4P(PE_CMD_EXEC_VERSION);
-	GetPEResponse();
+	pe_version = GetPEResponse() & 0x0000FFFF;
 }
 
-bool pic32::setup_pe(void){
+/* From program mode to serial execution, with the RAM set up for the PE */
+bool pic32::start_serial_exec(void){
 
 	if(!check_device_status()){
         cerr << "Timeout occurred checking device status!" << endl;
@@ -502,25 +590,56 @@ bool pic32::setup_pe(void){
         return false;
     }
 
+	init_pe_ram();
+	return true;
+}
+
+bool pic32::setup_pe(void){
+
+	if(!start_serial_exec())
+		return false;
+
+	vector<uint32_t> *pe_image;
+
 	switch(subfamily){
 		case SF_PIC32MX1:
 		case SF_PIC32MX2:
-			download_pe(pic32_pemx1);
+			pe_image = &pic32_pemx1;
 			break;
 		case SF_PIC32MX3:
-			download_pe(pic32_pemx3);
+			pe_image = &pic32_pemx3;
 			break;
 		case SF_PIC32MZ:
 		case SF_PIC32MK:
-			download_pe(pic32_pemz);
+			pe_image = &pic32_pemz;
 			break;
 		default:
 			return false;
 	}
 
+	if(pe_resident(*pe_image)){
+		if(pe_alive(*pe_image))
+			return true;
+
+		/* the CPU is no longer in serial execution: start over */
+		if(flags.debug)
+			fprintf(stderr, "Resident PE not answering, downloading it again\n");
+		exit_program_mode();
+		enter_program_mode();
+		if(!start_serial_exec())
+			return false;
+	}
+	download_pe(*pe_image);
+
 	return true;
 }
 
+/* shortest PGC phase of the family, the floor of --autotune */
+uint32_t pic32::pgc_min_ns(void){
+	return DELAY_P1A.half_min > DELAY_P1B.half_min ?
+			DELAY_P1A.half_min : DELAY_P1B.half_min;
+}
+
 bool pic32::read_device_id(void){
 	uint32_t rxp;
 
@@ -554,8 +673,7 @@ bool pic32::read_device_id(void){
 			strcpy(name, piclist[i].name);
 			mem.code_memory_size = piclist[i].code_memory_size;
 			mem.program_memory_size = 0x03000000;
-			mem.location = (uint16_t*) calloc(mem.program_memory_size,sizeof(uint16_t));
-			mem.filled = (bool*) calloc(mem.program_memory_size,sizeof(bool));
+			mem.clear();
 			found = true;
 			break;
 		}
@@ -565,22 +683,27 @@ bool pic32::read_device_id(void){
 		case SF_PIC32MX1:
 		case SF_PIC32MX2:
 			rowsize  = 128;
+			pagesize = 0x00000400;
 			bootsize = 0x00000C00;
 			break;
 		case SF_PIC32MX3:
 			rowsize  = 512;
+			pagesize = 0x00001000;
 			bootsize = 0x00003000;
 			break;
 		case SF_PIC32MK:
 			rowsize  = 2048;
+			pagesize = 0x00001000;
 			bootsize = 0x00005000;
 			break;
 		case SF_PIC32MZ:
 			rowsize  = 2048;
+			pagesize = 0x00004000;
 			bootsize = 0x00014000;
 			break;
 		default:
 			rowsize  = 128;
+			pagesize = 0x00000400;
 			bootsize = 0x00000C00;
 			break;
 	}
@@ -619,27 +742,46 @@ void pic32::read(char *outfile, uint32_t start, uint32_t count){
 	uint32_t blocksize = 0;	// expressed in bytes
 	const uint32_t max_blocksize = 0x0000FFFF*4;
 	const uint32_t programsize = mem.code_memory_size*2;
-	uint32_t counter = 0, read_locations = 0, i = 0;
+	uint32_t i = 0;
 	uint8_t area = PROGRAM_AREA;
 	uint32_t addr=0, startaddr = 0, stopaddr = 0;
+	uint32_t progstart = 0, progstop = programsize;
+	bool read_program = !flags.boot_only, read_boot = !flags.program_only;
+	readback *rb;
+
+	/* start and count are in 16-bit locations of program flash */
+	if(count != 0){
+		progstart = (start*2) & ~3;
+		progstop = std::min(programsize, ((start + count)*2 + 3) & ~3);
+		read_program = true;
+		read_boot = false;
+		fprintf(stderr, "Read only %d memory locations, from %06X to %06X\n",
+				count, start, start + count);
+	}
 
 	if(!flags.debug) cerr << "[ 0%]";
 	if(flags.client) fprintf(stdout, "@000");
 
 	uint32_t total_to_read = 0;
-	if (!flags.program_only)
+	if (read_boot)
 		total_to_read += bootsize;
-	if (!flags.boot_only)
-		total_to_read += programsize;
+	if (read_program && progstop > progstart)
+		total_to_read += progstop - progstart;
+
+	/* the words are stored and written out by the readback consumer */
+	rb = readback_start(&mem,
+			hex_open(outfile, PROGRAM_FLASH_BASEADDR, mem.program_memory_size >= 0x10000),
+			RB_SKIP_WORD, 0xFFFFFFFF,
+			total_to_read/2);
 
 	do{
 		switch(area){
 			case PROGRAM_AREA:	// Read Program Flash (0x1D000000 to 0x1D000000+CodeMem)
-				startaddr = 0;
-				stopaddr = programsize;
+				startaddr = progstart;
+				stopaddr = progstop;
 				blocksize = max_blocksize;
-				if(programsize < max_blocksize)
-					blocksize = programsize;
+				if(stopaddr - startaddr < max_blocksize)
+					blocksize = stopaddr - startaddr;
 				break;
 			case BOOT_AREA:	// Read bootflash+configuration
 				startaddr = BOOTFLASH_OFFSET;
@@ -650,7 +792,7 @@ void pic32::read(char *outfile, uint32_t start, uint32_t count){
 				break;
 		}
 
-		if(((area == PROGRAM_AREA) & !flags.boot_only) || ((area == BOOT_AREA) & !flags.program_only)){
+		if((area == PROGRAM_AREA && read_program) || (area == BOOT_AREA && read_boot)){
 
 			// addr is espressed in BYTES
 			uint32_t cur_blocksize;
@@ -667,155 +809,238 @@ void pic32::read(char *outfile, uint32_t start, uint32_t count){
 
 				// i is expressed in BYTES
 				for(i=0; i < cur_blocksize; i+=4){
-					int word_addr = (addr + i) / 2;
 					rxp = GetPEResponse();
-					if(flags.fulldump || (rxp != 0xFFFFFFFF)) {
-						mem.location[word_addr] = rxp & 0x0000FFFF;
-						mem.filled[word_addr] = 1;
-						mem.location[word_addr+1] = rxp >> 16;
-						mem.filled[word_addr+1] = 1;
-					}
-
-					read_locations += 4;
-
-					uint32_t cur_counter = read_locations*100/total_to_read;
-					if(counter != cur_counter){
-						counter = cur_counter;
-						if(flags.client)
-							fprintf(stdout,"@%03d", counter);
-						if(!flags.debug)
-							fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
-					}
+					readback_push(rb, (addr + i) / 2, rxp);
 				}
 			}
 		}
 		area++;
 	} while(area <= BOOT_AREA);
 
+	readback_finish(rb);
 	if(!flags.debug) cerr << "\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
-	write_inhx(&mem, outfile, PROGRAM_FLASH_BASEADDR);
 };
 
+/*
+ * true if any location of the row starting at (byte) address addr is
+ * filled; with --stream, among the rows received so far
+ */
+bool pic32::row_filled(uint32_t addr){
+	return mem.next_row(addr/2, rowsize/2) == addr/2;
+}
+
+/* The 32-bit word programmed at (byte) address addr */
+uint32_t pic32::image_word(uint32_t addr){
+	if(!mem.filled[addr/2])
+		return 0xFFFFFFFF;
+	return (uint32_t)mem.location[addr/2] | ((uint32_t)mem.location[addr/2+1] << 16);
+}
+
+/*
+ * Byte range of an area, relative to PROGRAM_FLASH_BASEADDR; false when the
+ * area is left out with --program-only or --boot-only.
+ */
+bool pic32::area_range(uint8_t area, uint32_t *startaddr, uint32_t *stopaddr){
+	switch(area){
+		case PROGRAM_AREA:	// Program Flash
+			*startaddr = 0;
+			*stopaddr = mem.code_memory_size*2;
+			return !flags.boot_only;
+		case BOOT_AREA:	// bootflash+configuration
+			*startaddr = BOOTFLASH_OFFSET;
+			*stopaddr = BOOTFLASH_OFFSET+bootsize;
+			return !flags.program_only;
+		default:
+			return false;
+	}
+}
+
+/* Sum of the image bytes, as PE_CMD_GET_CHECKSUM computes it on the device */
+uint32_t pic32::image_checksum(void){
+	uint32_t addr, startaddr, stopaddr, w, sum = 0;
+
+	for(uint8_t area=PROGRAM_AREA; area<=BOOT_AREA; area++){
+		if(!area_range(area, &startaddr, &stopaddr))
+			continue;
+		if(area == BOOT_AREA)
+			stopaddr -= 16;	// configuration words
+		for(addr=startaddr; addr<stopaddr; addr+=4){
+			w = image_word(addr);
+			sum += (w & 0xFF) + ((w >> 8) & 0xFF) + ((w >> 16) & 0xFF) + (w >> 24);
+		}
+	}
+	return sum;
+}
+
+/*
+ * --diff: compare the CRC of every page of the device with the one of the
+ * image. Pages that match are dropped from the image, the others are
+ * erased with PAGE_ERASE and written again by the row loop.
+ * Returns the number of locations dropped.
+ */
+uint32_t pic32::diff_pages(void){
+	uint32_t addr, startaddr, stopaddr, rxp, dropped = 0, changed = 0;
+	uint16_t crc;
+
+	for(uint8_t area=PROGRAM_AREA; area<=BOOT_AREA; area++){
+		if(!area_range(area, &startaddr, &stopaddr))
+			continue;
+		for(addr=startaddr; addr<stopaddr; addr+=pagesize){
+			crc = 0xFFFF;
+			for(uint32_t i=addr; i<addr+pagesize; i+=4)
+				crc = crc16_word(crc, image_word(i));
+
+			SendCommand(ETAP_FASTDATA);
+			XferFastData4P(PE_CMD_GET_CRC);
+			XferFastData4P(PROGRAM_FLASH_BASEADDR+addr);
+			XferFastData4P(pagesize);
+			/* no CRC word follows an error: rewrite the page */
+			rxp = GetPEResponse();
+			if(rxp != PE_CMD_GET_CRC)
+				fprintf(stderr, "___ERR___: %08x\n", rxp);
+			else if((GetPEResponse() & 0x0000FFFF) == crc){
+				for(uint32_t i=addr; i<addr+pagesize; i+=2)
+					if(mem.filled[i/2]){
+						mem.filled[i/2] = 0;
+						dropped++;
+					}
+				continue;
+			}
+
+			SendCommand(ETAP_FASTDATA);
+			XferFastData4P(PE_CMD_PAGE_ERASE | 1);
+			XferFastData4P(PROGRAM_FLASH_BASEADDR+addr);
+			rxp = GetPEResponse();
+			if(rxp != PE_CMD_PAGE_ERASE)
+				fprintf(stderr, "___ERR___: %08x\n", rxp);
+			changed++;
+		}
+	}
+
+	if(flags.debug)
+		fprintf(stderr, "%d pages changed\n", changed);
+	return dropped;
+}
+
 void pic32::write(char *infile){
 	uint32_t rxp = 0;
-	uint8_t area = PROGRAM_AREA;
-	uint32_t addr = 0, startaddr = 0, stopaddr = 0;
+	uint32_t addr = 0, startaddr = 0, stopaddr = 0, runend = 0, row = 0;
 	uint32_t filled_locations = 0, programmed_locations = 0;
-	bool skip = true;
 	uint32_t counter = 0;
 	uint32_t device_checksum = 0, calculated_checksum = 0;
 
-	filled_locations = read_inhx(infile, &mem, PROGRAM_FLASH_BASEADDR);
+	/* --diff compares the image with the flash before touching it */
+	if(flags.diff)
+		filled_locations = read_inhx(infile, &mem, PROGRAM_FLASH_BASEADDR);
+	else
+		filled_locations = read_inhx_erase(infile, this, PROGRAM_FLASH_BASEADDR);
 	if(!filled_locations) {
 		fprintf(stderr,"\n\n ERROR No filled locations!\n\n");
-		exit(31);
+		fatal(31);
+
 	}
 
-	bulk_erase();
+	if(flags.diff){
+		calculated_checksum = image_checksum();
+		filled_locations -= diff_pages();
+		if(!filled_locations)
+			filled_locations = 1;	/* nothing changed: only the checksum */
+	}
 
 	if(!flags.debug) cerr << "[ 0%]";
 	if(flags.client) fprintf(stdout, "@000");
 
-	do{
+	for(uint8_t area=PROGRAM_AREA; area<=BOOT_AREA; area++){
 
-		switch(area){
-			case PROGRAM_AREA:	// Write Program Flash
-				startaddr = 0;
-				stopaddr = (mem.code_memory_size*2)-1;
-				break;
-			case BOOT_AREA:	// Write bootflash+configuration
-				startaddr = BOOTFLASH_OFFSET;
-				stopaddr = startaddr+bootsize-1;
-				break;
-			default:
-				break;
-		}
+		if(!area_range(area, &startaddr, &stopaddr))
+			continue;
 
-		if(((area == PROGRAM_AREA) & !flags.boot_only) || ((area == BOOT_AREA) & !flags.program_only)){
+		for (addr = startaddr; addr < stopaddr; addr = runend){
 
-			for (addr = startaddr; addr < stopaddr; addr += rowsize){
+			/* straight to the next row with something to write */
+			runend = read_inhx_row(&mem, addr/2, rowsize/2);
+			if(runend == MEM_NO_ROW || 2*runend >= stopaddr)
+				break;
+			addr = 2*runend;
+
+			/*
+			 * A single PROGRAM command for the whole run of rows to
+			 * write. The PE programs a row while the next one comes in
+			 * and answers once per row: the answer to a row is read
+			 * after sending the following one, the last one at the end.
+			 * The ECC parts (MZ/MK) take whole rows too, so the quad-word
+			 * and cluster commands would not save anything here.
+			 */
+			for(runend = addr + rowsize; runend < stopaddr && row_filled(runend);
+				runend += rowsize);
+
+			SendCommand(ETAP_FASTDATA);
+			XferFastData4P(PE_CMD_PROGRAM);
+			XferFastData4P(PROGRAM_FLASH_BASEADDR+addr);
+			XferFastData4P(runend-addr);
+
+			for(row = addr; row < runend; row += rowsize){
+				if(row != addr)
+					SendCommand(ETAP_FASTDATA);
+				for(uint32_t i=row; i<row+rowsize; i+=4){
+					XferFastData4P(image_word(i));
+					if(mem.filled[i/2])
+						programmed_locations += 2;
 
-				skip = true;
-				for(uint32_t i=0; i<rowsize; i++){
-					if(mem.filled[(addr+i)/2]){
-						skip = false;
-						break;
+					if(counter != programmed_locations*100/filled_locations){
+						counter = programmed_locations*100/filled_locations;
+						if(flags.client)
+							fprintf(stdout,"@%03d", counter);
+						if(!flags.debug)
+							fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
 					}
 				}
-				if(skip){
-					calculated_checksum += 0x000000FF*rowsize;
+				if(row == addr)
 					continue;
-				}
-
-				SendCommand(ETAP_FASTDATA);
-				XferFastData4P(PE_CMD_ROW_PROGRAM);
-				XferFastData4P(PROGRAM_FLASH_BASEADDR+addr);
-
-				for(uint32_t i=0; i<rowsize; i+=4){
-					if(mem.filled[(addr+i)/2]){
-						XferFastData4P((uint32_t)mem.location[(addr+i)/2] |
-									((uint32_t)mem.location[(addr+i)/2+1] << 16));
-						programmed_locations += 2;
-						if((addr+i) < (BOOTFLASH_OFFSET+bootsize-16)){
-							calculated_checksum += (mem.location[(addr+i)/2] & 0x00FF) +
-												(mem.location[(addr+i)/2] >> 8) +
-												(mem.location[(addr+i)/2+1] & 0x00FF) +
-												(mem.location[(addr+i)/2+1] >> 8);
-						}
-					}
-					else{
-						XferFastData4P(0xFFFFFFFF);
-						if((addr+i) < (BOOTFLASH_OFFSET+bootsize-16))
-							calculated_checksum += 0x000000FF*4;
-					}
-				}
-				rxp = GetPEResponse();
-				if(rxp != PE_CMD_ROW_PROGRAM)
+				rxp = GetPEResponse();	// previous row
+				if(rxp != PE_CMD_PROGRAM)
 					fprintf(stderr, "___ERR___: %08x\n", rxp);
-
-				if(counter != programmed_locations*100/filled_locations){
-					counter = programmed_locations*100/filled_locations;
-					if(flags.client)
-						fprintf(stdout,"@%03d", counter);
-					if(!flags.debug)
-						fprintf(stderr,"\b\b\b\b\b[%2d%%]", counter);
-				}
 			}
+			rxp = GetPEResponse();	// last row
+			if(rxp != PE_CMD_PROGRAM)
+				fprintf(stderr, "___ERR___: %08x\n", rxp);
 		}
-		area++;
-	} while(area<=BOOT_AREA);
+	}
 
 	if(!flags.debug) cerr << "\b\b\b\b\b\b";
 	if(flags.client) fprintf(stdout, "@FIN");
 
-	// Checksum verification
-	// Program area checksum
-	SendCommand(ETAP_FASTDATA);
-	XferFastData4P(PE_CMD_GET_CHECKSUM);
-	XferFastData4P(PROGRAM_FLASH_BASEADDR);
-	XferFastData4P(mem.code_memory_size*2);
-	rxp = GetPEResponse();
-	if(rxp != PE_CMD_GET_CHECKSUM)
-		fprintf(stderr, "___ERR___: %08x\n", rxp);
-	device_checksum = GetPEResponse();
-
-	// Boot area checksum
-	SendCommand(ETAP_FASTDATA);
-	XferFastData4P(PE_CMD_GET_CHECKSUM);
-	XferFastData4P(PROGRAM_FLASH_BASEADDR+BOOTFLASH_OFFSET);
-	XferFastData4P(bootsize-16);
-	rxp = GetPEResponse();
-	if(rxp != PE_CMD_GET_CHECKSUM)
-		fprintf(stderr, "___ERR___: %08x\n", rxp);
-	device_checksum += GetPEResponse();
+	/* --stream: the whole file is in, the checksum can be computed */
+	filled_locations = read_inhx_wait(&mem, filled_locations);
+	if(!filled_locations)
+		fatal(31);
+	if(!flags.diff)
+		calculated_checksum = image_checksum();
+
+	// Checksum verification, over the same areas as image_checksum()
+	for(uint8_t area=PROGRAM_AREA; area<=BOOT_AREA; area++){
+		if(!area_range(area, &startaddr, &stopaddr))
+			continue;
+		if(area == BOOT_AREA)
+			stopaddr -= 16;	// configuration words
+
+		SendCommand(ETAP_FASTDATA);
+		XferFastData4P(PE_CMD_GET_CHECKSUM);
+		XferFastData4P(PROGRAM_FLASH_BASEADDR+startaddr);
+		XferFastData4P(stopaddr-startaddr);
+		rxp = GetPEResponse();
+		if(rxp != PE_CMD_GET_CHECKSUM)
+			fprintf(stderr, "___ERR___: %08x\n", rxp);
+		device_checksum += GetPEResponse();
+	}
 
 	if(calculated_checksum != device_checksum){
 		fprintf(stderr, "___CHECKSUM ERROR!___\n");
 		fprintf(stderr, "DEVICE CHECKSUM: %08x\n", device_checksum);
 		fprintf(stderr, "CALCULATED CHECKSUM: %08x\n", calculated_checksum);
 		if(flags.client) fprintf(stdout, "@ERR");
-		exit(35);
+		fatal(35);
 	}
 
 	if(flags.client) fprintf(stdout, "@FIN");
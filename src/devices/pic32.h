@@ -20,6 +20,7 @@
 
 #include <iostream>
 #include <vector>
+#include <ctime>
 
 #include "../common.h"
 #include "device.h"
@@ -47,6 +48,7 @@ class pic32: public Pic{
 		void exit_program_mode(void);
 		bool setup_pe(void);
 		bool read_device_id(void);
+		uint32_t pgc_min_ns(void);
 		void bulk_erase(void);
 		void dump_configuration_registers(void);
 		void read(char *outfile, uint32_t start=0, uint32_t count=0);
@@ -64,13 +66,27 @@ class pic32: public Pic{
 		void XferInstruction(uint32_t instruction);
 		uint32_t ReadFromAddress(uint32_t address);
 		uint32_t GetPEResponse(void);
+		bool pracc_retry(uint32_t n, clock_t *start);
 		bool check_device_status(void);
 		void code_protected_bulk_erase(void);
 		bool enter_serial_exec_mode(void);
-		void download_pe(vector<uint32_t> pe_pointer);
+		void init_pe_ram(void);
+		bool start_serial_exec(void);
+		bool pe_resident(const vector<uint32_t> &pe_pointer);
+		bool pe_alive(const vector<uint32_t> &pe_pointer);
+		void download_pe(const vector<uint32_t> &pe_pointer);
+		bool row_filled(uint32_t addr);
+		uint32_t image_word(uint32_t addr);
+		bool area_range(uint8_t area, uint32_t *startaddr, uint32_t *stopaddr);
+		uint32_t image_checksum(void);
+		uint32_t diff_pages(void);
 		
+		uint16_t pe_version;
+		bool pe_probing = false;	/* pe_alive() running: short PrACC timeouts */
+		bool pracc_lost = false;	/* a PrACC poll timed out while probing */
 		uint32_t bootsize;
 		uint32_t rowsize;
+		uint32_t pagesize;
 
 		/*
 		* DEVICES SECTION
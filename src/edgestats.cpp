@@ -0,0 +1,152 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef EDGE_STATS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+
+/*
+ * Log-linear histogram of the half periods: 1ns buckets below 256ns, then
+ * 32 buckets per power of two (3% resolution) up to ~2000s.
+ */
+#define HIST_LINEAR		256
+#define HIST_SUB_BITS	5
+#define HIST_MAX_EXP	40
+#define HIST_BUCKETS	(HIST_LINEAR + (HIST_MAX_EXP - 7) * (1 << HIST_SUB_BITS))
+
+#define WORST_STALLS	8
+
+struct stall {
+	uint64_t ns;
+	uint64_t edge;
+};
+
+static thread_local uint32_t hist[HIST_BUCKETS];
+static thread_local struct stall worst[WORST_STALLS];
+static thread_local uint64_t last_ticks;
+static thread_local uint64_t edges;			/* measured half periods */
+static thread_local uint64_t total_ns;
+static thread_local uint64_t ns_per_tick_q16;
+
+static inline unsigned int bucket(uint64_t ns)
+{
+	unsigned int e;
+
+	if (ns < HIST_LINEAR)
+		return ns;
+	if (ns >> (HIST_MAX_EXP + 1))
+		ns = (1ULL << (HIST_MAX_EXP + 1)) - 1;
+	e = 63 - __builtin_clzll(ns);
+	return HIST_LINEAR + (e - 8) * (1 << HIST_SUB_BITS) +
+			((ns >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* lower bound of a bucket, in ns */
+static uint64_t bucket_ns(unsigned int b)
+{
+	unsigned int e, m;
+
+	if (b < HIST_LINEAR)
+		return b;
+	e = (b - HIST_LINEAR) / (1 << HIST_SUB_BITS) + 8;
+	m = (b - HIST_LINEAR) % (1 << HIST_SUB_BITS);
+	return (uint64_t)((1 << HIST_SUB_BITS) + m) << (e - HIST_SUB_BITS);
+}
+
+static uint64_t percentile(unsigned int pct)
+{
+	uint64_t seen = 0, target = (edges * pct + 99) / 100;
+	unsigned int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= target)
+			return bucket_ns(b);
+	}
+	return bucket_ns(HIST_BUCKETS - 1);
+}
+
+void edge_stats_burst(void)
+{
+	last_ticks = 0;
+}
+
+void edge_stats_edge(void)
+{
+	uint64_t now = delay_ticks();
+	uint64_t ns;
+	int i;
+
+	if (last_ticks == 0) {
+		last_ticks = now;
+		if (ns_per_tick_q16 == 0)
+			ns_per_tick_q16 = delay_ticks_to_ns(1 << 16);
+		return;
+	}
+
+	ns = ((now - last_ticks) * ns_per_tick_q16) >> 16;
+	last_ticks = now;
+
+	hist[bucket(ns)]++;
+	edges++;
+	total_ns += ns;
+
+	if (ns > worst[WORST_STALLS - 1].ns) {
+		for (i = WORST_STALLS - 1; i > 0 && worst[i - 1].ns < ns; i--)
+			worst[i] = worst[i - 1];
+		worst[i].ns = ns;
+		worst[i].edge = edges;
+	}
+}
+
+/* Print the statistics of the edges seen since the last report */
+void edge_stats_report(const char *operation)
+{
+	int i;
+
+	if (edges == 0)
+		return;
+
+	fprintf(stderr, "\nPGC edges (%s): %llu half periods, "
+			"p50 %lluns, p99 %lluns, max %lluns, %.3f Mbit/s\n",
+			operation, (unsigned long long)edges,
+			(unsigned long long)percentile(50),
+			(unsigned long long)percentile(99),
+			(unsigned long long)worst[0].ns,
+			total_ns ? edges * 500.0 / total_ns : 0.0);
+
+	fprintf(stderr, "Worst stalls:");
+	for (i = 0; i < WORST_STALLS && worst[i].ns; i++)
+		fprintf(stderr, " %lluns@%llu", (unsigned long long)worst[i].ns,
+				(unsigned long long)worst[i].edge);
+	fprintf(stderr, "\n");
+
+	memset(hist, 0, sizeof(hist));
+	memset(worst, 0, sizeof(worst));
+	edges = 0;
+	total_ns = 0;
+	last_ticks = 0;
+}
+
+#endif /* EDGE_STATS */
@@ -0,0 +1,48 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EDGESTATS_H_
+#define EDGESTATS_H_
+
+/*
+ * PGC edge instrumentation, built only with "make <target> EDGE_STATS=1".
+ *
+ * The shift loops mark every clock edge with PGC_EDGE() and the start of
+ * every burst of edges (a command, a data word...) with PGC_BURST(), so
+ * that the time spent between bursts is not mistaken for a stretched
+ * phase. edge_stats_report() prints the half period distribution of the
+ * last operation and resets it. Without EDGE_STATS all of it compiles
+ * to nothing.
+ */
+#ifdef EDGE_STATS
+void edge_stats_burst(void);
+void edge_stats_edge(void);
+void edge_stats_report(const char *operation);
+
+#define PGC_BURST()		edge_stats_burst()
+#define PGC_EDGE()		edge_stats_edge()
+#else
+#define PGC_BURST()		do { } while (0)
+#define PGC_EDGE()		do { } while (0)
+
+static inline void edge_stats_report(const char *operation) {}
+#endif
+
+#endif /* EDGESTATS_H_ */
@@ -0,0 +1,156 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+
+int gang_count = 0;
+int gang_data[GANG_MAX];
+uint32_t gang_mask = 0;
+uint32_t gang_word[GANG_MAX];
+uint32_t gang_failed = 0;
+
+/* why and where every target failed, for the report */
+static const char *fail_what[GANG_MAX];
+static uint32_t fail_addr[GANG_MAX];
+
+/* Parse "PGC,MCLR,PGD1,PGD2,...", filling pic_clk, pic_mclr and pic_data */
+bool gang_parse(const char *pins)
+{
+#ifdef GPIO_SET_MASK
+	const char *p = pins;
+	char *end;
+	int pin[GANG_MAX + 2];
+	int n = 0, t, i;
+
+	while (n < GANG_MAX + 2) {
+		pin[n++] = strtol(p, &end, 10);
+		if (end == p || (*end != ',' && *end != '\0'))
+			return false;
+		if (pin[n - 1] < 0 || pin[n - 1] > 31)	/* GPIO bank 0 only */
+			return false;
+		if (*end == '\0')
+			break;
+		p = end + 1;
+	}
+	if (n < 3 || *end != '\0')
+		return false;
+
+	/* every PGD is a line of its own, apart from PGC, MCLR and the others */
+	for (t = 1; t < n; t++)
+		for (i = 0; i < t; i++)
+			if (pin[i] == pin[t]) {
+				fprintf(stderr, "GPIO %d is used twice in the gang.\n", pin[t]);
+				return false;
+			}
+
+	pic_clk = pin[0];
+	pic_mclr = pin[1];
+	gang_count = n - 2;
+	gang_mask = 0;
+	for (t = 0; t < gang_count; t++) {
+		gang_data[t] = pin[t + 2];
+		gang_mask |= GPIO_MASK(gang_data[t]);
+	}
+	pic_data = gang_data[0];
+
+	return true;
+#else
+	fprintf(stderr, "Gang programming is not supported on this host.\n");
+	return false;
+#endif
+}
+
+/* Mark as failed the targets that did not return the expected value */
+void gang_check(uint32_t expected, const char *what)
+{
+	int t;
+
+	for (t = 0; t < gang_count; t++)
+		if (GANG_ALIVE(t) && gang_word[t] != expected) {
+			fprintf(stderr, "Gang target %d (PGD %d): %s 0x%04x instead of 0x%04x\n",
+					t + 1, gang_data[t] & 0xFF, what, gang_word[t], expected);
+			gang_failed |= 1UL << t;
+			fail_what[t] = what;
+		}
+}
+
+/* A verify error on one target: drop it from the gang and go on */
+void gang_fail(int target, uint32_t addr, uint32_t written, uint32_t read)
+{
+	fprintf(stderr, "\n Gang target %d (PGD %d): ERROR at address %06X: "
+			"written %04X but %04X read!\n",
+			target + 1, gang_data[target] & 0xFF, addr, written, read);
+	gang_failed |= 1UL << target;
+	fail_what[target] = "verify";
+	fail_addr[target] = addr;
+}
+
+/* OR of the last word read from the targets still in the gang */
+uint32_t gang_or(void)
+{
+	uint32_t word = 0;
+	int t;
+
+	for (t = 0; t < gang_count; t++)
+		if (GANG_ALIVE(t))
+			word |= gang_word[t];
+
+	return word;
+}
+
+/* First target still in the gang (the first one when all have failed) */
+int gang_first(void)
+{
+	int t;
+
+	for (t = 0; t < gang_count; t++)
+		if (GANG_ALIVE(t))
+			return t;
+
+	return 0;
+}
+
+/* Print the result of every target, return the number of failed ones */
+int gang_report(void)
+{
+	int t, failed = 0;
+
+	fprintf(stdout, "Gang results:\n");
+	for (t = 0; t < gang_count; t++) {
+		if (GANG_ALIVE(t))
+			fprintf(stdout, "  target %2d (PGD %2d): OK\n",
+					t + 1, gang_data[t] & 0xFF);
+		else {
+			fprintf(stdout, "  target %2d (PGD %2d): FAILED (%s", t + 1,
+					gang_data[t] & 0xFF, fail_what[t]);
+			if (strcmp(fail_what[t], "verify") == 0)
+				fprintf(stdout, " at 0x%06X", fail_addr[t]);
+			fprintf(stdout, ")\n");
+			failed++;
+		}
+	}
+
+	return failed;
+}
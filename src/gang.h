@@ -0,0 +1,94 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GANG_H_
+#define GANG_H_
+
+/*
+ * Gang programming ("--gang=PGC,MCLR,PGD1,PGD2,..."): several targets share
+ * PGC and MCLR and have a PGD line each. The command stream is the same for
+ * all of them, so a single GPSET0/GPCLR0 store drives every PGD at once and
+ * a single GPLEV0 sample holds one bit of every target. Only available on
+ * hosts with mask registers (GPIO_SET_MASK) and all the pins must be in
+ * the same bank.
+ *
+ * The first PGD is also pic_data, so code that knows nothing about gangs
+ * keeps talking to the first target. A target that fails (wrong device ID,
+ * verify error) is marked in gang_failed and is still clocked along with
+ * the others, but its results are ignored.
+ */
+#define GANG_MAX	16
+
+extern int gang_count;					/* 0: single target */
+extern int gang_data[GANG_MAX];			/* PGD of every target */
+extern uint32_t gang_mask;				/* all the PGD lines */
+extern uint32_t gang_word[GANG_MAX];	/* last word read from every target */
+extern uint32_t gang_failed;			/* one bit per target */
+
+bool gang_parse(const char *pins);
+void gang_check(uint32_t expected, const char *what);
+void gang_fail(int target, uint32_t addr, uint32_t written, uint32_t read);
+uint32_t gang_or(void);
+int gang_first(void);
+int gang_report(void);
+
+#define GANG_ALIVE(t)	(!(gang_failed & (1UL << (t))))
+
+#ifdef GPIO_SET_MASK
+/* PGD lines driven by the shift kernels */
+static inline uint32_t pgd_mask(void)
+{
+	return gang_count ? gang_mask : GPIO_MASK(pic_data);
+}
+#endif
+
+/* PGD direction and level, on every target of the gang */
+static inline void pgd_in(void)
+{
+	int t;
+
+	if (!gang_count)
+		GPIO_IN(pic_data);
+	for (t = 0; t < gang_count; t++)
+		GPIO_IN(gang_data[t]);
+}
+
+static inline void pgd_out(void)
+{
+	int t;
+
+	if (!gang_count)
+		GPIO_OUT(pic_data);
+	for (t = 0; t < gang_count; t++)
+		GPIO_OUT(gang_data[t]);
+}
+
+static inline void pgd_clr(void)
+{
+#ifdef GPIO_SET_MASK
+	if (gang_count) {
+		GPIO_CLR_MASK(gang_mask);
+		return;
+	}
+#endif
+	GPIO_CLR(pic_data);
+}
+
+#endif /* GANG_H_ */
@@ -36,6 +36,8 @@
 #include <iostream>
 #include <fstream>
 
+/* gpio_test links alone: the GPIO macros must not reference the tracer */
+#define GPIO_NO_TRACE
 #include "common.h"
 
 int                 mem_fd;
@@ -40,12 +40,12 @@
 #define PULL        0x1C
 
 /* GPIO setup macros. Always use GPIO_IN(x) before using GPIO_OUT(x) */
-#define GPIO_IN(g)    *(int*)((char*)gpio+OFFSET+(g>>8)+(((int)(g&0xFF)/8)*4)) &= ~(0x07<<(((int)(g&0xFF)%8)*4))
-#define GPIO_OUT(g)   *(int*)((char*)gpio+OFFSET+(g>>8)+(((int)(g&0xFF)/8)*4)) |= (0x01<<(((int)(g&0xFF)%8)*4))
+#define HOST_GPIO_IN(g)    *(int*)((char*)gpio+OFFSET+(g>>8)+(((int)(g&0xFF)/8)*4)) &= ~(0x07<<(((int)(g&0xFF)%8)*4))
+#define HOST_GPIO_OUT(g)   *(int*)((char*)gpio+OFFSET+(g>>8)+(((int)(g&0xFF)/8)*4)) |= (0x01<<(((int)(g&0xFF)%8)*4))
 
-#define GPIO_SET(g)   *(int*)((char*)gpio+OFFSET+(g>>8)+SET) |= 1<<(int)(g&0xFF)
-#define GPIO_CLR(g)   *(int*)((char*)gpio+OFFSET+(g>>8)+SET) &= ~(1<<(int)(g&0xFF))
-#define GPIO_LEV(g)   (*(int*)((char*)gpio+OFFSET+(g>>8)+SET) >> (int)(g&0xFF)) & 0x1
+#define HOST_GPIO_SET(g)   *(int*)((char*)gpio+OFFSET+(g>>8)+SET) |= 1<<(int)(g&0xFF)
+#define HOST_GPIO_CLR(g)   *(int*)((char*)gpio+OFFSET+(g>>8)+SET) &= ~(1<<(int)(g&0xFF))
+#define HOST_GPIO_LEV(g)   (*(int*)((char*)gpio+OFFSET+(g>>8)+SET) >> (int)(g&0xFF)) & 0x1
 
 /* default GPIO <-> PIC connections */
 #define DEFAULT_PIC_CLK    (int)((PB<<8)|15)   /* PGC - Output - PB15 */
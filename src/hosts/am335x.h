@@ -37,12 +37,12 @@
 #define OFFSET(g) ((int)((bool)(g/32))*(GPIO1_BASE-GPIO0_BASE)+(int)((bool)(g/64))*(GPIO2_BASE-GPIO1_BASE)+(int)((bool)(g/96))*(GPIO3_BASE-GPIO2_BASE))/4
 
 /* GPIO setup macros. Always use GPIO_IN(x) before using GPIO_OUT(x) */
-#define GPIO_OUT(g)   *(gpio+OFFSET(g)+GPIO_OE_REG) &= ~(0x01<<(g%32))
-#define GPIO_IN(g)    *(gpio+OFFSET(g)+GPIO_OE_REG) |= (0x01<<(g%32))
+#define HOST_GPIO_OUT(g)   *(gpio+OFFSET(g)+GPIO_OE_REG) &= ~(0x01<<(g%32))
+#define HOST_GPIO_IN(g)    *(gpio+OFFSET(g)+GPIO_OE_REG) |= (0x01<<(g%32))
 
-#define GPIO_SET(g)   *(gpio+OFFSET(g)+GPIO_OUT_REG) |= (0x01<<(g%32))
-#define GPIO_CLR(g)   *(gpio+OFFSET(g)+GPIO_OUT_REG) &= ~(0x01<<(g%32))
-#define GPIO_LEV(g)   (*(gpio+OFFSET(g)+GPIO_IN_REG) >> (g%32)) & 0x01
+#define HOST_GPIO_SET(g)   *(gpio+OFFSET(g)+GPIO_OUT_REG) |= (0x01<<(g%32))
+#define HOST_GPIO_CLR(g)   *(gpio+OFFSET(g)+GPIO_OUT_REG) &= ~(0x01<<(g%32))
+#define HOST_GPIO_LEV(g)   (*(gpio+OFFSET(g)+GPIO_IN_REG) >> (g%32)) & 0x01
 
 /* default GPIO <-> PIC connections */
 #define DEFAULT_PIC_CLK    60   /* PGC  - Output - gpio1_28 */
@@ -25,13 +25,29 @@
 #define BLOCK_SIZE         (256)
 #define PORTOFFSET         0
 
+/* /dev/gpiomem exposes just the GPIO block, at offset 0, without root */
+#ifdef GPIO_GPIOMEM
+#define GPIO_DEVICE        "/dev/gpiomem"
+#define GPIO_MAP_BASE      0
+#endif
+
 /* GPIO setup macros. Always use GPIO_IN(x) before using GPIO_OUT(x) */
-#define GPIO_IN(g)    *(gpio+((g&0xFF)/10))   &= ~(7<<(((g&0xFF)%10)*3))
-#define GPIO_OUT(g)   *(gpio+((g&0xFF)/10))   |=  (1<<(((g&0xFF)%10)*3))
+#define HOST_GPIO_IN(g)    do { gpio_rmw_lock(); \
+                           *(gpio+((g&0xFF)/10)) &= ~(7<<(((g&0xFF)%10)*3)); \
+                           gpio_rmw_unlock(); } while (0)
+#define HOST_GPIO_OUT(g)   do { gpio_rmw_lock(); \
+                           *(gpio+((g&0xFF)/10)) |=  (1<<(((g&0xFF)%10)*3)); \
+                           gpio_rmw_unlock(); } while (0)
+
+#define HOST_GPIO_SET(g)   *(gpio+7)  = 1<<(g&0xFF)
+#define HOST_GPIO_CLR(g)   *(gpio+10) = 1<<(g&0xFF)
+#define HOST_GPIO_LEV(g)   (*(gpio+13) >> (g&0xFF)) & 0x1 /* reads pin level */
 
-#define GPIO_SET(g)   *(gpio+7)  = 1<<(g&0xFF)
-#define GPIO_CLR(g)   *(gpio+10) = 1<<(g&0xFF)
-#define GPIO_LEV(g)   (*(gpio+13) >> (g&0xFF)) & 0x1 /* reads pin level */
+/* Whole-bank access for the shift kernels: GPSET0/GPCLR0 take a mask */
+#define GPIO_MASK(g)            (1<<(g&0xFF))
+#define HOST_GPIO_SET_MASK(m)   *(gpio+7)  = (m)
+#define HOST_GPIO_CLR_MASK(m)   *(gpio+10) = (m)
+#define HOST_GPIO_LEV_MASK()    (*(gpio+13))
 
 /* default GPIO <-> PIC connections */
 #define DEFAULT_PIC_CLK    23   /* PGC - Output */
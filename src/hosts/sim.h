@@ -0,0 +1,55 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulated GPIO backend, for building and profiling picberry on machines
+ * without a programming header: pins are kept in memory and nothing is
+ * mapped. See sim.cpp.
+ */
+#define GPIO_SIMULATED
+#define GPIO_BASE          0
+#define BLOCK_SIZE         (4096)
+#define PORTOFFSET         0
+
+void sim_gpio_dir(int g, int input);
+void sim_gpio_write(int g, int level);
+int  sim_gpio_read(int g);
+void sim_gpio_set_mask(uint32_t mask);
+void sim_gpio_clr_mask(uint32_t mask);
+uint32_t sim_gpio_lev_mask(void);
+
+/* GPIO setup macros. Always use GPIO_IN(x) before using GPIO_OUT(x) */
+#define HOST_GPIO_IN(g)    sim_gpio_dir(g, 1)
+#define HOST_GPIO_OUT(g)   sim_gpio_dir(g, 0)
+
+#define HOST_GPIO_SET(g)   sim_gpio_write(g, 1)
+#define HOST_GPIO_CLR(g)   sim_gpio_write(g, 0)
+#define HOST_GPIO_LEV(g)   sim_gpio_read(g)  /* reads pin level */
+
+/* Set/clear/level registers, pins 0 to 31 (gang mode) */
+#define GPIO_MASK(g)            (1<<(g&0xFF))
+#define HOST_GPIO_SET_MASK(m)   sim_gpio_set_mask(m)
+#define HOST_GPIO_CLR_MASK(m)   sim_gpio_clr_mask(m)
+#define HOST_GPIO_LEV_MASK()    sim_gpio_lev_mask()
+
+/* default GPIO <-> PIC connections, as on the Raspberry Pi */
+#define DEFAULT_PIC_CLK    23   /* PGC - Output */
+#define DEFAULT_PIC_DATA   24   /* PGD - I/O */
+#define DEFAULT_PIC_MCLR   18   /* MCLR - Output */
@@ -22,6 +22,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <iostream>
 
@@ -30,260 +36,817 @@
 using namespace std;
 
 /*
- * Read a file in Intel HEX8M or HEX32 format and fill the memory structure
- * Returns the number of filled locations
- *
+ * Data outside of the memory image is dropped, with a warning (once per
+ * parser thread: the --channel workers parse their files concurrently)
  */
-unsigned int read_inhx(char *infile, memory *mem, uint32_t offset)
+static bool in_range(memory *mem, uint32_t index)
 {
-    FILE *fp;
-    int linenum;
-    char line[256], *ptr;
-    size_t linelen;
-    int nread;
+    static thread_local bool warned = false;
+
+    if (index < mem->program_memory_size)
+        return true;
+    if (!warned)
+        cerr << "Warning: hex data outside of the device memory ignored." << endl;
+    warned = true;
+    return false;
+}
 
-    unsigned int filled_locations=0;
+/* value of each character as a hex digit, HEX_BAD if it is not one */
+#define HEX_BAD 0xF0
 
-    uint16_t i=0;
-    uint8_t  byte_count;
-    uint16_t base_address = 0x0000;
-    uint16_t address;
-    uint32_t extended_address;
-    uint8_t  record_type;
-    uint16_t data, tmp;
-    uint8_t  checksum_calculated;
-    uint8_t  checksum_read;
-
-    fp = fopen(infile, "r");
-    if (fp == NULL) {
-        cerr << "Error: cannot open source file " << infile << endl;
-        return 0;
+static constexpr uint8_t hex_digit(int c)
+{
+    return c >= '0' && c <= '9' ? c - '0' :
+           c >= 'A' && c <= 'F' ? c - 'A' + 10 :
+           c >= 'a' && c <= 'f' ? c - 'a' + 10 : HEX_BAD;
+}
+
+/*
+ * Built at compile time, so that the parser threads (--stream, --channel)
+ * share it without any initialisation.
+ */
+#define HEX_4(c)    hex_digit(c), hex_digit((c) + 1), hex_digit((c) + 2), hex_digit((c) + 3)
+#define HEX_16(c)   HEX_4(c), HEX_4((c) + 4), HEX_4((c) + 8), HEX_4((c) + 12)
+#define HEX_64(c)   HEX_16(c), HEX_16((c) + 16), HEX_16((c) + 32), HEX_16((c) + 48)
+
+static const uint8_t hex_value[256] = {
+    HEX_64(0), HEX_64(64), HEX_64(128), HEX_64(192)
+};
+
+/* Decode the two hex digits at p, false if they are not */
+static inline bool hex_byte(const char *p, uint8_t *byte)
+{
+    uint8_t hi = hex_value[(uint8_t)p[0]], lo = hex_value[(uint8_t)p[1]];
+
+    *byte = (hi << 4) | lo;
+    return ((hi | lo) & HEX_BAD) == 0;
+}
+
+/* The record, as the old line by line parser printed it */
+static void debug_record(const char *line, size_t linelen, int linenum,
+                         uint8_t byte_count, uint16_t address, uint8_t record_type,
+                         const uint8_t *data, uint32_t extended_address)
+{
+    size_t i;
+
+    fprintf(stderr, "  line %d (%zd bytes): '", linenum, linelen);
+    for (i = 0; i < linelen; i++) {
+        if (line[i] == '\n')
+            cerr << "\\n";
+        else if (line[i] == '\r')
+            cerr << "\\r";
+        else
+            fprintf(stderr, "%c", line[i]);
     }
+    cerr << "'\n";
+
+    fprintf(stderr, "  byte_count  = 0x%02X\n", byte_count);
+    if (record_type != 0x04)
+        fprintf(stderr, "  address     = 0x%04X\n", address);
+    fprintf(stderr, "  record_type = 0x%02X (%s)\n",
+            record_type, record_type == 0 ? "data" :
+                (record_type == 1 ? "EOF" :
+                    (record_type == 0x04 ? "Extended Linear Address" : "Unknown")));
+
+    if (record_type == 0x04) {
+        fprintf(stderr, "  NEW BASE ADDRESS     = 0x%04X\n", (data[0] << 8) | data[1]);
+    } else {
+        for (i = 0; i < byte_count; i += 2)
+            fprintf(stderr, "  data        = 0x%04X @0x%08X\n",
+                    i + 1 < byte_count ? data[i] | (data[i+1] << 8) : data[i],
+                    (uint32_t)(extended_address/2 + i/2));
+    }
+    fprintf(stderr, "  checksum    = 0x%02X\n\n", data[byte_count]);
+}
 
-    if(flags.debug) cerr << "Reading hex file..." << endl;
+/*
+ * Decode the record in [line, line + linelen): the data bytes go to data[],
+ * followed by the checksum byte, and *checksum is the sum of all the bytes
+ * (0 for a good record). Returns NULL, or what could not be read.
+ */
+static const char *decode_record(const char *line, size_t linelen,
+                                 uint8_t *byte_count, uint16_t *address,
+                                 uint8_t *record_type, uint8_t *data,
+                                 uint8_t *checksum)
+{
+    uint8_t hi, lo;
+    uint32_t i;
 
-    linenum = 0;
-    while (1) {
-        ptr = fgets(line, 256, fp);
-
-        if (ptr != NULL) {
-            linenum++;
-            linelen = strlen(line);
-            if (flags.debug) {
-                fprintf(stderr, "  line %d (%zd bytes): '", linenum, linelen);
-                for (i = 0; i < linelen; i++) {
-                    if (line[i] == '\n')
-                        cerr << "\\n";
-                    else if (line[i] == '\r')
-                        cerr << "\\r";
-                    else
-                        fprintf(stderr, "%c", line[i]);
-                }
-                cerr << "'\n";
-            }
+    if (linelen < 1 || line[0] != ':')
+        return "invalid start code";
 
-            if (line[0] != ':') {
-                cerr << "Error: invalid start code."  << endl;
-                return 0;
-            }
+    if (linelen < 3 || !hex_byte(&line[1], byte_count))
+        return "cannot read byte count";
 
-            nread = sscanf(&line[1], "%2hhx", &byte_count);
-            if (nread != 1) {
-                cerr << "Error: cannot read byte count." << endl;
-                return 0;
-            }
-            if (flags.debug) fprintf(stderr, "  byte_count  = 0x%02X\n", byte_count);
+    if (linelen < 7 || !hex_byte(&line[3], &hi) || !hex_byte(&line[5], &lo))
+        return "cannot read address";
+    *address = (hi << 8) | lo;
 
-            nread = sscanf(&line[3], "%4hx", &address);
-            if (nread != 1) {
-                cerr << "Error: cannot read address." << endl;
-                return 0;
-            }
+    if (linelen < 9 || !hex_byte(&line[7], record_type))
+        return "cannot read record type";
 
-            nread = sscanf(&line[7], "%2hhx", &record_type);
-            if (nread != 1) {
-                cerr << "Error: cannot read record type." << endl;
-                return 0;
-            }
+    if (*record_type != 0 && *record_type != 1 && *record_type != 0x04)
+        return "unknown record type";
 
-            if (flags.debug && record_type != 0x04) fprintf(stderr, "  address     = 0x%04X\n", address);
+    *checksum = *byte_count + hi + lo + *record_type;
 
-            if (flags.debug)
-                fprintf(stderr, "  record_type = 0x%02X (%s)\n",
-                        record_type, record_type == 0 ? "data" :
-                            (record_type == 1 ? "EOF" :
-                                (record_type == 0x04 ? "Extended Linear Address" : "Unknown")));
-
-            if (record_type != 0 && record_type != 1 && record_type != 0x04) {
-            cerr << "Error: unknown record type." << endl;
-                return 0;
-            }
+    /* data bytes, then the checksum byte */
+    for (i = 0; i <= *byte_count; i++) {
+        if (linelen < 11 + 2 * i || !hex_byte(&line[9 + 2 * i], &data[i]))
+            return i == *byte_count ? "cannot read checksum" : "cannot read data";
+        *checksum += data[i];
+    }
 
-            checksum_calculated  = byte_count;
-            checksum_calculated += (address >> 8) & 0xFF;
-            checksum_calculated += address & 0xFF;
-            checksum_calculated += record_type;
-
-            if(record_type == 0x04){
-                nread = sscanf(&line[9], "%4hx", &base_address);
-                if (flags.debug) fprintf(stderr, "  NEW BASE ADDRESS     = 0x%04X\n", base_address);
-                checksum_calculated += (base_address >> 8) & 0xFF;
-                checksum_calculated += base_address & 0xFF;
-                i = 1;
-            } else {
-                for (i = 0; i < byte_count/2; i++) {
-                    nread = sscanf(&line[9+4*i], "%4hx", &data);
-                    if (nread != 1) {
-                        cerr << "Error: cannot read data." << endl;
-                        return 0;
-                    }
-                    tmp = data;
-                    data = (data >> 8) | (tmp << 8);
-                    if (flags.debug) fprintf(stderr, "  data        = 0x%04X", data);
-                    checksum_calculated += (data >> 8) & 0xFF;
-                    checksum_calculated += data & 0xFF;
-
-                    extended_address = ( ((uint32_t)base_address << 16) | address);
-                    if (flags.debug)
-                        fprintf(stderr, " @0x%08X\n", extended_address/2+i);
-
-                    mem->location[extended_address/2 + i - offset/2] = data;
-                    mem->filled[extended_address/2 + i - offset/2] = 1;
-                    filled_locations++;
-                }
-              if (byte_count % 2) {
-                nread = sscanf(&line[9+4*i], "%2hx", &data);
-                    if (nread != 1) {
-                        cerr << "Error: cannot read data." << endl;
-                        return 0;
-                    }
-                    if (flags.debug) fprintf(stderr, "  data        = 0x%04X", data);
-                    checksum_calculated += data & 0xFF;
-
-                    extended_address = ( ((uint32_t)base_address << 16) | address);
-                    if (flags.debug)
-                        fprintf(stderr, " @0x%08X\n", extended_address/2+i);
-
-                    mem->location[extended_address/2 + i - offset/2] = data;
-                    mem->filled[extended_address/2 + i - offset/2] = 1;
-                    filled_locations++;
-              }
-            }
+    return NULL;
+}
 
-            checksum_calculated = (checksum_calculated ^ 0xFF) + 1;
+/* state of the first record, for the --stream erase */
+#define FIRST_PENDING   0
+#define FIRST_GOOD      1
+#define FIRST_BAD       2
 
-            if (byte_count % 2)
-                nread = sscanf(&line[9+4*i+2], "%2hhx", &checksum_read);
-            else
-                nread = sscanf(&line[9+4*i], "%2hhx", &checksum_read);
-            if (nread != 1) {
-                cerr << "Error: cannot read checksum." << endl;
-                return 0;
-            }
-            if (flags.debug) fprintf(stderr, "  checksum    = 0x%02X\n", checksum_read);
+/*
+ * --stream row queue. The parser thread decodes the file into an image of
+ * its own and pushes each block of FEED_BLOCK locations (a multiple of the
+ * rows of every family) once the records have moved past it; after the
+ * erase, the thread programming the chip pops the blocks into the memory
+ * image of the device as its row loop gets to them (read_inhx_row()).
+ * This needs the records in increasing address order, as the linkers
+ * write them: a file that is not is parsed whole before the first push.
+ */
+#define FEED_RING       128     /* blocks, a power of two */
+#define FEED_BLOCK      1024    /* locations, the largest row (PIC32MZ) */
+
+struct feed_block {
+    uint32_t addr;                      /* first location */
+    uint16_t location[FEED_BLOCK];
+    uint32_t filled[FEED_BLOCK / 32];
+};
+
+struct hex_feed {
+    feed_block ring[FEED_RING];
+    std::atomic<uint32_t> head;         /* written by the parser only */
+    std::atomic<uint32_t> tail;         /* written by the programmer only */
+    std::atomic<int> first;             /* FIRST_*, see check_first_record() */
+    std::atomic<bool> done;             /* the parser is over */
+    std::atomic<bool> abandoned;        /* nobody pops any more */
+    pthread_t thread;
+
+    /* parser side */
+    char *infile;
+    uint32_t offset;
+    memory image;
+    bool sorted;                        /* records in increasing order */
+    uint32_t next;                      /* first location not pushed yet */
+    unsigned int filled_locations;      /* of the whole file, 0 if bad */
+
+    /* programmer side: the image is complete below received */
+    uint32_t received;
+};
+
+/* Push the blocks holding data in [feed->next, limit) */
+static bool feed_push(hex_feed *feed, uint32_t limit)
+{
+    feed_block *b;
+    mem_page *page;
+    uint32_t addr, head;
+
+    while ((addr = feed->image.pages.next_filled(feed->next, limit)) < limit) {
+        addr -= addr % FEED_BLOCK;
+        head = feed->head.load(std::memory_order_relaxed);
+        while (head - feed->tail.load(std::memory_order_acquire) == FEED_RING) {
+            if (feed->abandoned.load())
+                return false;
+            usleep(50);
+        }
 
-            if (checksum_calculated != checksum_read) {
-                cerr << "Error: checksum does not match. ";
+        b = &feed->ring[head & (FEED_RING - 1)];
+        page = feed->image.pages.find(addr);
+        b->addr = addr;
+        memcpy(b->location, &page->location[addr & MEM_PAGE_MASK], sizeof(b->location));
+        memcpy(b->filled, &page->filled[(addr & MEM_PAGE_MASK) / 32], sizeof(b->filled));
+        feed->head.store(head + 1, std::memory_order_release);
+        feed->next = addr + FEED_BLOCK;
+    }
+    if (limit > feed->next)
+        feed->next = limit;
+    return true;
+}
 
-                if(flags.debug)
-                    fprintf(stderr, "Calculated = 0x%02X, Read = 0x%02X\n", checksum_calculated, checksum_read);
-                return 0;
-            }
+/* A data record at location index: the blocks below its own are complete */
+static bool feed_record(hex_feed *feed, uint32_t index, uint32_t extended_address)
+{
+    if (!feed->sorted || index >= feed->image.program_memory_size)
+        return true;
+    if (index < feed->next) {
+        fprintf(stderr, "Error: record at 0x%08X below data already sent to "
+                "the chip, write without --stream.\n", extended_address);
+        return false;
+    }
+    return feed_push(feed, index - index % FEED_BLOCK);
+}
 
-            if (flags.debug)
-                cerr << "\n";
+/*
+ * Whether the data records of [p, end) come in increasing address order,
+ * give or take the block being filled. Only the address fields are
+ * decoded: the parser reports the errors.
+ */
+static bool hex_sorted(const char *p, const char *end, memory *mem, uint32_t offset)
+{
+    const char *eol;
+    uint8_t hi, lo, type, count, b0, b1;
+    uint16_t base_address = 0;
+    uint32_t index, next = 0;
+
+    for (; p < end; p = eol + 1) {
+        eol = (const char *) memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        if (eol - p < 11 || p[0] != ':' || !hex_byte(&p[1], &count) ||
+            !hex_byte(&p[3], &hi) || !hex_byte(&p[5], &lo) || !hex_byte(&p[7], &type))
+            return false;
+
+        if (type == 0x01)
+            break;
+        if (type == 0x04) {
+            if (eol - p < 13 || !hex_byte(&p[9], &b0) || !hex_byte(&p[11], &b1))
+                return false;
+            base_address = (b0 << 8) | b1;
+            continue;
+        }
+
+        index = (((uint32_t)base_address << 16) | (hi << 8) | lo) / 2 - offset / 2;
+        if (index >= mem->program_memory_size)
+            continue;
+        if (index < next)
+            return false;
+        next = index - index % FEED_BLOCK;
+    }
+    return true;
+}
 
-            if (record_type == 0x01)
-                break;
-        } else {
+/*
+ * Parse the Intel HEX records in [p, end) into the memory structure.
+ * Each record is decoded in place with the hex_value table and its
+ * checksum accumulated on the way; the data goes straight to the pages of
+ * the image, and the complete blocks to feed when there is one.
+ * Returns the number of filled locations, 0 on error.
+ */
+static unsigned int parse_inhx(const char *p, const char *end, memory *mem,
+                               uint32_t offset, hex_feed *feed)
+{
+    const char *line, *eol;
+    size_t linelen;
+    int linenum = 0;
+    unsigned int filled_locations = 0;
+
+    uint32_t i, index, extended_address, page_number = 0;
+    uint8_t  byte_count, record_type, checksum;
+    uint8_t  data[256];
+    uint16_t base_address = 0x0000;
+    uint16_t address;
+    mem_page *page = NULL;
+    const char *error;
+
+    for (line = p; ; line = eol + 1) {
+        if (line >= end) {
             cerr << "Error: unexpected EOF." << endl;
             return 0;
         }
+        eol = (const char *) memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        linelen = eol - line;
+        linenum++;
+
+        error = decode_record(line, linelen, &byte_count, &address,
+                              &record_type, data, &checksum);
+        if (error != NULL) {
+            cerr << "Error: " << error << "." << endl;
+            return 0;
+        }
+
+        extended_address = ((uint32_t)base_address << 16) | address;
+
+        if (flags.debug)
+            debug_record(line, eol < end ? linelen + 1 : linelen, linenum,
+                         byte_count, address, record_type, data, extended_address);
+
+        if (checksum != 0) {
+            cerr << "Error: checksum does not match. ";
+
+            if (flags.debug)
+                fprintf(stderr, "Calculated = 0x%02X, Read = 0x%02X\n",
+                        (uint8_t)(data[byte_count] - checksum), data[byte_count]);
+            return 0;
+        }
+
+        if (record_type == 0x01)
+            break;
+
+        if (record_type == 0x04) {
+            base_address = (data[0] << 8) | data[1];
+            continue;
+        }
+
+        if (feed != NULL &&
+            !feed_record(feed, extended_address/2 - offset/2, extended_address))
+            return 0;
+
+        for (i = 0; i < byte_count; i += 2) {
+            index = extended_address/2 + i/2 - offset/2;
+            if (!in_range(mem, index))
+                continue;
+            if (page == NULL || index >> MEM_PAGE_SHIFT != page_number) {
+                page = mem->pages.get(index);
+                page_number = index >> MEM_PAGE_SHIFT;
+            }
+            page->location[index & MEM_PAGE_MASK] =
+                    i + 1 < byte_count ? data[i] | (data[i+1] << 8) : data[i];
+            page->set_filled(index & MEM_PAGE_MASK, true);
+            filled_locations++;
+        }
     }
 
-    fclose(fp);
+    /* the filled flags were set behind the back of mem.filled[] */
+    mem->pages.changed();
 
-    if(flags.debug)
-        cerr << "DONE! " << filled_locations << " memory locations read." << endl;
+    /* everything left, up to the end of the memory */
+    if (feed != NULL &&
+        !feed_push(feed, (mem->program_memory_size + FEED_BLOCK - 1) /
+                         FEED_BLOCK * FEED_BLOCK))
+        return 0;
 
     return filled_locations;
 }
 
-/* Write the filled cells in given memory struct
- * to an Intel HEX8M or HEX32 file */
-void write_inhx(memory *mem, char *outfile, uint32_t offset)
+/*
+ * Check the first record of [buf, buf + size) once it has arrived whole
+ * (or the input is over) and publish the result in *first. An EOF record
+ * counts as bad: there is nothing to write.
+ */
+static void check_first_record(std::atomic<int> *first, const char *buf,
+                               size_t size, bool complete)
 {
-    FILE *fp;
-    uint32_t base, j, k, start, stop;
-    uint8_t  byte_count;
-    uint32_t address;
-    uint16_t base_address = 0x0000;
-    uint8_t  record_type;
-    uint16_t data, tmp;
-    uint8_t  checksum;
+    const char *eol;
+    uint8_t byte_count, record_type, checksum, data[256];
+    uint16_t address;
 
-    fp = fopen(outfile?outfile:"ofile.hex", "w");
-    if (fp == NULL) {
-        cerr << "Error: cannot open destination file " << outfile << endl;
+    if (first == NULL || first->load() != FIRST_PENDING)
         return;
+    eol = (const char *) memchr(buf, '\n', size);
+    if (eol == NULL && !complete)
+        return;
+
+    first->store(decode_record(buf, eol ? eol - buf : size, &byte_count,
+                               &address, &record_type, data, &checksum) == NULL &&
+                 checksum == 0 && record_type != 0x01 ? FIRST_GOOD : FIRST_BAD);
+}
+
+/*
+ * Read a file in Intel HEX8M or HEX32 format and fill the memory structure
+ * ("-" is the standard input). With a feed, the result of the check of
+ * the first record is published as soon as it is known, and the blocks
+ * are pushed as they are parsed.
+ * Returns the number of filled locations
+ *
+ */
+static unsigned int load_inhx(char *infile, memory *mem, uint32_t offset,
+                              hex_feed *feed)
+{
+    std::atomic<int> *first = feed ? &feed->first : NULL;
+    int fd;
+    struct stat st;
+    char *buf;
+    size_t size, len;
+    ssize_t nread;
+    bool mapped;
+    unsigned int filled_locations;
+
+    fd = strcmp(infile, "-") ? open(infile, O_RDONLY) : dup(STDIN_FILENO);
+    if (fd < 0) {
+        cerr << "Error: cannot open source file " << infile << endl;
+        return 0;
     }
 
-    if(flags.debug)
-        cerr << "Writing hex file...";
+    if(flags.debug) cerr << "Reading hex file..." << endl;
 
-    /* Write the program memory bytes */
+    /* map regular files, read anything else (a pipe...) into a buffer */
+    size = 0;
+    buf = (char *) MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size;
+        buf = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    mapped = buf != MAP_FAILED;
+    if (mapped) {
+        madvise(buf, size, MADV_SEQUENTIAL);
+    } else {
+        size = 0;
+        len = 65536;
+        buf = (char *) malloc(len);
+        while (buf != NULL && (nread = read(fd, buf + size, len - size)) > 0) {
+            size += nread;
+            check_first_record(first, buf, size, false);
+            if (size == len)
+                buf = (char *) realloc(buf, len *= 2);
+        }
+        if (buf == NULL) {
+            cerr << "Error: cannot read source file " << infile << endl;
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd);
+    check_first_record(first, buf, size, true);
 
-    for (base = 0; base < mem -> program_memory_size; ){
+    if (feed != NULL)
+        feed->sorted = hex_sorted(buf, buf + size, mem, offset);
+    filled_locations = parse_inhx(buf, buf + size, mem, offset, feed);
 
-        for (j = 0 ; j < (mem -> program_memory_size - base); j++)
-            if (mem -> filled[base+j]) break;
+    if (mapped)
+        munmap(buf, size);
+    else
+        free(buf);
 
-        start = j;
+    if(flags.debug && filled_locations)
+        cerr << "DONE! " << filled_locations << " memory locations read." << endl;
 
-        for ( ; j < (mem -> program_memory_size - base); j++)
-            if (!mem -> filled[base+j] || (j-start == 8) ) break;
+    return filled_locations;
+}
+
+unsigned int read_inhx(char *infile, memory *mem, uint32_t offset)
+{
+    return load_inhx(infile, mem, offset, NULL);
+}
+
+static void *feed_worker(void *arg)
+{
+    hex_feed *feed = (hex_feed *) arg;
+    int pending = FIRST_PENDING;
 
-        stop = j;
+    realtime_helper();
 
-        byte_count  = (stop - start)*2;
+    feed->filled_locations = load_inhx(feed->infile, &feed->image,
+                                       feed->offset, feed);
 
-        if (byte_count > 0) {
-            address = (base + start)*2+offset;
-            record_type = 0x00;
+    /* the file could not even be opened or read */
+    feed->first.compare_exchange_strong(pending, FIRST_BAD);
+    feed->done.store(true, std::memory_order_release);
+    return NULL;
+}
 
-            if(mem -> program_memory_size >= 0x10000 && (address >> 16) != base_address){  //extended linear address
-                base_address = (address >> 16);
-                fprintf(fp, ":02000004%04x", base_address);
-                checksum = 0x06 + ((base_address>>8) & 0xFF) + (base_address & 0xFF);
-                checksum = (checksum ^ 0xFF) + 1;
-                fprintf(fp, "%02x\n", checksum);
+/*
+ * Load a hex file into the memory image of pic and bulk erase the chip,
+ * which the caller then programs. The chip is left alone when the file
+ * has nothing to write.
+ *
+ * With --stream the file is parsed by another thread, which hands the
+ * rows over as they are decoded: the chip is erased as soon as the first
+ * record has arrived and is valid (so a missing or foreign file never
+ * erases it), and the caller programs the rows as they come with
+ * read_inhx_row(), then waits for the rest of the file with
+ * read_inhx_wait(). The number of filled locations is not known before
+ * that: the size of code memory stands for it meanwhile.
+ */
+unsigned int read_inhx_erase(char *infile, Pic *pic, uint32_t offset)
+{
+    hex_feed *feed;
+    unsigned int filled_locations;
+
+    if (flags.stream) {
+        feed = new hex_feed;
+        feed->head.store(0);
+        feed->tail.store(0);
+        feed->first.store(FIRST_PENDING);
+        feed->done.store(false);
+        feed->abandoned.store(false);
+        feed->infile = infile;
+        feed->offset = offset;
+        feed->image.program_memory_size = pic->mem.program_memory_size;
+        feed->image.code_memory_size = pic->mem.code_memory_size;
+        feed->sorted = false;
+        feed->next = 0;
+        feed->filled_locations = 0;
+        feed->received = 0;
+
+        if (pthread_create(&feed->thread, NULL, feed_worker, feed) == 0) {
+            while (feed->first.load() == FIRST_PENDING)
+                usleep(100);
+            if (feed->first.load() == FIRST_GOOD) {
+                pic->bulk_erase();
+                pic->mem.feed = feed;
+                return pic->mem.code_memory_size ? pic->mem.code_memory_size : 1;
             }
+            pthread_join(feed->thread, NULL);
+            delete feed;
+            return 0;
+        }
+        delete feed;
+    }
 
-            fprintf(fp, ":%02x%04x%02x", byte_count, (address & 0x0000FFFF), record_type);
+    filled_locations = read_inhx(infile, &pic->mem, offset);
+    if (filled_locations)
+        pic->bulk_erase();
+    return filled_locations;
+}
 
-            checksum  = byte_count;
-            checksum += ((address & 0x0000FFFF) >> 8) & 0xFF;
-            checksum += (address & 0x0000FFFF) & 0xFF;
-            checksum += record_type;
+/* Copy a block into the memory image */
+static void feed_store(memory *mem, const feed_block *b)
+{
+    mem_page *page = mem->pages.get(b->addr);
+    uint32_t base = b->addr & MEM_PAGE_MASK, bits, w, i;
 
-            for (k = start; k < stop; k++) {
-                data = mem -> location[base+k];
-                tmp = data;
-                data = (data >> 8) | (tmp << 8);
-                fprintf(fp, "%04x", data);
-                checksum += (data >> 8) & 0xFF;
-                checksum += data & 0xFF;
-            }
+    for (w = 0; w < FEED_BLOCK / 32; w++) {
+        for (bits = b->filled[w]; bits; bits &= bits - 1) {
+            i = w * 32 + __builtin_ctz(bits);
+            page->location[base + i] = b->location[i];
+        }
+        page->filled[base / 32 + w] |= b->filled[w];
+    }
+    mem->pages.changed();
+}
+
+/*
+ * Take the blocks pushed so far, waiting for one if wait is set. False
+ * once the parser is over and everything has been taken.
+ */
+static bool feed_pop(memory *mem, hex_feed *feed, bool wait)
+{
+    uint32_t tail = feed->tail.load(std::memory_order_relaxed), head;
+    bool done;
+
+    for (;;) {
+        done = feed->done.load(std::memory_order_acquire);
+        head = feed->head.load(std::memory_order_acquire);
+        if (tail != head)
+            break;
+        if (done) {
+            feed->received = MEM_NO_ROW;
+            return false;
+        }
+        if (!wait)
+            return true;
+        usleep(50);
+    }
+
+    for (; tail != head; tail++) {
+        feed_store(mem, &feed->ring[tail & (FEED_RING - 1)]);
+        feed->received = feed->ring[tail & (FEED_RING - 1)].addr + FEED_BLOCK;
+    }
+    feed->tail.store(tail, std::memory_order_release);
+    return true;
+}
+
+/*
+ * mem->next_row(addr, row), for the row loops of write(): with --stream,
+ * waits until that row has been received whole, or the file is over.
+ * MEM_NO_ROW as soon as the parser finds an error.
+ */
+uint32_t read_inhx_row(memory *mem, uint32_t addr, uint32_t row)
+{
+    hex_feed *feed = mem->feed;
+    uint32_t start = addr - addr % row, found;
+
+    if (feed == NULL)
+        return mem->next_row(addr, row);
+
+    feed_pop(mem, feed, false);
+    for (;;) {
+        if (feed->received == MEM_NO_ROW)
+            return feed->filled_locations ? mem->next_row(addr, row) : MEM_NO_ROW;
+
+        found = mem->pages.next_filled(start, feed->received);
+        if (found < feed->received) {
+            found -= found % row;
+            if (found + row <= feed->received)
+                return std::max(found, addr);
+        }
+        feed_pop(mem, feed, true);
+    }
+}
+
+/*
+ * With --stream, wait for the end of the file and take the rest of it
+ * (the configuration words...) into the memory image. Returns the filled
+ * locations of the whole file, 0 when it turned out to be bad: the chip
+ * is then erased and partly written. Without, returns filled_locations.
+ */
+unsigned int read_inhx_wait(memory *mem, unsigned int filled_locations)
+{
+    hex_feed *feed = mem->feed;
+
+    if (feed == NULL)
+        return filled_locations;
+
+    while (feed_pop(mem, feed, true))
+        ;
+    pthread_join(feed->thread, NULL);
+    filled_locations = feed->filled_locations;
+    mem->feed = NULL;
+    delete feed;
+
+    if (!filled_locations)
+        cerr << "Error: bad hex file, the chip is erased and only partly written."
+             << endl;
+    return filled_locations;
+}
+
+/* The device goes away before read_inhx_wait() (fatal() in a channel) */
+void read_inhx_drop(hex_feed *feed)
+{
+    feed->abandoned.store(true);
+    pthread_join(feed->thread, NULL);
+    delete feed;
+}
+
+#define HEX_OUT_SIZE    (1 << 20)   /* output buffered before each write() */
+#define HEX_RECORD_MAX  (1 + 2 * (4 + 255 + 1) + 1)
+
+struct hex_out {
+    int fd;
+    char *buf;
+    size_t len;
+    bool failed;
+};
+
+static void hex_flush(hex_out *out)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < out->len && !out->failed) {
+        n = write(out->fd, out->buf + done, out->len - done);
+        if (n > 0)
+            done += n;
+        else if (n < 0 && errno != EINTR)
+            out->failed = true;
+    }
+    out->len = 0;
+}
+
+/* Format a record (byte_count bytes of data) into the output buffer */
+static void hex_record(hex_out *out, uint8_t byte_count, uint16_t address,
+                       uint8_t record_type, const uint8_t *data)
+{
+    static const char digits[] = "0123456789abcdef";
+    uint8_t checksum = 0;
+    char *p;
+    int i;
+
+#define HEX_PUT(b) do {                 \
+        *p++ = digits[(b) >> 4];        \
+        *p++ = digits[(b) & 0x0F];      \
+        checksum += (b);                \
+    } while (0)
+
+    if (out->len + HEX_RECORD_MAX > HEX_OUT_SIZE)
+        hex_flush(out);
+    p = out->buf + out->len;
+
+    *p++ = ':';
+    HEX_PUT(byte_count);
+    HEX_PUT(address >> 8);
+    HEX_PUT(address & 0xFF);
+    HEX_PUT(record_type);
+    for (i = 0; i < byte_count; i++)
+        HEX_PUT(data[i]);
+    checksum = (checksum ^ 0xFF) + 1;
+    HEX_PUT(checksum);
+    *p++ = '\n';
+
+#undef HEX_PUT
+
+    out->len = p - out->buf;
+}
+
+/*
+ * Streaming hex writer: the locations are given in increasing order and
+ * go out in records of flags.hex_record_size bytes at most, split where
+ * a run of locations ends and at every 64k boundary.
+ */
+struct hex_writer {
+    hex_out out;
+    char *name;
+    uint32_t offset;
+    bool extended;              /* extended linear address records */
+    uint16_t base_address;
+    uint32_t record_words;
+    uint32_t start, n;          /* the record being filled */
+    uint8_t bytes[256];
+};
+
+/* Open outfile (NULL: "ofile.hex") for locations at offset */
+hex_writer *hex_open(char *outfile, uint32_t offset, bool extended)
+{
+    const char *name = outfile ? outfile : "ofile.hex";
+    hex_writer *w = new hex_writer;
+
+    w->out.fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w->out.fd < 0) {
+        cerr << "Error: cannot open destination file " << name << endl;
+        delete w;
+        return NULL;
+    }
+    w->out.buf = (char *) malloc(HEX_OUT_SIZE);
+    if (w->out.buf == NULL) {
+        cerr << "Error: cannot write destination file " << name << endl;
+        close(w->out.fd);
+        delete w;
+        return NULL;
+    }
+    w->out.len = 0;
+    w->out.failed = false;
+
+    w->name = strdup(name);
+    w->offset = offset;
+    w->extended = extended;
+    w->base_address = 0x0000;
+    w->record_words = flags.hex_record_size / 2;
+    w->n = 0;
+    return w;
+}
+
+static void hex_emit(hex_writer *w)
+{
+    uint32_t address = w->start*2 + w->offset;
+    uint8_t ela[2];
+
+    if (w->extended && (address >> 16) != w->base_address) {  //extended linear address
+        w->base_address = address >> 16;
+        ela[0] = w->base_address >> 8;
+        ela[1] = w->base_address & 0xFF;
+        hex_record(&w->out, 2, 0x0000, 0x04, ela);
+    }
+    hex_record(&w->out, 2*w->n, address & 0xFFFF, 0x00, w->bytes);
+    w->n = 0;
+}
+
+/* Add location index, holding data */
+void hex_put(hex_writer *w, uint32_t index, uint16_t data)
+{
+    if (w->n && (index != w->start + w->n || w->n == w->record_words ||
+                 ((index*2 + w->offset) & 0xFFFF) == 0))
+        hex_emit(w);
+    if (w->n == 0)
+        w->start = index;
+    w->bytes[2*w->n] = data & 0xFF;
+    w->bytes[2*w->n+1] = data >> 8;
+    w->n++;
+}
+
+/* Write the last record and the EOF record, and close the file */
+void hex_close(hex_writer *w)
+{
+    if (w->n)
+        hex_emit(w);
+
+    /* EOF record, in upper case as it has always been written */
+    if (w->out.len + HEX_RECORD_MAX > HEX_OUT_SIZE)
+        hex_flush(&w->out);
+    memcpy(w->out.buf + w->out.len, ":00000001FF\n", 12);
+    w->out.len += 12;
+    hex_flush(&w->out);
+
+    if (w->out.failed)
+        cerr << "Error: cannot write destination file " << w->name << endl;
+    free(w->out.buf);
+    close(w->out.fd);
+    free(w->name);
+    delete w;
+}
+
+/*
+ * Write the filled cells in given memory struct to an Intel HEX8M or HEX32
+ * file. Only the runs of filled locations are visited.
+ */
+void write_inhx(memory *mem, char *outfile, uint32_t offset)
+{
+    hex_writer *w;
+    mem_page *page;
+    uint32_t start, stop, k, size;
+
+    size = mem->program_memory_size;
+    w = hex_open(outfile, offset, size >= 0x10000);
+    if (w == NULL)
+        return;
+
+    if(flags.debug)
+        cerr << "Writing hex file...";
 
-            checksum = (checksum ^ 0xFF) + 1;
-            fprintf(fp, "%02x\n", checksum);
+    for (start = mem->pages.next_filled(0, size); start < size;
+         start = mem->pages.next_filled(stop, size)) {
+        stop = mem->pages.next_empty(start, size);
 
+        page = mem->pages.find(start);
+        for (k = start; k < stop; k++) {
+            if ((k & MEM_PAGE_MASK) == 0)
+                page = mem->pages.find(k);
+            hex_put(w, k, page->location[k & MEM_PAGE_MASK]);
         }
-        base += stop;
     }
 
-    fprintf(fp, ":00000001FF\n");
-    fclose(fp);
+    hex_close(w);
     if(flags.debug)
         cerr << "DONE!" << endl;
 }
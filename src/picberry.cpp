@@ -62,9 +62,10 @@ volatile uint32_t   *gpio;
 
 struct flags_struct flags;
 
-int pic_clk  = DEFAULT_PIC_CLK;
-int pic_data = DEFAULT_PIC_DATA;
-int pic_mclr = DEFAULT_PIC_MCLR;
+/* per thread: every --channel worker drives its own triplet */
+thread_local int pic_clk  = DEFAULT_PIC_CLK;
+thread_local int pic_data = DEFAULT_PIC_DATA;
+thread_local int pic_mclr = DEFAULT_PIC_MCLR;
 char pic_clk_port=0, pic_data_port=0, pic_mclr_port=0;
 
 #define FXN_NULL        0b00000000
@@ -76,20 +77,6 @@ char pic_clk_port=0, pic_data_port=0, pic_mclr_port=0;
 #define FXN_BLANKCHEK   0b00100000
 #define FXN_REGDUMP     0b01000000
 
-/* Hardware delay function by Gordon's Projects - WiringPi */
-void delay_us (unsigned int howLong)
-{
-	struct timeval tNow, tLong, tEnd;
-
-	gettimeofday (&tNow, 0);
-	tLong.tv_sec  = howLong / 1000000;
-	tLong.tv_usec = howLong % 1000000;
-	timeradd (&tNow, &tLong, &tEnd);
-
-	while (timercmp (&tNow, &tEnd, <))
-		gettimeofday (&tNow, 0);
-}
-
 int main(int argc, char *argv[])
 {
 	int opt, function = 0;
@@ -98,6 +85,8 @@ int main(int argc, char *argv[])
     bool log = false;
     char *logfile = 0;
     char *pins = 0;
+    char *gang = 0;
+    char *vcdfile = 0;
     char *family = 0;
     uint32_t count = 0, start = 0;
     int option_index = 0;
@@ -122,7 +111,18 @@ int main(int argc, char *argv[])
             {"boot-only",   no_argument,       &flags.boot_only,    1},
             {"program-only",no_argument,       &flags.program_only, 1},
             {"fulldump",    no_argument,       &flags.fulldump,     1},
+            {"diff",        no_argument,       &flags.diff,         1},
+            {"hex-record-size", required_argument, 0,       'H'},
+            {"stream",      no_argument,       &flags.stream,       1},
             {"unattended",  no_argument,       &flags.unattended,   1},
+            {"timing",      required_argument, 0,           'T'},
+            {"autotune",    no_argument,       &flags.autotune,     1},
+            {"realtime",    optional_argument, 0,           'F'},
+            {"gang",        required_argument, 0,           'G'},
+            {"channel",     required_argument, 0,           'C'},
+            {"trace-vcd",   required_argument, 0,           'V'},
+            {"pe",          required_argument, 0,           'P'},
+            {"no-pe",       no_argument,       &flags.nope,         1},
             {0, 0, 0, 0}
     };
 
@@ -176,6 +176,52 @@ int main(int argc, char *argv[])
             case 'R':
                 function = FXN_RESET;
                 break;
+            case 'T':
+                if (!strcmp(optarg, "spec"))
+                    flags.timing = TIMING_SPEC;
+                else if (!strcmp(optarg, "fast"))
+                    flags.timing = TIMING_FAST;
+                else if (!strcmp(optarg, "safe"))
+                    flags.timing = TIMING_SAFE;
+                else {
+                    cout << "Unknown timing profile " << optarg
+                         << " (spec, fast or safe)" << endl;
+                    exit(1);
+                }
+                break;
+            case 'F':
+                flags.realtime = 1;
+                if (optarg)
+                    flags.realtime_cpu = atoi(optarg);
+                break;
+            case 'G':
+                gang = optarg;
+                break;
+            case 'C':
+                if(!channel_parse(optarg)){
+                    cout << "Channel selection string must be "
+                            "PGC,PGD,MCLR:family:file.hex" << endl;
+                    exit(3);
+                }
+                break;
+            case 'V':
+#ifndef VCD_TRACE
+                cout << "--trace-vcd is not compiled in, "
+                        "build with make <target> VCD_TRACE=1." << endl;
+                exit(3);
+#endif
+                vcdfile = optarg;
+                break;
+            case 'P':
+                flags.pe_file = optarg;
+                break;
+            case 'H':
+                flags.hex_record_size = atoi(optarg) & ~1;
+                if (flags.hex_record_size < 2 || flags.hex_record_size > 255) {
+                    cout << "Hex record size must be 2 to 255 bytes" << endl;
+                    exit(1);
+                }
+                break;
             default:
                 cout << endl;
                 usage();
@@ -221,6 +267,39 @@ int main(int argc, char *argv[])
         }
     }
     
+    /* Gang mode: shared PGC and MCLR, one PGD per target */
+    if(gang != 0){
+        if(!gang_parse(gang)){
+            cout << "Gang selection string must be PGC,MCLR,PGD1,PGD2,... "
+                    "(up to " << GANG_MAX << " targets, GPIO 0 to 31)" << endl;
+            exit(3);
+        }
+        if(function == FXN_SERVER || function == FXN_RESET ||
+           (family != 0 && strcmp(family, "dspic33e") != 0 &&
+            strcmp(family, "pic24fj") != 0)){
+            cout << "Gang programming is only available for chip operations "
+                    "on the dspic33e and pic24fj families." << endl;
+            exit(3);
+        }
+        if(family == 0){
+            cout << "Please specify the family (-f dspic33e or -f pic24fj) "
+                    "in gang mode." << endl;
+            exit(3);
+        }
+    }
+
+    /* Channel mode: every channel writes its own file, nothing else */
+    if(channel_count && (function != FXN_NULL || gang != 0 || pins != 0 ||
+                         flags.autotune)){
+        cout << "--channel cannot be combined with other operations, "
+                "--gpio, --gang or --autotune." << endl;
+        exit(3);
+    }
+    if(channel_count && vcdfile != 0){
+        cout << "--trace-vcd cannot be used with --channel." << endl;
+        exit(3);
+    }
+
     if(flags.debug){
         cout << "PGC <=> pin " << pic_clk_port << (pic_clk&0xFF)
              << endl;
@@ -228,65 +307,39 @@ int main(int argc, char *argv[])
              << endl;
         cout << "MCLR <=> pin " << pic_mclr_port << (pic_mclr&0xFF)
              << endl;
+        for(int t = 1; t < gang_count; t++)
+            cout << "PGD" << t + 1 << " <=> pin " << (gang_data[t]&0xFF)
+                 << endl;
+    }
+
+    /* Calibrate the delay loop before the first clock edge */
+    delay_init();
+
+    /* Trace from the first pin setup on, timestamps need delay_init() */
+    if(vcdfile != 0 && !vcd_start(vcdfile)){
+        cout << "Cannot allocate the VCD trace buffer." << endl;
+        exit(3);
     }
 
     /* Setup gpio pointer for direct register access */
     if(flags.debug) cout << "Setting up I/O..." << endl;
     setup_io();
 
-    if(function == FXN_RESET)
+    /* From now on ICSP traffic can happen: keep the scheduler out of it */
+    if(flags.realtime)
+        realtime_enter(flags.realtime_cpu);
+
+    if(channel_count)
+        return_code = channels_run();
+    else if(function == FXN_RESET)
         pic_reset();
     else if(function == FXN_SERVER)
         server_mode(server_port);
     else{
 
-        Pic *pic = new dspic33f();
-
-        if(family == 0 || strcmp(family, "dspic33f") == 0);
-            //pic = new dspic33f(); default case, nothing to do
-        else if(strcmp(family,"dspic33e") == 0)
-            pic = new dspic33e(SF_DSPIC33E);
-        else if(strcmp(family,"pic24fj") == 0)
-            pic = new dspic33e(SF_PIC24FJ);
-        else if(strcmp(family,"pic10f322") == 0)
-            pic = new pic10f322();
-        else if(strcmp(family,"pic18fj") == 0)
-            pic = new pic18fj();
-        else if(strcmp(family,"pic24fjxxxga0xx") == 0)
-            pic = new pic24fjxxxga0xx();
-        else if(strcmp(family,"pic24fjxxxga3xx") == 0)
-            pic = new pic24fjxxxga3xx();
-        else if(strcmp(family,"pic24fjxxga1xx") == 0)
-            pic = new pic24fjxxga1xx_gb0xx();
-        else if(strcmp(family,"pic24fjxxgb0xx") == 0)
-            pic = new pic24fjxxga1xx_gb0xx();
-        else if(strcmp(family,"pic24fjxxxga1xx") == 0)
-            pic = new pic24fjxxxga1_gb1();
-        else if(strcmp(family,"pic24fjxxxgb1xx") == 0)
-            pic = new pic24fjxxxga1_gb1();
-	    else if(strcmp(family,"pic24fxxka1xx") == 0)
-            pic = new pic24fxxka1xx();
-	    else if(strcmp(family,"pic32mx1") == 0)
-            pic = new pic32(SF_PIC32MX1);
-        else if(strcmp(family,"pic32mx2") == 0)
-            pic = new pic32(SF_PIC32MX2);
-        else if(strcmp(family,"pic32mx3") == 0)
-            pic = new pic32(SF_PIC32MX3);
-        else if(strcmp(family,"pic32mz") == 0)
-            pic = new pic32(SF_PIC32MZ);
-        else if(strcmp(family,"pic32mk") == 0)
-            pic = new pic32(SF_PIC32MK);
-        else if(strcmp(family,"pic24fjxxxxgx6xx") == 0)
-            pic = new pic24fjxxxxgx6xx();
-        else if(strcmp(family,"pic16f183xx") == 0)
-            pic = new pic16f183xx();
-        else if(strcmp(family,"pic24fxxklxxx") == 0)
-            pic = new pic24fxxklxxx();
-        else if(strcmp(family,"dspic33epxxgs50x") == 0)
-            pic = new dspic33epxxgs50x();
-        else if(strcmp(family,"dspic33ckxxmp10x") == 0)
-            pic = new dspic33ckxxmp10x();
-        else{
+        Pic *pic = pic_new(family);
+
+        if(pic == NULL){
             cerr << "ERROR: PIC family not correctly chosen." << endl;
             cerr << "Available families:" << endl
                 << "- dspic33e" << endl
@@ -323,6 +376,12 @@ int main(int argc, char *argv[])
 		    fprintf(stdout,"Device ID: 0x%08x\n", pic ->device_id);
             fprintf(stderr,"Revision: 0x%08x\n", pic ->device_rev);
 
+            if(flags.autotune)
+                autotune(pic);
+
+            realtime_prefault(&pic->mem);
+            edge_stats_report("device ID");
+
             switch (function){
                 case FXN_NULL:          // no function selected, exit
                     break;
@@ -330,16 +389,19 @@ int main(int argc, char *argv[])
                     cout << "Reading chip...";
                     pic->read(outfile,start,count);
                     cout << "DONE! " << endl;
+                    edge_stats_report("read");
                     break;
                 case FXN_WRITE:
                     cout << "Writing chip...";
                     pic->write(infile);
                     cout << "\nDONE! " << endl;
+                    edge_stats_report("write");
                     break;
                 case FXN_ERASE:
                 	cout << "Bulk Erase...";
                     pic->bulk_erase();
                     cout << "DONE!" << endl;
+                    edge_stats_report("erase");
                     break;
                 case FXN_BLANKCHEK:
                     cout << "Blank check...";
@@ -348,15 +410,20 @@ int main(int argc, char *argv[])
                         cout << "chip is blank." << endl;
                     else
                         cout << "chip is not blank." << endl;
+                    edge_stats_report("blank check");
                     break;
                 case FXN_REGDUMP:
                     pic->dump_configuration_registers();
+                    edge_stats_report("register dump");
                     break;
                 default:
                     cout << endl << endl << "Please select only one option" <<
                     "between -d, -b, -r, -w, -e." << endl;
                     break;
             };
+
+            if(gang_count && gang_report())
+                return_code = 32;
         }
         else{
 		    fprintf(stdout,"Device ID: 0x%x\n", pic ->device_id);
@@ -367,6 +434,7 @@ int main(int argc, char *argv[])
             
 
         pic->exit_program_mode();
+        realtime_exit();
         
         if(!log && !flags.unattended){
             cout << "Press ENTER to exit program mode...";
@@ -374,32 +442,93 @@ int main(int argc, char *argv[])
         }
         
         /* Free memory */
-        free(pic->mem.location);
-        free(pic->mem.filled);
+        pic->mem.clear();
     }
 
 clean:
+    realtime_exit();
+
     /* Release the MCLR pin and clean up I\O structures */
     close_io();
 
+    vcd_flush();
+
     fclose(stderr);
     fclose(stdout);
     return return_code;
 }
 
+/* Create the driver of the given family (NULL: unknown family) */
+Pic *pic_new(const char *family)
+{
+    if(family == 0 || strcmp(family, "dspic33f") == 0)
+        return new dspic33f();
+    else if(strcmp(family,"dspic33e") == 0)
+        return new dspic33e(SF_DSPIC33E);
+    else if(strcmp(family,"pic24fj") == 0)
+        return new dspic33e(SF_PIC24FJ);
+    else if(strcmp(family,"pic10f322") == 0)
+        return new pic10f322();
+    else if(strcmp(family,"pic18fj") == 0)
+        return new pic18fj();
+    else if(strcmp(family,"pic24fjxxxga0xx") == 0)
+        return new pic24fjxxxga0xx();
+    else if(strcmp(family,"pic24fjxxxga3xx") == 0)
+        return new pic24fjxxxga3xx();
+    else if(strcmp(family,"pic24fjxxga1xx") == 0)
+        return new pic24fjxxga1xx_gb0xx();
+    else if(strcmp(family,"pic24fjxxgb0xx") == 0)
+        return new pic24fjxxga1xx_gb0xx();
+    else if(strcmp(family,"pic24fjxxxga1xx") == 0)
+        return new pic24fjxxxga1_gb1();
+    else if(strcmp(family,"pic24fjxxxgb1xx") == 0)
+        return new pic24fjxxxga1_gb1();
+    else if(strcmp(family,"pic24fxxka1xx") == 0)
+        return new pic24fxxka1xx();
+    else if(strcmp(family,"pic32mx1") == 0)
+        return new pic32(SF_PIC32MX1);
+    else if(strcmp(family,"pic32mx2") == 0)
+        return new pic32(SF_PIC32MX2);
+    else if(strcmp(family,"pic32mx3") == 0)
+        return new pic32(SF_PIC32MX3);
+    else if(strcmp(family,"pic32mz") == 0)
+        return new pic32(SF_PIC32MZ);
+    else if(strcmp(family,"pic32mk") == 0)
+        return new pic32(SF_PIC32MK);
+    else if(strcmp(family,"pic24fjxxxxgx6xx") == 0)
+        return new pic24fjxxxxgx6xx();
+    else if(strcmp(family,"pic16f183xx") == 0)
+        return new pic16f183xx();
+    else if(strcmp(family,"pic24fxxklxxx") == 0)
+        return new pic24fxxklxxx();
+    else if(strcmp(family,"dspic33epxxgs50x") == 0)
+        return new dspic33epxxgs50x();
+    else if(strcmp(family,"dspic33ckxxmp10x") == 0)
+        return new dspic33ckxxmp10x();
+
+    return NULL;
+}
+
 /* Set up a memory regions to access GPIO */
 void setup_io(void)
 {
-    /* open /dev/mem */
-    mem_fd = open("/dev/mem", O_RDWR|O_SYNC);
+#ifdef GPIO_SIMULATED
+    /* no registers: a scratch page keeps the gpio pointer valid */
+    mem_fd = -1;
+    gpio_map = mmap(0, BLOCK_SIZE, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#else
+    /* open /dev/mem (or /dev/gpiomem) */
+    mem_fd = open(GPIO_DEVICE, O_RDWR|O_SYNC);
     if (mem_fd == -1) {
-        perror("Cannot open /dev/mem");
+        perror("Cannot open " GPIO_DEVICE);
         exit(11);
     }
 
     /* mmap GPIO */
     gpio_map = mmap(0, BLOCK_SIZE, PROT_READ|PROT_WRITE,
-                    MAP_SHARED, mem_fd, GPIO_BASE);
+                    MAP_SHARED, mem_fd, GPIO_MAP_BASE);
+#endif
     if (gpio_map == MAP_FAILED) {
         perror("mmap() failed");
         exit(12);
@@ -407,30 +536,45 @@ void setup_io(void)
 
     /* Always use volatile pointer! */
     gpio = (volatile uint32_t *) gpio_map;
-        
+
+    /* the channel workers set up their own pins */
+    if(!channel_count)
+        setup_pins();
+}
+
+/* Configure the PGC/PGD/MCLR pins of the calling thread */
+void setup_pins(void)
+{
     GPIO_IN(pic_clk);   // NOTE: MUST use GPIO_IN before GPIO_OUT
     GPIO_OUT(pic_clk);
     
-    GPIO_IN(pic_data);
-    GPIO_OUT(pic_data);
+    pgd_in();
+    pgd_out();
     
     GPIO_IN(pic_mclr);      // MCLR as input, puts the output driver in Hi-Z
 
     GPIO_CLR(pic_clk);
-    GPIO_CLR(pic_data);
+    pgd_clr();
 
     delay_us(1);        // sleep for 1us after GPIO configuration
 }
 
+/* Puts the output drivers of the calling thread's pins in Hi-Z */
+void release_pins(void)
+{
+    GPIO_IN(pic_mclr);
+    pgd_in();
+    GPIO_IN(pic_clk);
+}
+
 /* Release GPIO memory region */
 void close_io(void)
 {
         int ret;
         
         /* Puts the output driver in Hi-Z */
-        GPIO_IN(pic_mclr);
-        GPIO_IN(pic_data);
-        GPIO_IN(pic_clk);
+        if(!channel_count)
+            release_pins();
 
         /* munmap GPIO */
         ret = munmap(gpio_map, BLOCK_SIZE);
@@ -440,9 +584,11 @@ void close_io(void)
         }
 
         /* close /dev/mem */
+        if (mem_fd == -1)
+            return;
         ret = close(mem_fd);
         if (ret == -1) {
-            perror("Cannot close /dev/mem");
+            perror("Cannot close " GPIO_DEVICE);
             exit(22);
         }
 }
@@ -474,18 +620,29 @@ void usage(void)
             "       --server=port,      -S port           server mode, listening on given port\n"
             "       --log=[file],       -l [file]         redirect the output to log file(s)\n"
             "       --gpio=PGC,PGD,MCLR -g PGC,PGD,MCLR   GPIO selection in form [PORT:]NUM (optional)\n"
+            "       --gang=PGC,MCLR,PGD1,PGD2,...         program several targets in lockstep (dspic33e, pic24fj)\n"
+            "       --channel=PGC,PGD,MCLR:family:file.hex write several independent targets in parallel (repeat)\n"
             "       --family=[family],  -f [family]       PIC family [default: dspic33f]\n"
             "       --read=[file.hex],  -r [file.hex]     read chip to file [defaults to ofile.hex]\n"
-            "       --write=file.hex,   -w file.hex       bulk erase and write chip\n"
+            "       --write=file.hex,   -w file.hex       bulk erase and write chip (- for the standard input)\n"
             "       --erase,            -e                bulk erase chip\n"
             "       --blankcheck,       -b                blank check of the chip\n"
             "       --regdump,          -d                read configuration registers\n"
             "       --noverify                            skip memory verification after writing\n"
             "       --debug                               turn ON debug\n"
-            "       --fulldump                            don't detect empty sections, make complete dump (PIC32)\n"
+            "       --fulldump                            don't detect empty sections, make complete dump\n"
             "       --program-only                        read/write only program section (PIC32)\n"
             "       --boot-only                           read/write only boot section (PIC32)\n"
+            "       --diff                                write only the pages that differ, no bulk erase (PIC32)\n"
+            "       --hex-record-size=N                   data bytes per record of the hex file read [default: 16, max 255]\n"
+            "       --stream                              write the file while it is being parsed\n"
             "       --unattended                          disable waiting for user interaction\n"
+            "       --timing=spec|fast|safe               ICSP timing profile [default: spec]\n"
+            "       --autotune                            use the fastest reliable PGC rate of this fixture\n"
+            "       --realtime[=cpu]                      SCHED_FIFO on one CPU with locked memory [default: last CPU]\n"
+            "       --trace-vcd=file.vcd                  record PGC/PGD/MCLR activity as a VCD waveform\n"
+            "       --pe=file.hex|dir                     Programming Executive to download when none is resident (dsPIC33/PIC24)\n"
+            "       --no-pe                               do not use the Programming Executive (dsPIC33/PIC24)\n"
             "\n"
             "\n"
             "   Runtime Options\n"
@@ -727,6 +884,7 @@ void server_mode(int port){
                 default:
                     break;
             }
+            edge_stats_report("server command");
             
             /* Check for more data */
             if ((received = recv(clientsock, buffer, BUFFSIZE, 0)) < 0)
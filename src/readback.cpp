@@ -0,0 +1,142 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+ * No division per entry: wait for the count of the next percent. The last
+ * one is left to the caller, which clears the "[xx%]" field.
+ */
+static void readback_progress(readback *rb, uint32_t locations)
+{
+	rb->read_locations += locations;
+	if (rb->read_locations >= rb->next_percent &&
+			rb->read_locations < rb->total) {
+		uint32_t counter = (uint64_t)rb->read_locations * 100 / rb->total;
+
+		rb->next_percent = ((uint64_t)(counter + 1) * rb->total + 99) / 100;
+		if (flags.client)
+			fprintf(stdout, "@%03d", counter);
+		if (!flags.debug)
+			fprintf(stderr, "\b\b\b\b\b[%2d%%]", counter);
+	}
+}
+
+/* Store one entry, write it out and update the progress */
+void readback_store(readback *rb, readback_entry e)
+{
+	uint16_t low = e.data & 0xFFFF, high = e.data >> 16;
+	bool keep_low = true, keep_high = true;
+
+	if (e.addr & RB_SINGLE) {
+		e.addr &= ~RB_SINGLE;
+		if (rb->skip == RB_KEEP_ALL || low != high) {
+			rb->mem->store(e.addr, low);
+			if (rb->hex)
+				hex_put(rb->hex, e.addr, low);
+		}
+		readback_progress(rb, 1);
+		return;
+	}
+
+	if (rb->skip == RB_SKIP_WORD) {
+		keep_low = keep_high = e.data != rb->blank;
+	} else if (rb->skip == RB_SKIP_HALF) {
+		keep_low = low != (rb->blank & 0xFFFF);
+		keep_high = high != (rb->blank >> 16);
+	}
+
+	if (keep_low) {
+		rb->mem->store(e.addr, low);
+		if (rb->hex)
+			hex_put(rb->hex, e.addr, low);
+	}
+	if (keep_high) {
+		rb->mem->store(e.addr + 1, high);
+		if (rb->hex)
+			hex_put(rb->hex, e.addr + 1, high);
+	}
+
+	readback_progress(rb, 2);
+}
+
+static void *readback_consumer(void *arg)
+{
+	readback *rb = (readback *) arg;
+	uint32_t tail = 0, head;
+	bool done;
+
+	realtime_helper();
+
+	for (;;) {
+		done = rb->done.load(std::memory_order_acquire);
+		head = rb->head.load(std::memory_order_acquire);
+		if (tail == head) {
+			if (done)
+				break;
+			usleep(100);
+			continue;
+		}
+		for (; tail != head; tail++)
+			readback_store(rb, rb->ring[tail & (READBACK_RING - 1)]);
+		rb->tail.store(tail, std::memory_order_release);
+	}
+	return NULL;
+}
+
+/*
+ * Start a readback of total locations into mem and, unless hex is NULL,
+ * into a hex file. The entries are pushed in increasing address order.
+ * With --fulldump the erased locations are kept as well.
+ * Without a consumer thread the producer stores them itself.
+ */
+readback *readback_start(memory *mem, hex_writer *hex, int skip,
+		uint32_t blank, uint32_t total)
+{
+	readback *rb = new readback;
+
+	rb->head.store(0);
+	rb->tail.store(0);
+	rb->done.store(false);
+	rb->mem = mem;
+	rb->hex = hex;
+	rb->skip = flags.fulldump ? RB_KEEP_ALL : skip;
+	rb->blank = blank;
+	rb->total = total ? total : 1;
+	rb->read_locations = 0;
+	rb->next_percent = (rb->total + 99) / 100;
+
+	rb->threaded = pthread_create(&rb->thread, NULL, readback_consumer, rb) == 0;
+	return rb;
+}
+
+/* Wait for the consumer to drain the ring, then close the hex file */
+void readback_finish(readback *rb)
+{
+	if (rb->threaded) {
+		rb->done.store(true, std::memory_order_release);
+		pthread_join(rb->thread, NULL);
+	}
+	if (rb->hex)
+		hex_close(rb->hex);
+	delete rb;
+}
@@ -0,0 +1,95 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READBACK_H_
+#define READBACK_H_
+
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * Readback pipeline: the thread that clocks the words out of the target
+ * (the producer) only pushes them into a ring buffer, and a consumer
+ * thread stores them into the memory image, prints the progress and
+ * writes the hex file, so that the formatting overlaps the bus reads
+ * instead of following them. The consumer runs at SCHED_OTHER and, with
+ * --realtime, off the realtime CPU when there is another one.
+ *
+ * Every entry holds two consecutive locations, the low one first: a PIC32
+ * word or a 24-bit instruction of the 16-bit families. An entry flagged
+ * with RB_SINGLE holds one location (a configuration word, an 8-bit PIC
+ * word) and its own erased value, in place of the second location.
+ */
+#define READBACK_RING	(1 << 16)	/* entries, a power of two */
+
+#define RB_KEEP_ALL		0	/* store every location */
+#define RB_SKIP_WORD	1	/* skip the entries equal to blank */
+#define RB_SKIP_HALF	2	/* skip each location equal to its half of blank */
+
+#define RB_SINGLE		0x80000000	/* addr flag: data = value | erased << 16 */
+
+struct readback_entry {
+	uint32_t addr;				/* first location */
+	uint32_t data;				/* low location | high location << 16 */
+};
+
+struct readback {
+	readback_entry ring[READBACK_RING];
+	std::atomic<uint32_t> head;	/* written by the producer only */
+	std::atomic<uint32_t> tail;	/* written by the consumer only */
+	std::atomic<bool> done;
+	bool threaded;				/* false: the producer stores in place */
+	pthread_t thread;
+
+	memory *mem;
+	hex_writer *hex;			/* NULL: memory image only */
+	int skip;
+	uint32_t blank;
+	uint32_t total, read_locations, next_percent;
+};
+
+readback *readback_start(memory *mem, hex_writer *hex, int skip,
+		uint32_t blank, uint32_t total);
+void readback_store(readback *rb, readback_entry e);
+void readback_finish(readback *rb);
+
+/* Queue two locations; waits while the consumer is a full ring behind */
+static inline void readback_push(readback *rb, uint32_t addr, uint32_t data)
+{
+	uint32_t head = rb->head.load(std::memory_order_relaxed);
+
+	if (!rb->threaded) {
+		readback_store(rb, {addr, data});
+		return;
+	}
+	while (head - rb->tail.load(std::memory_order_acquire) == READBACK_RING)
+		usleep(50);
+	rb->ring[head & (READBACK_RING - 1)] = {addr, data};
+	rb->head.store(head + 1, std::memory_order_release);
+}
+
+/* Queue a single location, left out unless it differs from blank */
+static inline void readback_push_location(readback *rb, uint32_t addr,
+		uint16_t data, uint16_t blank)
+{
+	readback_push(rb, addr | RB_SINGLE, data | (uint32_t)blank << 16);
+}
+
+#endif /* READBACK_H_ */
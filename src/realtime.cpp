@@ -0,0 +1,143 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+#define PREFAULT_STACK	(128 * 1024)
+
+static bool rt_active = false;
+static int rt_old_policy;
+static struct sched_param rt_old_param;
+static cpu_set_t rt_old_cpus;
+static int rt_cpu;
+
+/* Touch the stack the shift loops and the drivers will use */
+static void __attribute__((noinline)) prefault_stack(void)
+{
+	volatile uint8_t stack[PREFAULT_STACK];
+
+	memset((void *)stack, 0, sizeof(stack));
+}
+
+/*
+ * Run the bit-bang critical sections without being preempted: pin the
+ * process on one CPU (by default the last one, usually the one isolated
+ * with isolcpus=), switch to SCHED_FIFO and lock all present and future
+ * pages, so that a clock phase is never stretched by the scheduler or by a
+ * page fault. Failures are reported but not fatal.
+ */
+void realtime_enter(int cpu)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	long page = sysconf(_SC_PAGESIZE);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t off;
+
+	if (rt_active)
+		return;
+
+	if (cpu < 0 || cpu >= ncpus)
+		cpu = ncpus - 1;
+
+	rt_old_policy = sched_getscheduler(0);
+	sched_getparam(0, &rt_old_param);
+	sched_getaffinity(0, sizeof(rt_old_cpus), &rt_old_cpus);
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		perror("Cannot set CPU affinity");
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		perror("Cannot lock memory");
+
+	/* the GPIO mapping is I/O memory: mlockall() does not populate it */
+	for (off = 0; off < BLOCK_SIZE; off += page)
+		(void)gpio[off / sizeof(uint32_t)];
+	prefault_stack();
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+		perror("Cannot switch to SCHED_FIFO");
+
+	rt_cpu = cpu;
+	rt_active = true;
+
+	if (flags.debug)
+		fprintf(stderr, "Realtime: SCHED_FIFO %d on CPU %d\n",
+				param.sched_priority, cpu);
+}
+
+/*
+ * Fault in the pages the memory image already has (those of a hex file
+ * just parsed); the ones allocated later are populated by MCL_FUTURE.
+ */
+void realtime_prefault(memory *mem)
+{
+	if (!rt_active)
+		return;
+
+	mem->pages.prefault();
+}
+
+/* Go back to the scheduling the process was started with */
+void realtime_exit(void)
+{
+	if (!rt_active)
+		return;
+
+	sched_setscheduler(0, rt_old_policy, &rt_old_param);
+	sched_setaffinity(0, sizeof(rt_old_cpus), &rt_old_cpus);
+	munlockall();
+
+	rt_active = false;
+}
+
+/*
+ * Called by the helper threads (hex parser, readback consumer): back to
+ * SCHED_OTHER, so that they never get in the way of the bit-bang thread,
+ * and with --realtime off its CPU, unless it is the only one allowed.
+ */
+void realtime_helper(void)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+
+	memset(&param, 0, sizeof(param));
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+	if (!rt_active)
+		return;
+
+	cpus = rt_old_cpus;
+	CPU_CLR(rt_cpu, &cpus);
+	if (CPU_COUNT(&cpus) > 0)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
@@ -0,0 +1,153 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHIFT_H_
+#define SHIFT_H_
+
+/*
+ * Shift kernels: every ICSP word goes through shift_out()/shift_in(), with
+ * the PGC high and low times given by the driver (timing_param or
+ * pgc_param, hence the templates).
+ *
+ * All the supported families latch PGD on the falling edge of PGC, so a
+ * new data bit is driven together with the rising edge and held for the
+ * whole high time. On hosts providing set/clear mask registers
+ * (GPIO_SET_MASK and friends) a '1' and the rising edge cost a single
+ * store, and PGD is only written when it changes; the other hosts fall
+ * back to the per-pin macros.
+ */
+
+/* Clock out the nbits low bits of bits, LSB or MSB first */
+template <class H, class L>
+static inline void shift_out(uint32_t bits, uint8_t nbits, bool lsb_first,
+		const H &high, const L &low)
+{
+	uint32_t bit = lsb_first ? 1 : 1UL << (nbits - 1);
+	int level = -1;		/* PGD level unknown on entry */
+#ifdef GPIO_SET_MASK
+	const uint32_t clk = GPIO_MASK(pic_clk);
+	const uint32_t dat = pgd_mask();
+#endif
+
+	for (; nbits; nbits--) {
+		if (bits & bit) {
+#ifdef GPIO_SET_MASK
+			GPIO_SET_MASK(clk | dat);
+#else
+			if (level != 1)
+				GPIO_SET(pic_data);
+			GPIO_SET(pic_clk);
+#endif
+			level = 1;
+		}
+		else {
+			if (level != 0) {
+#ifdef GPIO_SET_MASK
+				GPIO_CLR_MASK(dat);
+#else
+				GPIO_CLR(pic_data);
+#endif
+			}
+#ifdef GPIO_SET_MASK
+			GPIO_SET_MASK(clk);
+#else
+			GPIO_SET(pic_clk);
+#endif
+			level = 0;
+		}
+		PGC_EDGE();
+		delay_ns(high);
+
+#ifdef GPIO_SET_MASK
+		GPIO_CLR_MASK(clk);
+#else
+		GPIO_CLR(pic_clk);
+#endif
+		PGC_EDGE();
+		delay_ns(low);
+
+		bit = lsb_first ? bit << 1 : bit >> 1;
+	}
+}
+
+/* Clock in nbits (LSB first), sampling PGD at the end of each high time */
+template <class H, class L>
+static inline uint32_t shift_in(uint8_t nbits, const H &high, const L &low)
+{
+	uint32_t data = 0;
+	uint8_t i;
+#ifdef GPIO_SET_MASK
+	const uint32_t clk = GPIO_MASK(pic_clk);
+	const uint32_t dat = GPIO_MASK(pic_data);
+#endif
+
+	for (i = 0; i < nbits; i++) {
+#ifdef GPIO_SET_MASK
+		GPIO_SET_MASK(clk);
+		PGC_EDGE();
+		delay_ns(high);
+		if (GPIO_LEV_MASK() & dat)
+			data |= 1UL << i;
+		GPIO_CLR_MASK(clk);
+#else
+		GPIO_SET(pic_clk);
+		PGC_EDGE();
+		delay_ns(high);
+		data |= (uint32_t)(GPIO_LEV(pic_data) & 0x01) << i;
+		GPIO_CLR(pic_clk);
+#endif
+		PGC_EDGE();
+		delay_ns(low);
+	}
+
+	return data;
+}
+
+/*
+ * Gang version of shift_in(): one GPLEV0 sample per bit, split into the
+ * word of every target (gang_word[]) during the low time.
+ */
+template <class H, class L>
+static inline void shift_in_gang(uint8_t nbits, const H &high, const L &low)
+{
+#ifdef GPIO_SET_MASK
+	const uint32_t clk = GPIO_MASK(pic_clk);
+	uint32_t lev;
+	uint8_t i;
+	int t;
+
+	for (t = 0; t < gang_count; t++)
+		gang_word[t] = 0;
+
+	for (i = 0; i < nbits; i++) {
+		GPIO_SET_MASK(clk);
+		PGC_EDGE();
+		delay_ns(high);
+		lev = GPIO_LEV_MASK();
+		GPIO_CLR_MASK(clk);
+		PGC_EDGE();
+		for (t = 0; t < gang_count; t++)
+			gang_word[t] |= ((lev >> (gang_data[t] & 0xFF)) & 0x01) << i;
+		delay_ns(low);
+	}
+#endif
+}
+
+#endif /* SHIFT_H_ */
@@ -0,0 +1,848 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef BOARD_SIM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+#define SIM_PINS	64
+
+/*
+ * Pin model: a pin driven by the host reads back its output latch, an
+ * undriven pin keeps its last level (bus keeper), as a disconnected
+ * programming header would.
+ */
+static uint8_t sim_input[SIM_PINS];
+static uint8_t sim_level[SIM_PINS];
+
+/*
+ * Simulated dsPIC33/PIC24 target, selected with PICBERRY_SIM_TARGET=<family>
+ * (the -f name of the driver to exercise). It decodes the ICSP bit stream
+ * seen on the PGC/PGD/MCLR pins: the entry key, SIX (4-bit code and 24-bit
+ * instruction) and REGOUT (4-bit code, 8 idle clocks, VISI out LSB first),
+ * and executes the instructions the drivers use:
+ *   MOV #lit16,Wn - MOV f,Wn - MOV Wn,f - CLR Wn - BSET f,#b
+ *   TBLRDL/TBLRDH/TBLWTL/TBLWTH (.B too) with all the indirect modes
+ *   NOP and GOTO (ignored)
+ * on a 64KB data space (W0..W15 at 0x0000, as on the real parts) and a
+ * sparse flash array. A TBLWT goes to the write latches; a WR of NVMCON,
+ * after the NVMKEY sequence on the families that need it, either bulk
+ * erases or programs the latched words. Latches in the 0xFA0000 page are
+ * programmed at NVMADRU:NVMADR, the others at their own address.
+ *
+ * With the Enhanced ICSP key, a target holding anything in executive memory
+ * (0x800000) answers as a Programming Executive: SCHECK, QVER, READP,
+ * PROGP, ERASEB, QBLANK and CRCP, on the same flash.
+ *
+ * With --gang there is one such target on every PGD of the gang, sharing
+ * PGC and MCLR.
+ *
+ * PICBERRY_SIM_FLASH=<file> keeps the flash contents between runs (<file>.N
+ * for gang target N). At exit
+ * the bus cycles and commands of the session are reported, to compare the
+ * protocol cost of driver changes without a board.
+ */
+struct sim_target {
+	const char *family;
+	const char *name;
+	uint16_t devid;
+	uint16_t devrev;
+	/* SFR byte addresses, 0 when the family does not use the register */
+	uint16_t tblpag, nvmcon, nvmadr, nvmadru, nvmkey, visi;
+	uint16_t bulk_erase;		/* NVMCON value of a bulk erase */
+	uint16_t page_erase;		/* NVMCON value of a page erase */
+	uint32_t page;				/* page size, PC units */
+};
+
+static const struct sim_target sim_targets[] = {
+	{"dspic33f",         "DSPIC33FJ128GP802", 0x062D, 0x3003,
+	 0x032, 0x760, 0,     0,     0,     0x784, 0x404F, 0x4042, 0x400},
+	{"dspic33e",         "dsPIC33EP256MU806", 0x1861, 0x4001,
+	 0x054, 0x728, 0x72A, 0x72C, 0x72E, 0xF88, 0x400E, 0x4003, 0x800},
+	{"pic24fj",          "PIC24FJ128GA606",   0x6000, 0x0001,
+	 0x054, 0x728, 0x72A, 0x72C, 0x72E, 0xF88, 0x400E, 0x4003, 0x800},
+	{"dspic33ckxxmp10x", "dsPIC33CK64MP105",  0x8E12, 0x0001,
+	 0x054, 0x8D0, 0x8D2, 0x8D4, 0x8D6, 0xFCC, 0x400E, 0x4003, 0x800},
+	{"pic24fjxxxga0xx",  "PIC24FJ64GA002",    0x0447, 0x3001,
+	 0x032, 0x760, 0,     0,     0,     0x784, 0x404F, 0x4042, 0x400},
+	{"pic24fjxxga1xx",   "PIC24FJ64GB002",    0x4207, 0x3001,
+	 0x032, 0x760, 0,     0,     0,     0x784, 0x404F, 0x4042, 0x400},
+	{"pic24fxxka1xx",    "PIC24F16KA102",     0x0D03, 0x0001,
+	 0x032, 0x760, 0,     0,     0,     0x784, 0x4064, 0x4058, 0x40},
+};
+
+#define SIM_ICSP_KEY		0x4D434851
+#define SIM_EICSP_KEY		0x4D434850
+#define SIM_EXEC_BASE		0x800000
+#define SIM_EXEC_SIZE		0x1000
+#define SIM_PE_VERSION		0x10
+#define SIM_ENTRY_CLOCKS	5			/* extra clocks of the first SIX */
+#define SIM_LATCH_BASE		0xFA0000
+#define SIM_DEVID_ADDR		0xFF0000
+#define SIM_ERASED			0xFFFFFF
+
+enum sim_state { SIM_RESET, SIM_KEY, SIM_RUN, SIM_ICSP, SIM_PE };
+enum sim_phase { SIM_CODE, SIM_SIX, SIM_REGOUT_IDLE, SIM_REGOUT,
+				 SIM_PE_RX, SIM_PE_TX };
+
+static bool sim_ready = false;
+static const struct sim_target *target = NULL;
+static const char *flash_file = NULL;
+static FILE *report;			/* main() closes stderr before exiting */
+
+/*
+ * One simulated part. In gang mode (--gang) there is one per target: they
+ * share PGC and MCLR, each one has its own PGD and flash.
+ */
+struct sim_chip {
+	int pgd;					/* PGD pin */
+	char file[256];				/* flash contents, see flash_load() */
+
+	enum sim_state state;
+	enum sim_phase phase;
+	uint32_t shreg;				/* bits being shifted in */
+	int nbits;
+	int skip;					/* clocks to ignore after the entry */
+	uint16_t outword;			/* REGOUT word being shifted out */
+	bool out_active;
+
+	uint16_t pe_cmd[0x1000];	/* PE command being received */
+	int pe_words;
+	std::vector<uint16_t> pe_resp;	/* PE response being sent */
+	size_t pe_sent;
+
+	uint8_t ram[0x10000];
+	int key_state;				/* NVMKEY sequence: 0, 0x55 seen, 0xAA seen */
+
+	std::unordered_map<uint32_t, uint32_t> flash;
+	std::map<uint32_t, uint32_t> latch;
+};
+
+static struct sim_chip chips[GANG_MAX];
+static int sim_chips = 0;
+static struct sim_chip *chip;	/* the one the handlers below act on */
+
+static struct {
+	uint64_t pgc;				/* PGC cycles in program mode */
+	uint64_t six;
+	uint64_t regout;
+	uint64_t unknown;			/* instructions not modelled */
+	uint64_t entries;
+	uint64_t erases;
+	uint64_t programs;
+	uint64_t words;				/* flash words programmed */
+	uint64_t locked;			/* WR without the NVMKEY sequence */
+	uint64_t pe;				/* PE commands */
+} stats;
+
+static inline uint16_t rd16(uint32_t a)
+{
+	a &= 0xFFFE;
+	return chip->ram[a] | (chip->ram[a + 1] << 8);
+}
+
+static inline uint8_t rd8(uint32_t a)
+{
+	return chip->ram[a & 0xFFFF];
+}
+
+#define W(n)	rd16(2 * (n))
+
+static void nvm_operation(void);
+
+/* Data space writes, with the side effects of the NVM registers */
+static void wr16(uint32_t a, uint16_t v)
+{
+	a &= 0xFFFE;
+	chip->ram[a] = v & 0xFF;
+	chip->ram[a + 1] = v >> 8;
+
+	if (target->nvmkey && a == target->nvmkey) {
+		if (v == 0x55)
+			chip->key_state = 0x55;
+		else if (v == 0xAA && chip->key_state == 0x55)
+			chip->key_state = 0xAA;
+		else
+			chip->key_state = 0;
+	}
+	else if (a == target->nvmcon && (v & 0x8000))
+		nvm_operation();
+}
+
+static void wr8(uint32_t a, uint8_t v)
+{
+	a &= 0xFFFF;
+	if (a & 1)
+		wr16(a, (rd16(a) & 0x00FF) | (v << 8));
+	else
+		wr16(a, (rd16(a) & 0xFF00) | v);
+}
+
+static uint32_t flash_read(uint32_t addr)
+{
+	std::unordered_map<uint32_t, uint32_t>::iterator f;
+	std::map<uint32_t, uint32_t>::iterator l;
+
+	addr &= ~1;
+	if (addr == SIM_DEVID_ADDR)
+		return target->devid;
+	if (addr == SIM_DEVID_ADDR + 2)
+		return target->devrev;
+	if ((addr & 0xFF0000) == SIM_LATCH_BASE) {
+		l = chip->latch.find(addr);
+		return l == chip->latch.end() ? SIM_ERASED : l->second;
+	}
+
+	f = chip->flash.find(addr);
+	return f == chip->flash.end() ? SIM_ERASED : f->second;
+}
+
+/* Bulk erase, through NVMCON or ERASEB: executive memory survives it */
+static void chip_erase(void)
+{
+	for (auto f = chip->flash.begin(); f != chip->flash.end(); )
+		if (f->first < SIM_EXEC_BASE ||
+				f->first >= SIM_EXEC_BASE + SIM_EXEC_SIZE)
+			f = chip->flash.erase(f);
+		else
+			++f;
+	chip->latch.clear();
+	stats.erases++;
+}
+
+/* WR set in NVMCON: bulk erase, or program whatever is in the latches */
+static void nvm_operation(void)
+{
+	std::map<uint32_t, uint32_t>::iterator l;
+	uint16_t nvmcon = rd16(target->nvmcon);
+	uint32_t base = 0, dest;
+
+	if (target->nvmkey && chip->key_state != 0xAA) {
+		stats.locked++;
+	}
+	else if ((nvmcon & 0x7FFF) == target->bulk_erase) {
+		chip_erase();
+	}
+	else if ((nvmcon & 0x7FFF) == target->page_erase) {
+		/* the page is in NVMADRU:NVMADR, or the one of the last TBLWT */
+		if (target->nvmadr)
+			base = ((uint32_t)rd16(target->nvmadru) << 16) | rd16(target->nvmadr);
+		else if (!chip->latch.empty())
+			base = chip->latch.begin()->first;
+		base &= ~(target->page - 1);
+		for (dest = base; dest < base + target->page; dest += 2)
+			chip->flash.erase(dest);
+		chip->latch.clear();
+		stats.erases++;
+	}
+	else {
+		if (target->nvmadr)
+			base = ((uint32_t)rd16(target->nvmadru) << 16) | rd16(target->nvmadr);
+
+		/* flash cells can only go from 1 to 0 */
+		for (l = chip->latch.begin(); l != chip->latch.end(); ++l) {
+			if ((l->first & 0xFF0000) == SIM_LATCH_BASE)
+				dest = base + (l->first - SIM_LATCH_BASE);
+			else
+				dest = l->first;
+			chip->flash[dest & ~1] = flash_read(dest) & l->second & SIM_ERASED;
+			stats.words++;
+		}
+		chip->latch.clear();
+		stats.programs++;
+	}
+
+	/* the operation completes at once: WR reads back as 0 */
+	chip->key_state = 0;
+	chip->ram[target->nvmcon + 1] &= 0x7F;
+}
+
+/* Effective address of indirect mode 1-5 on Wn, with its side effect */
+static uint16_t ea(int mode, int n, int size)
+{
+	uint16_t w = W(n);
+
+	switch (mode) {
+		case 2:	wr16(2 * n, w - size); break;			/* [Wn--] */
+		case 3:	wr16(2 * n, w + size); break;			/* [Wn++] */
+		case 4:	w -= size; wr16(2 * n, w); break;		/* [--Wn] */
+		case 5:	w += size; wr16(2 * n, w); break;		/* [++Wn] */
+	}
+
+	return w;
+}
+
+/* TBLRDL/TBLRDH/TBLWTL/TBLWTH (.B) */
+static void table_op(uint32_t op)
+{
+	bool write = (op >> 16) == 0xBB;
+	bool high = (op >> 15) & 1;
+	bool byte = (op >> 14) & 1;
+	int q = (op >> 11) & 7, d = (op >> 7) & 0xF;
+	int p = (op >> 4) & 7, s = op & 0xF;
+	int size = byte ? 1 : 2;
+	uint32_t taddr, word, v;
+	uint16_t daddr;
+
+	if (!write) {
+		/* source: table address, destination: data space */
+		taddr = ((uint32_t)rd16(target->tblpag) << 16) | ea(p, s, size);
+		word = flash_read(taddr);
+
+		if (!high)
+			v = byte ? (word >> ((taddr & 1) * 8)) & 0xFF : word & 0xFFFF;
+		else
+			v = (byte && (taddr & 1)) ? 0 : (word >> 16) & 0xFF;
+
+		if (q == 0) {
+			if (byte)
+				wr8(2 * d, v);
+			else
+				wr16(2 * d, v);
+		}
+		else {
+			daddr = ea(q, d, size);
+			if (byte)
+				wr8(daddr, v);
+			else
+				wr16(daddr, v);
+		}
+		return;
+	}
+
+	/* source: data space, destination: table address (the latches) */
+	if (p == 0)
+		v = byte ? W(s) & 0xFF : W(s);
+	else {
+		daddr = ea(p, s, size);
+		v = byte ? rd8(daddr) : rd16(daddr);
+	}
+	taddr = ((uint32_t)rd16(target->tblpag) << 16) | ea(q, d, size);
+
+	word = chip->latch.count(taddr & ~1) ? chip->latch[taddr & ~1] : SIM_ERASED;
+	if (!high) {
+		if (!byte)
+			word = (word & 0xFF0000) | v;
+		else if (taddr & 1)
+			word = (word & 0xFF00FF) | (v << 8);
+		else
+			word = (word & 0xFFFF00) | v;
+	}
+	else if (!byte || !(taddr & 1))
+		word = (word & 0x00FFFF) | ((v & 0xFF) << 16);
+	chip->latch[taddr & ~1] = word;
+}
+
+/* Execute the 24-bit instruction of a SIX command */
+static void execute(uint32_t op)
+{
+	uint16_t f;
+	int bit;
+
+	if ((op & 0xF00000) == 0x200000)				/* MOV #lit16, Wn */
+		wr16(2 * (op & 0xF), (op >> 4) & 0xFFFF);
+	else if ((op & 0xF80000) == 0x880000)			/* MOV Wn, f */
+		wr16(((op >> 4) & 0x7FFF) << 1, W(op & 0xF));
+	else if ((op & 0xF80000) == 0x800000)			/* MOV f, Wn */
+		wr16(2 * (op & 0xF), rd16(((op >> 4) & 0x7FFF) << 1));
+	else if ((op & 0xFFC07F) == 0xEB0000)			/* CLR Wn */
+		wr16(2 * ((op >> 7) & 0xF), 0);
+	else if ((op & 0xFF0000) == 0xA80000) {		/* BSET f, #bit */
+		f = op & 0x1FFE;
+		bit = ((op >> 13) & 7) | ((op & 1) << 3);
+		wr16(f, rd16(f) | (1 << bit));
+	}
+	else if ((op & 0xFE0000) == 0xBA0000)			/* TBLRD, TBLWT */
+		table_op(op);
+	else if (op == 0 || (op & 0xFF0000) == 0x040000)	/* NOP, GOTO */
+		;
+	else {
+		stats.unknown++;
+		if (flags.debug)
+			fprintf(stderr, "\nSim: instruction 0x%06X not modelled\n", op);
+	}
+}
+
+/* Instruction words of flash as the PE packs them, see pe_execute() */
+static void pe_pack(uint32_t addr, uint32_t n)
+{
+	uint32_t i, w0, w1;
+
+	for (i = 0; i + 1 < n; i += 2) {
+		w0 = flash_read(addr + 2 * i);
+		w1 = flash_read(addr + 2 * i + 2);
+		chip->pe_resp.push_back(w0 & 0xFFFF);
+		chip->pe_resp.push_back(((w1 >> 8) & 0xFF00) | (w0 >> 16));
+		chip->pe_resp.push_back(w1 & 0xFFFF);
+	}
+	if (n & 1) {
+		w0 = flash_read(addr + 2 * i);
+		chip->pe_resp.push_back(w0 & 0xFFFF);
+		chip->pe_resp.push_back(w0 >> 16);
+	}
+}
+
+static uint16_t pe_crc(uint32_t addr, uint32_t n)
+{
+	uint16_t crc = 0xFFFF;
+	uint32_t i, word;
+	int b, k;
+
+	for (i = 0; i < n; i++) {
+		word = flash_read(addr + 2 * i);
+		for (b = 0; b < 3; b++) {
+			crc ^= ((word >> (8 * b)) & 0xFF) << 8;
+			for (k = 0; k < 8; k++)
+				crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/*
+ * Execute the command in pe_cmd[] and queue the response: PASS (or NACK),
+ * the echoed opcode and QE code, the length in words, then the data.
+ * Instructions travel two in three words: LSW0, MSB1:MSB0, LSW1.
+ */
+static void pe_execute(void)
+{
+	int op = chip->pe_cmd[0] >> 12, qe = 0;
+	uint32_t addr, n, i, w, v;
+	bool blank;
+
+	chip->pe_resp.assign(2, 0);
+	stats.pe++;
+
+	switch (op) {
+		case 0x0:									/* SCHECK */
+			break;
+		case 0xB:									/* QVER */
+			qe = SIM_PE_VERSION;
+			break;
+		case 0x2:									/* READP */
+			n = chip->pe_cmd[1];
+			addr = ((uint32_t)chip->pe_cmd[2] << 16) | chip->pe_cmd[3];
+			pe_pack(addr, n);
+			break;
+		case 0x5:									/* PROGP */
+			addr = ((uint32_t)chip->pe_cmd[1] << 16) | chip->pe_cmd[2];
+			n = (chip->pe_words - 3) / 3 * 2;
+			for (i = 0; i < n; i += 2) {
+				w = 3 + i / 2 * 3;
+				v = ((uint32_t)(chip->pe_cmd[w + 1] & 0xFF) << 16) | chip->pe_cmd[w];
+				chip->flash[addr + 2 * i] = flash_read(addr + 2 * i) & v;
+				v = ((uint32_t)(chip->pe_cmd[w + 1] >> 8) << 16) | chip->pe_cmd[w + 2];
+				chip->flash[addr + 2 * i + 2] = flash_read(addr + 2 * i + 2) & v;
+			}
+			stats.programs++;
+			stats.words += n;
+			break;
+		case 0x7:									/* ERASEB */
+			chip_erase();
+			break;
+		case 0xA:									/* QBLANK */
+			n = ((uint32_t)chip->pe_cmd[1] << 16) | chip->pe_cmd[2];
+			addr = ((uint32_t)chip->pe_cmd[3] << 16) | chip->pe_cmd[4];
+			blank = true;
+			for (i = 0; i < n && blank; i++)
+				blank = flash_read(addr + 2 * i) == SIM_ERASED;
+			qe = blank ? 0xF0 : 0x0F;
+			break;
+		case 0xC:									/* CRCP */
+			addr = ((uint32_t)chip->pe_cmd[1] << 16) | chip->pe_cmd[2];
+			n = ((uint32_t)chip->pe_cmd[3] << 16) | chip->pe_cmd[4];
+			chip->pe_resp.push_back(pe_crc(addr, n));
+			break;
+		default:
+			chip->pe_resp[0] = 0x3000 | (op << 8);		/* NACK */
+			chip->pe_resp[1] = 2;
+			return;
+	}
+
+	chip->pe_resp[0] = 0x1000 | (op << 8) | qe;
+	chip->pe_resp[1] = chip->pe_resp.size();
+}
+
+/* Enhanced ICSP: only a target with a PE in executive memory answers */
+static void pe_enter(void)
+{
+	uint32_t a;
+
+	chip->state = SIM_RUN;
+	for (a = SIM_EXEC_BASE; a < SIM_EXEC_BASE + SIM_EXEC_SIZE; a += 2)
+		if (chip->flash.count(a))
+			chip->state = SIM_PE;
+	if (chip->state != SIM_PE)
+		return;
+
+	chip->phase = SIM_PE_RX;
+	chip->shreg = 0;
+	chip->nbits = 0;
+	chip->pe_words = 0;
+	stats.entries++;
+}
+
+static void icsp_enter(void)
+{
+	chip->state = SIM_ICSP;
+	chip->phase = SIM_CODE;
+	chip->shreg = 0;
+	chip->nbits = 0;
+	chip->skip = SIM_ENTRY_CLOCKS;
+	chip->key_state = 0;
+	memset(chip->ram, 0, sizeof(chip->ram));
+	chip->latch.clear();
+	stats.entries++;
+}
+
+/*
+ * PE protocol: 16-bit words MSB first, sampled on the falling edge; when a
+ * command is complete the PE drives PGD low (response ready) and shifts
+ * the response out on the rising edges, then releases PGD.
+ */
+static void pe_falling(int pgd)
+{
+	if (chip->phase == SIM_PE_RX) {
+		chip->shreg = (chip->shreg << 1) | pgd;
+		if (++chip->nbits < 16)
+			return;
+		if (chip->pe_words < (int)(sizeof(chip->pe_cmd) / sizeof(chip->pe_cmd[0])))
+			chip->pe_cmd[chip->pe_words++] = chip->shreg & 0xFFFF;
+		chip->shreg = 0;
+		chip->nbits = 0;
+		if (chip->pe_words < (chip->pe_cmd[0] & 0x0FFF))
+			return;
+
+		pe_execute();
+		chip->pe_words = 0;
+		chip->pe_sent = 0;
+		chip->phase = SIM_PE_TX;
+		chip->out_active = true;
+		sim_level[chip->pgd] = 0;
+		return;
+	}
+
+	if (++chip->nbits < 16)
+		return;
+	chip->nbits = 0;
+	if (++chip->pe_sent < chip->pe_resp.size())
+		return;
+	chip->out_active = false;
+	chip->phase = SIM_PE_RX;
+}
+
+/* PGD sampled by the target on the falling edge of PGC */
+static void pgc_falling(int pgd)
+{
+	if (chip->state == SIM_KEY) {
+		chip->shreg = (chip->shreg << 1) | pgd;
+		chip->nbits++;
+		return;
+	}
+	if (chip->state == SIM_PE) {
+		pe_falling(pgd);
+		return;
+	}
+	if (chip->state != SIM_ICSP)
+		return;
+
+	if (chip->skip) {
+		chip->skip--;
+		return;
+	}
+
+	switch (chip->phase) {
+		case SIM_CODE:
+			chip->shreg |= pgd << chip->nbits;
+			if (++chip->nbits < 4)
+				break;
+			if (chip->shreg == 0x0) {
+				chip->phase = SIM_SIX;
+				stats.six++;
+			}
+			else if (chip->shreg == 0x1) {
+				chip->phase = SIM_REGOUT_IDLE;
+				stats.regout++;
+			}
+			else
+				stats.unknown++;
+			chip->shreg = 0;
+			chip->nbits = 0;
+			break;
+		case SIM_SIX:
+			chip->shreg |= (uint32_t)pgd << chip->nbits;
+			if (++chip->nbits < 24)
+				break;
+			execute(chip->shreg);
+			chip->phase = SIM_CODE;
+			chip->shreg = 0;
+			chip->nbits = 0;
+			break;
+		case SIM_REGOUT_IDLE:
+			if (++chip->nbits < 8)
+				break;
+			chip->outword = rd16(target->visi);
+			chip->phase = SIM_REGOUT;
+			chip->nbits = 0;
+			break;
+		case SIM_REGOUT:
+			if (++chip->nbits < 16)
+				break;
+			/* release PGD, the keeper holds the last bit */
+			chip->out_active = false;
+			sim_level[chip->pgd] = (chip->outword >> 15) & 1;
+			chip->phase = SIM_CODE;
+			chip->nbits = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+/* The target drives the REGOUT bits on the rising edge */
+static void pgc_rising(void)
+{
+	if (chip->state == SIM_ICSP || chip->state == SIM_KEY || chip->state == SIM_PE)
+		stats.pgc++;
+
+	if (chip->state == SIM_PE && chip->phase == SIM_PE_TX) {
+		chip->out_active = true;
+		sim_level[chip->pgd] =
+				(chip->pe_resp[chip->pe_sent] >> (15 - chip->nbits)) & 1;
+		return;
+	}
+
+	if (chip->state == SIM_ICSP && chip->phase == SIM_REGOUT) {
+		chip->out_active = true;
+		sim_level[chip->pgd] = (chip->outword >> chip->nbits) & 1;
+	}
+}
+
+static void mclr_edge(int level)
+{
+	if (!level) {
+		/* any low pulse resets the part, the key may follow */
+		chip->state = SIM_KEY;
+		chip->shreg = 0;
+		chip->nbits = 0;
+		chip->out_active = false;
+	}
+	else if (chip->state == SIM_KEY && chip->nbits >= 32 && chip->shreg == SIM_ICSP_KEY)
+		icsp_enter();
+	else if (chip->state == SIM_KEY && chip->nbits >= 32 && chip->shreg == SIM_EICSP_KEY)
+		pe_enter();
+	else
+		chip->state = SIM_RUN;
+}
+
+static void flash_load(void)
+{
+	FILE *fp = fopen(chip->file, "r");
+	unsigned int addr, word;
+
+	if (fp == NULL)
+		return;
+	while (fscanf(fp, "%x %x", &addr, &word) == 2)
+		chip->flash[addr & ~1] = word & SIM_ERASED;
+	fclose(fp);
+}
+
+static void flash_save(void)
+{
+	std::map<uint32_t, uint32_t> sorted(chip->flash.begin(), chip->flash.end());
+	std::map<uint32_t, uint32_t>::iterator f;
+	FILE *fp = fopen(chip->file, "w");
+
+	if (fp == NULL) {
+		perror("Cannot save the simulated flash");
+		return;
+	}
+	for (f = sorted.begin(); f != sorted.end(); ++f)
+		if (f->second != SIM_ERASED)
+			fprintf(fp, "%06X %06X\n", f->first, f->second);
+	fclose(fp);
+}
+
+static void sim_report(void)
+{
+	int c;
+
+	if (flash_file)
+		for (c = 0; c < sim_chips; c++) {
+			chip = &chips[c];
+			flash_save();
+		}
+
+	fprintf(report, "\nSim %s: %llu PGC cycles, %llu SIX, %llu REGOUT, "
+			"%llu entries\n", target->name,
+			(unsigned long long)stats.pgc, (unsigned long long)stats.six,
+			(unsigned long long)stats.regout, (unsigned long long)stats.entries);
+	fprintf(report, "Sim %s: %llu erases, %llu programs (%llu words)",
+			target->name, (unsigned long long)stats.erases,
+			(unsigned long long)stats.programs, (unsigned long long)stats.words);
+	if (stats.pe)
+		fprintf(report, ", %llu PE commands", (unsigned long long)stats.pe);
+	if (stats.locked)
+		fprintf(report, ", %llu locked WR", (unsigned long long)stats.locked);
+	if (stats.unknown)
+		fprintf(report, ", %llu unknown commands", (unsigned long long)stats.unknown);
+	if (sim_chips > 1)
+		fprintf(report, " (%d targets)", sim_chips);
+	fprintf(report, "\n");
+	fclose(report);
+}
+
+/*
+ * One part on PGD, or one per gang target, each one on its own PGD. In
+ * gang mode target N keeps its flash in PICBERRY_SIM_FLASH.N.
+ */
+static void sim_init(void)
+{
+	const char *family = getenv("PICBERRY_SIM_TARGET");
+	unsigned int i;
+	int c;
+
+	sim_ready = true;
+	if (family == NULL)
+		return;
+
+	for (i = 0; i < sizeof(sim_targets) / sizeof(sim_targets[0]); i++)
+		if (strcmp(family, sim_targets[i].family) == 0)
+			target = &sim_targets[i];
+
+	if (target == NULL) {
+		fprintf(stderr, "Unknown simulated target %s, available:", family);
+		for (i = 0; i < sizeof(sim_targets) / sizeof(sim_targets[0]); i++)
+			fprintf(stderr, " %s", sim_targets[i].family);
+		fprintf(stderr, "\n");
+		exit(1);
+	}
+
+	flash_file = getenv("PICBERRY_SIM_FLASH");
+	sim_chips = gang_count ? gang_count : 1;
+	for (c = 0; c < sim_chips; c++) {
+		chip = &chips[c];
+		chip->pgd = ((gang_count ? gang_data[c] : pic_data) & 0xFF) % SIM_PINS;
+		chip->state = SIM_RESET;
+		chip->phase = SIM_CODE;
+		if (flash_file == NULL)
+			continue;
+		if (gang_count)
+			snprintf(chip->file, sizeof(chip->file), "%s.%d", flash_file, c + 1);
+		else
+			snprintf(chip->file, sizeof(chip->file), "%s", flash_file);
+		flash_load();
+	}
+
+	report = fdopen(dup(STDERR_FILENO), "w");
+	if (report != NULL)
+		atexit(sim_report);
+}
+
+void sim_gpio_dir(int g, int input)
+{
+	if (!sim_ready)
+		sim_init();
+	sim_input[(g & 0xFF) % SIM_PINS] = input;
+}
+
+void sim_gpio_write(int g, int level)
+{
+	int pin = (g & 0xFF) % SIM_PINS;
+	int old = sim_level[pin];
+	int c;
+
+	if (!sim_ready)
+		sim_init();
+
+	/* the host does not win against a target driving its PGD */
+	for (c = 0; c < sim_chips; c++)
+		if (chips[c].out_active && pin == chips[c].pgd)
+			return;
+	sim_level[pin] = level;
+
+	if (target == NULL || old == level)
+		return;
+
+	for (c = 0; c < sim_chips; c++) {
+		chip = &chips[c];
+		if (pin == (pic_clk & 0xFF) % SIM_PINS) {
+			if (level)
+				pgc_rising();
+			else
+				pgc_falling(sim_level[chip->pgd]);
+		}
+		else if (pin == (pic_mclr & 0xFF) % SIM_PINS)
+			mclr_edge(level);
+	}
+}
+
+int sim_gpio_read(int g)
+{
+	return sim_level[(g & 0xFF) % SIM_PINS];
+}
+
+/*
+ * Mask accesses, as on the hosts with set/clear registers. PGD changes
+ * before a rising PGC and after a falling one, as seen by the targets
+ * when all the pins switch at once.
+ */
+void sim_gpio_set_mask(uint32_t mask)
+{
+	uint32_t clk = GPIO_MASK(pic_clk), m;
+
+	for (m = mask & ~clk; m; m &= m - 1)
+		sim_gpio_write(__builtin_ctz(m), 1);
+	if (mask & clk)
+		sim_gpio_write(pic_clk, 1);
+}
+
+void sim_gpio_clr_mask(uint32_t mask)
+{
+	uint32_t clk = GPIO_MASK(pic_clk), m;
+
+	if (mask & clk)
+		sim_gpio_write(pic_clk, 0);
+	for (m = mask & ~clk; m; m &= m - 1)
+		sim_gpio_write(__builtin_ctz(m), 0);
+}
+
+uint32_t sim_gpio_lev_mask(void)
+{
+	uint32_t lev = 0;
+	int g;
+
+	for (g = 0; g < 32; g++)
+		lev |= (uint32_t)sim_level[g] << g;
+
+	return lev;
+}
+
+#endif /* BOARD_SIM */
@@ -0,0 +1,92 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include <stdint.h>
+
+/* speed grades, selected at runtime with --timing */
+#define TIMING_SPEC		0	/* datasheet values (default) */
+#define TIMING_FAST		1	/* datasheet minimums, for known-good fixtures */
+#define TIMING_SAFE		2	/* conservative, for long or marginal cables */
+#define TIMING_GRADES	3
+
+/*
+ * Conservative value of a parameter: halfway into its window when it has a
+ * maximum, 1us for sub-microsecond parameters (the pre-nanosecond
+ * behaviour) and 25% of margin for everything else.
+ */
+static constexpr uint32_t timing_safe(uint32_t typ, uint32_t max)
+{
+	return max ? (max > typ ? typ + (max - typ) / 2 : typ) :
+			(typ == 0 ? 0 : (typ < 1000 ? 1000 : typ + typ / 4));
+}
+
+/*
+ * One datasheet timing parameter, in nanoseconds (max = 0: no maximum).
+ * The delay of every speed grade is resolved at compile time, so that a
+ * delay in a shift loop costs a single indexed load from a constant table.
+ */
+struct timing_param {
+	uint32_t min;
+	uint32_t typ;
+	uint32_t max;
+	uint32_t grade[TIMING_GRADES];
+
+	constexpr timing_param(uint32_t mn, uint32_t tp, uint32_t mx)
+		: min(mn), typ(tp), max(mx),
+		  grade{tp, mn, timing_safe(tp, mx)} {}
+
+protected:
+	constexpr timing_param(uint32_t mn, uint32_t tp, uint32_t mx,
+			uint32_t spec, uint32_t fast, uint32_t safe)
+		: min(mn), typ(tp), max(mx), grade{spec, fast, safe} {}
+};
+
+/* at least half of the minimum clock period, rounded up */
+static constexpr uint32_t pgc_half(uint32_t t, uint32_t period)
+{
+	return t > (period + 1) / 2 ? t : (period + 1) / 2;
+}
+
+/*
+ * Half period of the programming clock (PGC high or low time). Kept apart
+ * from the other parameters so that --autotune can override just the bit
+ * rate of a fixture.
+ * The datasheets give a minimum for each phase and a (longer) minimum for
+ * the whole period: no grade goes below half of that period, so that two
+ * phases at their minimum never make a clock faster than the device
+ * accepts. half_min is that floor, which a tuned rate never goes below
+ * either.
+ */
+struct pgc_param : timing_param {
+	uint32_t half_min;
+
+	constexpr pgc_param(uint32_t mn, uint32_t tp, uint32_t mx, uint32_t period = 0)
+		: timing_param(mn, tp, mx, pgc_half(tp, period), pgc_half(mn, period),
+				pgc_half(timing_safe(tp, mx), period)),
+		  half_min(pgc_half(mn, period)) {}
+};
+
+/* delay of parameter p in the currently selected speed grade */
+#define TIMING(p)	((p).grade[flags.timing])
+
+#endif /* TIMING_H_ */
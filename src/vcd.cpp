@@ -0,0 +1,180 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef VCD_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+/*
+ * Ring buffer of events, one uint64_t each: time source ticks << 8, then
+ * the signal index << 1 and the value. 4M events (32MB) hold the last ~1M
+ * PGC cycles of an operation; older events are overwritten.
+ */
+#define VCD_RING_EVENTS		(1 << 22)
+#define VCD_SIGNALS			9		/* 3 lines x level, direction, read */
+
+static const char *vcd_names[VCD_SIGNALS] = {
+	"PGC", "PGD", "MCLR",
+	"PGC_oe", "PGD_oe", "MCLR_oe",
+	"PGC_rd", "PGD_rd", "MCLR_rd",
+};
+
+bool vcd_active = false;
+
+static uint64_t *ring = NULL;
+static uint64_t head;				/* events recorded so far */
+static char *vcd_file = NULL;
+
+/* Allocate (and fault in) the ring; tracing starts right away */
+bool vcd_start(const char *file)
+{
+	ring = (uint64_t *)malloc(VCD_RING_EVENTS * sizeof(uint64_t));
+	if (ring == NULL)
+		return false;
+	memset(ring, 0, VCD_RING_EVENTS * sizeof(uint64_t));
+
+	vcd_file = strdup(file);
+	head = 0;
+	vcd_active = true;
+	atexit(vcd_flush);
+
+	return true;
+}
+
+static inline int vcd_line(int g)
+{
+	if (g == pic_clk)
+		return 0;
+	if (g == pic_data)
+		return 1;
+	if (g == pic_mclr)
+		return 2;
+	return -1;
+}
+
+void vcd_record(int g, int what, int value)
+{
+	int line = vcd_line(g);
+
+	if (line < 0)
+		return;
+	ring[head++ & (VCD_RING_EVENTS - 1)] = (delay_ticks() << 8) |
+			((what * 3 + line) << 1) | (value & 0x01);
+}
+
+void vcd_record_mask(uint32_t mask, int value)
+{
+#ifdef HOST_GPIO_SET_MASK
+	uint64_t ticks = delay_ticks() << 8;
+	int pins[3] = {pic_clk, pic_data, pic_mclr};
+	int line;
+
+	for (line = 0; line < 3; line++)
+		if (mask & GPIO_MASK(pins[line]))
+			ring[head++ & (VCD_RING_EVENTS - 1)] = ticks |
+					((VCD_LEVEL * 3 + line) << 1) | (value & 0x01);
+#endif
+}
+
+/*
+ * Write the ring out as a VCD with a 1ns timescale. Level and direction
+ * signals only get a change record when they change; every read is
+ * recorded, and toggles the "rd" strobe so that repeated reads of the
+ * same level remain visible.
+ */
+void vcd_flush(void)
+{
+	uint64_t first, i, t0, t, last_t = ~0ULL, e;
+	char state[VCD_SIGNALS], strobe = '0', v;
+	time_t now = time(NULL);
+	FILE *fp;
+	int s;
+
+	if (!vcd_active)
+		return;
+	vcd_active = false;
+
+	fp = fopen(vcd_file, "w");
+	if (fp == NULL) {
+		perror("Cannot write the VCD trace");
+		return;
+	}
+
+	first = head > VCD_RING_EVENTS ? head - VCD_RING_EVENTS : 0;
+	t0 = head ? ring[first & (VCD_RING_EVENTS - 1)] >> 8 : 0;
+
+	fprintf(fp, "$date %s$end\n", ctime(&now));
+	fprintf(fp, "$version picberry %s $end\n", VERSION);
+	fprintf(fp, "$comment GPIO accesses on the programming lines (*_oe: 1 = "
+			"output, *_rd: level read back)");
+	if (first)
+		fprintf(fp, ", %llu earlier events dropped",
+				(unsigned long long)first);
+	fprintf(fp, " $end\n");
+	fprintf(fp, "$timescale 1ns $end\n");
+	fprintf(fp, "$scope module picberry $end\n");
+	for (s = 0; s < VCD_SIGNALS; s++)
+		fprintf(fp, "$var wire 1 %c %s $end\n", '!' + s, vcd_names[s]);
+	fprintf(fp, "$var wire 1 %c rd $end\n", '!' + VCD_SIGNALS);
+	fprintf(fp, "$upscope $end\n$enddefinitions $end\n");
+
+	fprintf(fp, "#0\n$dumpvars\n");
+	for (s = 0; s <= VCD_SIGNALS; s++)
+		fprintf(fp, "%c%c\n", s == VCD_SIGNALS ? '0' : 'x', '!' + s);
+	fprintf(fp, "$end\n");
+	memset(state, 'x', sizeof(state));
+
+	for (i = first; i < head; i++) {
+		e = ring[i & (VCD_RING_EVENTS - 1)];
+		s = (e >> 1) & 0x7F;
+		v = '0' + (e & 0x01);
+
+		if (s < 2 * 3 && state[s] == v)
+			continue;
+
+		t = delay_ticks_to_ns((e >> 8) - t0);
+		if (t != last_t) {
+			fprintf(fp, "#%llu\n", (unsigned long long)t);
+			last_t = t;
+		}
+
+		state[s] = v;
+		fprintf(fp, "%c%c\n", v, '!' + s);
+		if (s >= 2 * 3) {
+			strobe = strobe == '0' ? '1' : '0';
+			fprintf(fp, "%c%c\n", strobe, '!' + VCD_SIGNALS);
+		}
+	}
+
+	fclose(fp);
+	fprintf(stderr, "VCD: %llu events written to %s\n",
+			(unsigned long long)(head - first), vcd_file);
+
+	free(ring);
+	ring = NULL;
+}
+
+#endif /* VCD_TRACE */
@@ -0,0 +1,92 @@
+/*
+ * Raspberry Pi PIC Programmer using GPIO connector
+ * https://github.com/WallaceIT/picberry
+ * Copyright 2014 Francesco Valla
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCD_H_
+#define VCD_H_
+
+/*
+ * GPIO access macros. The hosts provide the raw HOST_GPIO_* accessors.
+ * Built with "make <target> VCD_TRACE=1", they are wrapped so that
+ * --trace-vcd can timestamp every access to the PGC, PGD and MCLR lines
+ * into a preallocated ring buffer, written out as a Value Change Dump once
+ * the operation is over; with tracing off the wrappers cost a
+ * predicted-not-taken branch. Without VCD_TRACE they are the bare register
+ * accesses and --trace-vcd is refused.
+ */
+#if defined(VCD_TRACE) && !defined(GPIO_NO_TRACE)
+#define VCD_LEVEL	0	/* level driven by the host */
+#define VCD_DIR		1	/* direction, 1: output */
+#define VCD_READ	2	/* level read back by the host */
+
+extern bool vcd_active;
+
+bool vcd_start(const char *file);
+void vcd_record(int g, int what, int value);
+void vcd_record_mask(uint32_t mask, int value);
+void vcd_flush(void);
+
+#define VCD(g, what, value) \
+	do { if (__builtin_expect(vcd_active, 0)) vcd_record(g, what, value); } while (0)
+
+static inline int gpio_lev_traced(int g, int level)
+{
+	VCD(g, VCD_READ, level);
+	return level;
+}
+
+#define GPIO_IN(g)    do { HOST_GPIO_IN(g);  VCD(g, VCD_DIR, 0); } while (0)
+#define GPIO_OUT(g)   do { HOST_GPIO_OUT(g); VCD(g, VCD_DIR, 1); } while (0)
+#define GPIO_SET(g)   do { HOST_GPIO_SET(g); VCD(g, VCD_LEVEL, 1); } while (0)
+#define GPIO_CLR(g)   do { HOST_GPIO_CLR(g); VCD(g, VCD_LEVEL, 0); } while (0)
+#define GPIO_LEV(g)   gpio_lev_traced(g, (HOST_GPIO_LEV(g)))
+
+#ifdef HOST_GPIO_SET_MASK
+/* in the mask kernels the level read back is the one of PGD */
+static inline uint32_t gpio_lev_mask_traced(uint32_t lev)
+{
+	VCD(pic_data, VCD_READ, (lev >> (pic_data & 0xFF)) & 0x01);
+	return lev;
+}
+
+#define GPIO_SET_MASK(m)   do { HOST_GPIO_SET_MASK(m); \
+		if (__builtin_expect(vcd_active, 0)) vcd_record_mask(m, 1); } while (0)
+#define GPIO_CLR_MASK(m)   do { HOST_GPIO_CLR_MASK(m); \
+		if (__builtin_expect(vcd_active, 0)) vcd_record_mask(m, 0); } while (0)
+#define GPIO_LEV_MASK()    gpio_lev_mask_traced(HOST_GPIO_LEV_MASK())
+#endif /* HOST_GPIO_SET_MASK */
+
+#else
+#define GPIO_IN(g)    HOST_GPIO_IN(g)
+#define GPIO_OUT(g)   HOST_GPIO_OUT(g)
+#define GPIO_SET(g)   HOST_GPIO_SET(g)
+#define GPIO_CLR(g)   HOST_GPIO_CLR(g)
+#define GPIO_LEV(g)   (HOST_GPIO_LEV(g))
+
+#ifdef HOST_GPIO_SET_MASK
+#define GPIO_SET_MASK(m)   HOST_GPIO_SET_MASK(m)
+#define GPIO_CLR_MASK(m)   HOST_GPIO_CLR_MASK(m)
+#define GPIO_LEV_MASK()    HOST_GPIO_LEV_MASK()
+#endif
+
+static inline bool vcd_start(const char *file) { return false; }
+static inline void vcd_flush(void) {}
+#endif /* VCD_TRACE */
+
+#endif /* VCD_H_ */